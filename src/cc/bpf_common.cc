@@ -14,7 +14,13 @@
  * limitations under the License.
  */
 #include "cc/bpf_module.h"
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
 #include "cc/bpf_common.h"
+#include "cc/module_cache.h"
 
 extern "C" {
 void * bpf_module_create_b(const char *filename, const char *proto_filename, unsigned flags) {
@@ -23,6 +29,12 @@ void * bpf_module_create_b(const char *filename, const char *proto_filename, uns
     delete mod;
     return nullptr;
   }
+  if (!(flags & BPF_MODULE_COMPILE_ONLY) && mod->instantiate() != 0) {
+    delete mod;
+    return nullptr;
+  }
+  if (flags & BPF_MODULE_RUNTIME_ONLY)
+    mod->compact();
   return mod;
 }
 
@@ -32,6 +44,12 @@ void * bpf_module_create_c(const char *filename, unsigned flags, const char *cfl
     delete mod;
     return nullptr;
   }
+  if (!(flags & BPF_MODULE_COMPILE_ONLY) && mod->instantiate() != 0) {
+    delete mod;
+    return nullptr;
+  }
+  if (flags & BPF_MODULE_RUNTIME_ONLY)
+    mod->compact();
   return mod;
 }
 
@@ -41,15 +59,95 @@ void * bpf_module_create_c_from_string(const char *text, unsigned flags, const c
     delete mod;
     return nullptr;
   }
+  if (!(flags & BPF_MODULE_COMPILE_ONLY) && mod->instantiate() != 0) {
+    delete mod;
+    return nullptr;
+  }
+  if (flags & BPF_MODULE_RUNTIME_ONLY)
+    mod->compact();
   return mod;
 }
 
+int bpf_module_create_c_batch(const char *texts[], size_t n, unsigned flags,
+                              const char *cflags[], int ncflags, void *modules[],
+                              unsigned nthreads) {
+  if (!nthreads)
+    nthreads = std::max(std::thread::hardware_concurrency(), 1u);
+  nthreads = std::min<size_t>(nthreads, n);
+
+  std::atomic<size_t> next(0);
+  std::atomic<int> failed(0);
+  auto worker = [&]() {
+    for (size_t i = next++; i < n; i = next++) {
+      modules[i] = bpf_module_create_c_from_string(texts[i], flags, cflags, ncflags);
+      if (!modules[i])
+        ++failed;
+    }
+  };
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < nthreads; ++i)
+    threads.emplace_back(worker);
+  worker();
+  for (auto &t : threads)
+    t.join();
+  return failed;
+}
+
 void bpf_module_destroy(void *program) {
   auto mod = static_cast<ebpf::BPFModule *>(program);
   if (!mod) return;
   delete mod;
 }
 
+int bpf_build_type_db(const char *path, const char *headers[], int nheaders,
+                      const char *types[], int ntypes) {
+  std::vector<std::string> h(headers, headers + (headers ? nheaders : 0));
+  std::vector<std::string> t(types, types + (types ? ntypes : 0));
+  return ebpf::BPFModule::build_type_db(path ? path : "", h, t);
+}
+
+int bpf_build_header_archive(const char *path) {
+  return ebpf::BPFModule::build_header_archive(path ? path : "");
+}
+
+int bpf_module_compact(void *program) {
+  auto mod = static_cast<ebpf::BPFModule *>(program);
+  if (!mod) return -1;
+  return mod->compact();
+}
+
+int bpf_module_instantiate(void *program) {
+  auto mod = static_cast<ebpf::BPFModule *>(program);
+  if (!mod) return -1;
+  return mod->instantiate();
+}
+
+int bpf_module_instantiate_from(void *program, void *prev) {
+  auto mod = static_cast<ebpf::BPFModule *>(program);
+  auto prev_mod = static_cast<ebpf::BPFModule *>(prev);
+  if (!mod || !prev_mod) return -1;
+  return mod->instantiate(prev_mod);
+}
+
+int bpf_module_take_exports(void *program, void *prev) {
+  auto mod = static_cast<ebpf::BPFModule *>(program);
+  auto prev_mod = static_cast<ebpf::BPFModule *>(prev);
+  if (!mod || !prev_mod) return -1;
+  return mod->take_exports(prev_mod);
+}
+
+size_t bpf_module_skipped_map_bytes(void *program) {
+  auto mod = static_cast<ebpf::BPFModule *>(program);
+  if (!mod) return 0;
+  return mod->skipped_map_bytes();
+}
+
+int bpf_module_write_object(void *program, const char *path) {
+  auto mod = static_cast<ebpf::BPFModule *>(program);
+  if (!mod) return -1;
+  return mod->write_object(path);
+}
+
 size_t bpf_num_functions(void *program) {
   auto mod = static_cast<ebpf::BPFModule *>(program);
   if (!mod) return 0;
@@ -86,6 +184,35 @@ size_t bpf_function_size_id(void *program, size_t id) {
   return mod->function_size(id);
 }
 
+const char * bpf_function_disasm(void *program, const char *name) {
+  auto mod = static_cast<ebpf::BPFModule *>(program);
+  if (!mod) return nullptr;
+  return mod->function_disasm(name);
+}
+
+const char * bpf_function_cost(void *program, const char *name) {
+  auto mod = static_cast<ebpf::BPFModule *>(program);
+  if (!mod) return nullptr;
+  return mod->function_cost(name);
+}
+
+const char * bpf_function_verifier_report(void *program, const char *name, const char *log) {
+  auto mod = static_cast<ebpf::BPFModule *>(program);
+  if (!mod) return nullptr;
+  return mod->verifier_report(name, log);
+}
+
+int bpf_function_load_batch(void *program, const char *names[], size_t n, int prog_type,
+                            const char *const_names[], const unsigned long long *const_values,
+                            int nconsts, unsigned log_level, unsigned nthreads, int fds[],
+                            const char *logs[]) {
+  auto mod = static_cast<ebpf::BPFModule *>(program);
+  if (!mod) return -1;
+  std::vector<std::string> v(names, names + n);
+  return mod->load_functions(v, prog_type, const_names, const_values, nconsts, log_level,
+                             nthreads, fds, logs);
+}
+
 char * bpf_module_license(void *program) {
   auto mod = static_cast<ebpf::BPFModule *>(program);
   if (!mod) return nullptr;
@@ -98,6 +225,20 @@ unsigned bpf_module_kern_version(void *program) {
   return mod->kern_version();
 }
 
+const char * bpf_module_compile_stats(void *program) {
+  auto mod = static_cast<ebpf::BPFModule *>(program);
+  if (!mod) return nullptr;
+  return mod->compile_stats();
+}
+
+size_t bpf_module_cache_hits(void) {
+  return ebpf::ModuleCache::hits();
+}
+
+size_t bpf_module_cache_misses(void) {
+  return ebpf::ModuleCache::misses();
+}
+
 size_t bpf_num_tables(void *program) {
   auto mod = static_cast<ebpf::BPFModule *>(program);
   if (!mod) return -1;
@@ -222,4 +363,12 @@ int bpf_table_leaf_sscanf(void *program, size_t id, const char *buf, void *leaf)
   return mod->table_leaf_scanf(id, buf, leaf);
 }
 
+int bpf_table_format(void *program, size_t id, int format, const void *keys, const void *leaves,
+                     size_t count, char *buf, size_t buflen) {
+  auto mod = static_cast<ebpf::BPFModule *>(program);
+  if (!mod) return -1;
+  return mod->table_format(id, format & ~BPF_TABLE_FORMAT_HEADER, format & BPF_TABLE_FORMAT_HEADER,
+                           keys, leaves, count, buf, buflen);
+}
+
 }
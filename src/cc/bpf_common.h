@@ -24,18 +24,89 @@
 extern "C" {
 #endif
 
+/* bpf_module_create_* flags, the low byte holds the debug flags. At most one
+ * BPF_MODULE_OPT_* profile may be given, the default is -O3. The profile and
+ * the timing only apply to the BPF program, not to the host side formatters. */
+#define BPF_MODULE_OPT_FAST    0x100  /* -O1, for one-off tools */
+#define BPF_MODULE_OPT_SIZE    0x200  /* -Oz, smallest code for the verifier limits */
+#define BPF_MODULE_OPT_MASK    0x300
+#define BPF_MODULE_TIME_PASSES 0x400  /* print the BPF program's per pass timing to stderr */
+#define BPF_MODULE_RUNTIME_ONLY 0x800 /* bpf_module_compact() once loaded */
+#define BPF_MODULE_COMPILE_ONLY 0x1000 /* no maps until bpf_module_instantiate() */
+#define BPF_MODULE_KERNEL_TYPES 0x2000 /* compile against the type database, not the
+                                          kernel headers. Implied if those are missing. */
+
 void * bpf_module_create_b(const char *filename, const char *proto_filename, unsigned flags);
 void * bpf_module_create_c(const char *filename, unsigned flags, const char *cflags[], int ncflags);
 void * bpf_module_create_c_from_string(const char *text, unsigned flags, const char *cflags[], int ncflags);
+/* Compile the n programs in texts from up to nthreads threads (0 for one per
+ * cpu). modules[i] is set to the module of texts[i], or NULL if it failed to
+ * compile. Returns the number of failures. */
+int bpf_module_create_c_batch(const char *texts[], size_t n, unsigned flags,
+                              const char *cflags[], int ncflags, void *modules[],
+                              unsigned nthreads);
 void bpf_module_destroy(void *program);
+/* Extract the layouts of the kernel types tools use from the headers of the
+ * running kernel, for BPF_MODULE_KERNEL_TYPES. headers and types add to the
+ * default sets. The database is written to path, or if NULL to the module
+ * cache, where it is found for this kernel release. Use $BCC_TYPE_DB to
+ * compile against one at another path. */
+int bpf_build_type_db(const char *path, const char *headers[], int nheaders,
+                      const char *types[], int ntypes);
+/* Snapshot the headers of the running kernel into one indexed archive, which
+ * the compiler maps instead of reading the header tree. It is written to
+ * path, or if NULL to the module cache, where it is also taken on the first
+ * compile and retaken when the headers change. Use $BCC_HEADER_ARCHIVE to
+ * compile against one at another path, or set it empty to read the headers. */
+int bpf_build_header_archive(const char *path);
+/* Free the compiler state of a loaded module, only the function sections and
+ * table metadata are kept. Tables are then formatted from their desc. */
+int bpf_module_compact(void *program);
+/* Create the maps of a module compiled with BPF_MODULE_COMPILE_ONLY and patch
+ * their fds into the functions. Until then table fds are -1. */
+int bpf_module_instantiate(void *program);
+/* Same, but reuse the maps of prev that have the same name, type, size and
+ * key/leaf desc, so that a reloaded program keeps their contents. Fails if a
+ * map of the same name differs. */
+int bpf_module_instantiate_from(void *program, void *prev);
+/* Move the exports of the maps shared that way from prev to program, which
+ * then removes them when destroyed. Call before destroying prev. */
+int bpf_module_take_exports(void *program, void *prev);
+/* Locked memory of the maps that instantiate skipped because no function
+ * references them. They are created on the first bpf_table_fd* call. */
+size_t bpf_module_skipped_map_bytes(void *program);
+int bpf_module_write_object(void *program, const char *path);
 char * bpf_module_license(void *program);
 unsigned bpf_module_kern_version(void *program);
+/* JSON array with wall/cpu time and peak RSS growth per compile phase */
+const char * bpf_module_compile_stats(void *program);
+size_t bpf_module_cache_hits(void);
+size_t bpf_module_cache_misses(void);
 size_t bpf_num_functions(void *program);
 const char * bpf_function_name(void *program, size_t id);
 void * bpf_function_start_id(void *program, size_t id);
 void * bpf_function_start(void *program, const char *name);
 size_t bpf_function_size_id(void *program, size_t id);
 size_t bpf_function_size(void *program, const char *name);
+/* Listing of the function's instructions. Valid until the next call of this,
+ * bpf_function_cost() or bpf_function_verifier_report() on the module. */
+const char * bpf_function_disasm(void *program, const char *name);
+/* JSON object with the static cost of the function: instruction and helper
+ * call counts, longest path and stack usage */
+const char * bpf_function_cost(void *program, const char *name);
+/* JSON object with the verifier log of loading the function broken down per
+ * instruction, see verifier_log.h */
+const char * bpf_function_verifier_report(void *program, const char *name, const char *log);
+/* Load the functions names[i] as programs of prog_type, with the constants
+ * bound as by bpf_bind_consts(), on up to nthreads threads (0 for one per
+ * cpu) so that the kernel verifies them concurrently. fds[i] is the program
+ * fd or -errno. logs[i] is the verifier log at log_level, or for a rejected
+ * program at level 1 if log_level is 0, and is valid until the next call of
+ * this on the module. Returns the number of programs that failed. */
+int bpf_function_load_batch(void *program, const char *names[], size_t n, int prog_type,
+                            const char *const_names[], const unsigned long long *const_values,
+                            int nconsts, unsigned log_level, unsigned nthreads, int fds[],
+                            const char *logs[]);
 size_t bpf_num_tables(void *program);
 size_t bpf_table_id(void *program, const char *table_name);
 int bpf_table_fd(void *program, const char *table_name);
@@ -58,6 +129,19 @@ int bpf_table_leaf_snprintf(void *program, size_t id, char *buf, size_t buflen,
 int bpf_table_key_sscanf(void *program, size_t id, const char *buf, void *key);
 int bpf_table_leaf_sscanf(void *program, size_t id, const char *buf, void *leaf);
 
+#define BPF_TABLE_FORMAT_TEXT 0
+#define BPF_TABLE_FORMAT_JSON 1
+#define BPF_TABLE_FORMAT_CSV 2
+// start csv output with a line of column names
+#define BPF_TABLE_FORMAT_HEADER 0x100
+
+// Format count keys and/or leaves (either may be NULL), stored back to back,
+// into buf with one line per record. Returns the number of records that fit
+// or -1 on error. Only the key_desc/leaf_desc of the table are used, the JIT'd
+// snprintf helpers are not involved.
+int bpf_table_format(void *program, size_t id, int format, const void *keys, const void *leaves,
+                     size_t count, char *buf, size_t buflen);
+
 #ifdef __cplusplus
 }
 #endif
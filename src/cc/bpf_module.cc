@@ -14,18 +14,29 @@
  * limitations under the License.
  */
 #include <algorithm>
+#include <atomic>
+#include <errno.h>
 #include <fcntl.h>
+#include <fstream>
 #include <ftw.h>
+#include <malloc.h>
+#include <iterator>
 #include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
 #include <stdio.h>
+#include <string.h>
 #include <string>
 #include <sys/stat.h>
 #include <sys/utsname.h>
+#include <thread>
 #include <unistd.h>
 #include <vector>
 #include <linux/bpf.h>
 
 #include <llvm/ADT/STLExtras.h>
+#include <llvm/Bitcode/ReaderWriter.h>
 #include <llvm/ExecutionEngine/MCJIT.h>
 #include <llvm/ExecutionEngine/SectionMemoryManager.h>
 #include <llvm/IRReader/IRReader.h>
@@ -38,24 +49,33 @@
 #include <llvm/Object/ObjectFile.h>
 #include <llvm/Support/FormattedStream.h>
 #include <llvm/Support/Host.h>
+#include <llvm/Support/RWMutex.h>
 #include <llvm/Support/SourceMgr.h>
 #include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/Timer.h>
 #include <llvm/Transforms/IPO.h>
 #include <llvm/Transforms/IPO/PassManagerBuilder.h>
 
+#include "bpf_common.h"
 #include "exception.h"
 #include "frontends/b/loader.h"
 #include "frontends/clang/loader.h"
 #include "frontends/clang/b_frontend_action.h"
 #include "bpf_module.h"
+#include "bpf_object.h"
 #include "exported_files.h"
 #include "kbuild_helper.h"
+#include "module_cache.h"
+#include "prog_analysis.h"
+#include "verifier_log.h"
+#include "table_format.h"
 #include "shared_table.h"
 #include "libbpf.h"
 
 namespace ebpf {
 
 using std::get;
+using std::istringstream;
 using std::make_tuple;
 using std::map;
 using std::move;
@@ -100,22 +120,27 @@ class MyMemoryManager : public SectionMemoryManager {
   map<string, tuple<uint8_t *, uintptr_t>> *sections_;
 };
 
+static std::once_flag init_targets_once;
+
 BPFModule::BPFModule(unsigned flags)
-    : flags_(flags), ctx_(new LLVMContext) {
-  InitializeNativeTarget();
-  InitializeNativeTargetAsmPrinter();
-  LLVMInitializeBPFTarget();
-  LLVMInitializeBPFTargetMC();
-  LLVMInitializeBPFTargetInfo();
-  LLVMInitializeBPFAsmPrinter();
-  LLVMLinkInMCJIT(); /* call empty function to force linking of MCJIT */
+    : flags_(flags), ctx_(new LLVMContext), sections_owned_(false), instantiated_(false),
+      skipped_map_bytes_(0) {
+  std::call_once(init_targets_once, []() {
+    InitializeNativeTarget();
+    InitializeNativeTargetAsmPrinter();
+    LLVMInitializeBPFTarget();
+    LLVMInitializeBPFTargetMC();
+    LLVMInitializeBPFTargetInfo();
+    LLVMInitializeBPFAsmPrinter();
+    LLVMLinkInMCJIT(); /* call empty function to force linking of MCJIT */
+  });
 }
 
 BPFModule::~BPFModule() {
   engine_.reset();
-  rw_engine_.reset();
+  rw_.clear();
   ctx_.reset();
-  if (tables_) {
+  if (tables_ && instantiated_) {
     for (auto table : *tables_) {
       if (table.is_shared)
         SharedTables::instance()->remove_fd(table.name);
@@ -307,7 +332,7 @@ Function * BPFModule::make_writer(Module *mod, Type *type) {
 unique_ptr<ExecutionEngine> BPFModule::finalize_rw(unique_ptr<Module> m) {
   Module *mod = &*m;
 
-  run_pass_manager(*mod);
+  run_pass_manager(*mod, false);
 
   string err;
   EngineBuilder builder(move(m));
@@ -321,61 +346,151 @@ unique_ptr<ExecutionEngine> BPFModule::finalize_rw(unique_ptr<Module> m) {
 
 // load an entire c file as a module
 int BPFModule::load_cfile(const string &file, bool in_memory, const char *cflags[], int ncflags) {
-  clang_loader_ = make_unique<ClangLoader>(&*ctx_, flags_);
+  clang_loader_ = make_unique<ClangLoader>(&*ctx_, flags_, &stats_);
   if (clang_loader_->parse(&mod_, &tables_, file, in_memory, cflags, ncflags))
     return -1;
   return 0;
 }
 
+int BPFModule::build_type_db(const string &path, const vector<string> &headers,
+                             const vector<string> &types) {
+  ClangLoader loader(nullptr, 0);
+  return loader.build_type_db(path, headers, types);
+}
+
+int BPFModule::build_header_archive(const string &path) {
+  return ClangLoader::build_header_archive(path);
+}
+
 // NOTE: this is a duplicate of the above, but planning to deprecate if we
 // settle on clang as the frontend
 
 // Load in a pre-built list of functions into the initial Module object, then
 // build an ExecutionEngine.
 int BPFModule::load_includes(const string &text) {
-  clang_loader_ = make_unique<ClangLoader>(&*ctx_, flags_);
+  clang_loader_ = make_unique<ClangLoader>(&*ctx_, flags_, &stats_);
   if (clang_loader_->parse(&mod_, &tables_, text, true, nullptr, 0))
     return -1;
   return 0;
 }
 
 int BPFModule::annotate() {
+  CompileStats::Timer timer(&stats_, "annotate");
   for (auto fn = mod_->getFunctionList().begin(); fn != mod_->getFunctionList().end(); ++fn)
     fn->addFnAttr(Attribute::AlwaysInline);
 
-  // separate module to hold the reader functions
-  auto m = make_unique<Module>("sscanf", *ctx_);
-
+  // only remember the key/leaf types, the reader and writer functions are
+  // generated by table_rw() when first used
   size_t id = 0;
+  rw_types_.assign(tables_->size(), std::make_pair(nullptr, nullptr));
+  rw_.resize(tables_->size());
   for (auto &table : *tables_) {
-    table_names_[table.name] = id++;
+    size_t table_id = id++;
+    table_names_[table.name] = table_id;
     GlobalValue *gvar = mod_->getNamedValue(table.name);
     if (!gvar) continue;
     if (PointerType *pt = dyn_cast<PointerType>(gvar->getType())) {
       if (StructType *st = dyn_cast<StructType>(pt->getElementType())) {
         if (st->getNumElements() < 2) continue;
-        Type *key_type = st->elements()[0];
-        Type *leaf_type = st->elements()[1];
-        table.key_sscanf = make_reader(&*m, key_type);
-        if (!table.key_sscanf)
-          errs() << "Failed to compile sscanf for " << *key_type << "\n";
-        table.leaf_sscanf = make_reader(&*m, leaf_type);
-        if (!table.leaf_sscanf)
-          errs() << "Failed to compile sscanf for " << *leaf_type << "\n";
-        table.key_snprintf = make_writer(&*m, key_type);
-        if (!table.key_snprintf)
-          errs() << "Failed to compile snprintf for " << *key_type << "\n";
-        table.leaf_snprintf = make_writer(&*m, leaf_type);
-        if (!table.leaf_snprintf)
-          errs() << "Failed to compile snprintf for " << *leaf_type << "\n";
+        rw_types_[table_id] = std::make_pair(st->elements()[0], st->elements()[1]);
       }
     }
   }
 
-  rw_engine_ = finalize_rw(move(m));
-  if (rw_engine_)
-    rw_engine_->finalizeObject();
+  return 0;
+}
+
+// Generate and JIT the formatters of a table. Most tables are never printed
+// (perf outputs, stack traces, ...), so this is deferred to the first
+// table_{key,leaf}_{printf,scanf} call and done one table at a time.
+const BPFModule::TableRW * BPFModule::table_rw(size_t id) {
+  TableRW &rw = rw_[id];
+  if (rw.engine)
+    return &rw;
+  TableDesc &table = (*tables_)[id];
+  Type *key_type = rw_types_[id].first;
+  Type *leaf_type = rw_types_[id].second;
+  if (!key_type || !leaf_type)
+    return nullptr;
+
+  CompileStats::Timer timer(&stats_, "rw_jit");
+  // separate module to hold the reader functions
+  auto m = make_unique<Module>("sscanf", *ctx_);
+  readers_.clear();
+  writers_.clear();
+  table.key_sscanf = make_reader(&*m, key_type);
+  if (!table.key_sscanf)
+    errs() << "Failed to compile sscanf for " << *key_type << "\n";
+  table.leaf_sscanf = make_reader(&*m, leaf_type);
+  if (!table.leaf_sscanf)
+    errs() << "Failed to compile sscanf for " << *leaf_type << "\n";
+  table.key_snprintf = make_writer(&*m, key_type);
+  if (!table.key_snprintf)
+    errs() << "Failed to compile snprintf for " << *key_type << "\n";
+  table.leaf_snprintf = make_writer(&*m, leaf_type);
+  if (!table.leaf_snprintf)
+    errs() << "Failed to compile snprintf for " << *leaf_type << "\n";
+  readers_.clear();
+  writers_.clear();
+
+  rw.engine = finalize_rw(move(m));
+  if (!rw.engine) {
+    table.key_sscanf = table.leaf_sscanf = table.key_snprintf = table.leaf_snprintf = nullptr;
+    return nullptr;
+  }
+  rw.engine->finalizeObject();
+  // resolve once, the per call lookups showed up when dumping large tables
+  if (table.key_sscanf)
+    rw.key_sscanf = rw.engine->getPointerToFunction(table.key_sscanf);
+  if (table.leaf_sscanf)
+    rw.leaf_sscanf = rw.engine->getPointerToFunction(table.leaf_sscanf);
+  if (table.key_snprintf)
+    rw.key_snprintf = rw.engine->getPointerToFunction(table.key_snprintf);
+  if (table.leaf_snprintf)
+    rw.leaf_snprintf = rw.engine->getPointerToFunction(table.leaf_snprintf);
+  return &rw;
+}
+
+// Parse the key or leaf desc of a table on first use
+TableFormat * BPFModule::table_formatter(size_t id, bool leaf) {
+  TableRW &rw = rw_[id];
+  unique_ptr<TableFormat> &fmt = leaf ? rw.leaf_format : rw.key_format;
+  if (fmt)
+    return &*fmt;
+  const TableDesc &desc = (*tables_)[id];
+  fmt = TableFormat::create(leaf ? desc.leaf_desc : desc.key_desc);
+  // the desc carries no packing attributes, refuse to guess
+  if (!fmt || fmt->size() != (leaf ? desc.leaf_size : desc.key_size)) {
+    fprintf(stderr, "Cannot format %s of table %s\n", leaf ? "leaves" : "keys", desc.name.c_str());
+    fmt.reset();
+    return nullptr;
+  }
+  return &*fmt;
+}
 
+// the JIT'd helpers are gone after compact(), format as described by the desc
+int BPFModule::native_printf(size_t id, bool leaf, char *buf, size_t buflen, const void *rec) {
+  TableFormat *fmt = table_formatter(id, leaf);
+  if (!fmt)
+    return -1;
+  FormatBuf out(buf, buflen);
+  if (!fmt->format(TableFormat::TEXT, (const uint8_t *)rec, &out)) {
+    fprintf(stderr, "snprintf ran out of buffer space\n");
+    return -1;
+  }
+  out.terminate();
+  return 0;
+}
+
+int BPFModule::native_scanf(size_t id, bool leaf, const char *str, void *rec) {
+  TableFormat *fmt = table_formatter(id, leaf);
+  if (!fmt)
+    return -1;
+  if (!fmt->scan(str, (uint8_t *)rec)) {
+    fprintf(stderr, "Cannot parse %s of table %s\n", leaf ? "leaf" : "key",
+            (*tables_)[id].name.c_str());
+    return -1;
+  }
   return 0;
 }
 
@@ -385,7 +500,9 @@ void BPFModule::dump_ir(Module &mod) {
   PM.run(mod);
 }
 
-int BPFModule::run_pass_manager(Module &mod) {
+// The optimization profile and the pass timing are those of the BPF program,
+// the host side formatters (!bpf) always get -O3 and are not timed.
+int BPFModule::run_pass_manager(Module &mod, bool bpf) {
   if (verifyModule(mod, &errs())) {
     if (flags_ & 1)
       dump_ir(mod);
@@ -394,13 +511,38 @@ int BPFModule::run_pass_manager(Module &mod) {
 
   legacy::PassManager PM;
   PassManagerBuilder PMB;
-  PMB.OptLevel = 3;
-  PM.add(createFunctionInliningPass());
+  // annotate() marks every function always_inline, BPF has no calls
+  switch (bpf ? flags_ & BPF_MODULE_OPT_MASK : 0) {
+    case BPF_MODULE_OPT_FAST:
+      PMB.OptLevel = 1;
+      break;
+    case BPF_MODULE_OPT_SIZE:
+      PMB.OptLevel = 2;
+      PMB.SizeLevel = 2;
+      break;
+    default:
+      PMB.OptLevel = 3;
+      PM.add(createFunctionInliningPass());
+      break;
+  }
   PM.add(createAlwaysInlinerPass());
   PMB.populateModulePassManager(PM);
   if (flags_ & 1)
     PM.add(createPrintModulePass(outs()));
-  PM.run(mod);
+
+  // the pass timers are process wide: a timed run excludes every other run,
+  // untimed ones only share the lock so that they don't record into them
+  static llvm::sys::SmartRWMutex<true> time_passes_mutex;
+  if (bpf && (flags_ & BPF_MODULE_TIME_PASSES)) {
+    llvm::sys::SmartScopedWriter<true> lock(time_passes_mutex);
+    TimePassesIsEnabled = true;
+    PM.run(mod);
+    TimePassesIsEnabled = false;
+    TimerGroup::printAll(errs());
+  } else {
+    llvm::sys::SmartScopedReader<true> lock(time_passes_mutex);
+    PM.run(mod);
+  }
   return 0;
 }
 
@@ -422,10 +564,14 @@ int BPFModule::finalize() {
     return -1;
   }
 
-  if (int rc = run_pass_manager(*mod))
+  CompileStats::Timer opt_timer(&stats_, "opt");
+  if (int rc = run_pass_manager(*mod, true))
     return rc;
+  opt_timer.stop();
 
+  CompileStats::Timer codegen_timer(&stats_, "bpf_codegen");
   engine_->finalizeObject();
+  codegen_timer.stop();
 
   // give functions an id
   for (auto section : sections_)
@@ -479,6 +625,121 @@ size_t BPFModule::function_size(const string &name) const {
   return get<1>(section->second);
 }
 
+const char * BPFModule::function_disasm(const string &name) {
+  uint8_t *start = function_start(name);
+  if (!start)
+    return nullptr;
+  analysis_ = disassemble((const struct bpf_insn *)start, function_size(name) / sizeof(struct bpf_insn));
+  return analysis_.c_str();
+}
+
+const char * BPFModule::function_cost(const string &name) {
+  uint8_t *start = function_start(name);
+  if (!start)
+    return nullptr;
+  analysis_ = ProgCost::analyze((const struct bpf_insn *)start,
+                                function_size(name) / sizeof(struct bpf_insn)).json();
+  return analysis_.c_str();
+}
+
+const char * BPFModule::verifier_report(const string &name, const char *log) {
+  uint8_t *start = function_start(name);
+  if (!start || !log)
+    return nullptr;
+  // index the listing by instruction, it names the helpers and maps the way
+  // the source does rather than by kernel internals
+  map<unsigned, string> listing;
+  istringstream lines(disassemble((const struct bpf_insn *)start,
+                                  function_size(name) / sizeof(struct bpf_insn)));
+  string line;
+  while (getline(lines, line)) {
+    unsigned idx;
+    int n = -1;
+    if (sscanf(line.c_str(), " %u: (%*x) %n", &idx, &n) == 1 && n > 0)
+      listing[idx] = line.substr(n);
+  }
+  analysis_ = VerifierLog::parse(log).json(&listing);
+  return analysis_.c_str();
+}
+
+// Load one function with the constants bound in a copy. The log buffer grows
+// until the log fits, and a rejected function is loaded once more with the
+// log on if it was off. Returns the fd or -errno.
+int BPFModule::load_function(const string &name, int prog_type, const char *const_names[],
+                             const unsigned long long *const_values, int nconsts,
+                             unsigned log_level, string *log) const {
+  uint8_t *start = function_start(name);
+  if (!start) {
+    *log = "Unknown program " + name;
+    return -ENOENT;
+  }
+  size_t size = function_size(name);
+  vector<struct bpf_insn> insns(size / sizeof(struct bpf_insn));
+  memcpy(insns.data(), start, insns.size() * sizeof(struct bpf_insn));
+  int unbound = bpf_bind_consts(insns.data(), insns.size(), const_names, const_values, nconsts);
+  if (unbound < 0) {
+    *log = "Out of memory binding the constants";
+    return -ENOMEM;
+  }
+  if (unbound) {
+    *log = std::to_string(unbound) + " uses of constants without a value";
+    return -EINVAL;
+  }
+
+  vector<char> buf(log_level ? 65536 : 0);
+  while (true) {
+    int fd = bpf_prog_load_level((enum bpf_prog_type)prog_type, insns.data(),
+                                 insns.size() * sizeof(struct bpf_insn), license(), kern_version(),
+                                 log_level, buf.empty() ? nullptr : buf.data(), buf.size());
+    int err = errno;
+    if (fd < 0 && !log_level) {
+      log_level = 1;
+      buf.resize(65536);
+      continue;
+    }
+    if (fd < 0 && err == ENOSPC && buf.size() < BPF_LOG_BUF_MAX) {
+      buf.resize(std::min<size_t>(buf.size() * 2, BPF_LOG_BUF_MAX));
+      continue;
+    }
+    if (!buf.empty())
+      *log = buf.data();
+    return fd < 0 ? -err : fd;
+  }
+}
+
+int BPFModule::load_functions(const vector<string> &names, int prog_type,
+                              const char *const_names[], const unsigned long long *const_values,
+                              int nconsts, unsigned log_level, unsigned nthreads, int fds[],
+                              const char *logs[]) {
+  size_t n = names.size();
+  load_logs_.assign(n, string());
+  if (!nthreads)
+    nthreads = std::max(std::thread::hardware_concurrency(), 1u);
+  nthreads = std::min<size_t>(nthreads, n);
+
+  // the verifier runs in the calling thread, so programs are verified
+  // concurrently by loading them from several
+  std::atomic<size_t> next(0);
+  std::atomic<int> failed(0);
+  auto worker = [&]() {
+    for (size_t i = next++; i < n; i = next++) {
+      fds[i] = load_function(names[i], prog_type, const_names, const_values, nconsts, log_level,
+                             &load_logs_[i]);
+      if (fds[i] < 0)
+        ++failed;
+    }
+  };
+  vector<std::thread> threads;
+  for (unsigned i = 1; i < nthreads; ++i)
+    threads.emplace_back(worker);
+  worker();
+  for (auto &t : threads)
+    t.join();
+  for (size_t i = 0; i < n; ++i)
+    logs[i] = load_logs_[i].c_str();
+  return failed;
+}
+
 char * BPFModule::license() const {
   auto section = sections_.find("license");
   if (section == sections_.end())
@@ -495,6 +756,213 @@ unsigned BPFModule::kern_version() const {
   return *(unsigned *)get<0>(section->second);
 }
 
+// Rough locked memory of a map, its keys and values. The kernel adds its own
+// per element overhead on top.
+static size_t map_bytes(const TableDesc &table) {
+  size_t leaf_size = table.leaf_size;
+  if (table.type == BPF_MAP_TYPE_PERCPU_HASH || table.type == BPF_MAP_TYPE_PERCPU_ARRAY) {
+    long ncpus = sysconf(_SC_NPROCESSORS_CONF);
+    leaf_size = (leaf_size + 7) / 8 * 8 * (ncpus > 0 ? ncpus : 1);
+  }
+  return (table.key_size + leaf_size) * table.max_entries;
+}
+
+// Copy the sections out of the JIT memory, which is read-only once finalized
+void BPFModule::own_sections() {
+  if (sections_owned_)
+    return;
+  for (auto &section : sections_) {
+    size_t size = get<1>(section.second);
+    unique_ptr<uint8_t[]> buf(new uint8_t[size]);
+    memcpy(buf.get(), get<0>(section.second), size);
+    section.second = make_tuple(buf.get(), size);
+    section_bufs_.push_back(move(buf));
+  }
+  sections_owned_ = true;
+}
+
+// whether a map made for a can hold b's data: type, sizes and descriptions
+static bool same_layout(const TableDesc &a, const TableDesc &b) {
+  return a.type == b.type && a.key_size == b.key_size && a.leaf_size == b.leaf_size &&
+      a.max_entries == b.max_entries && a.key_desc == b.key_desc && a.leaf_desc == b.leaf_desc;
+}
+
+// The frontend only records the tables and refers to each with a placeholder
+// fd (its index). Create the maps, look up the extern ones, export the shared
+// ones and patch the fds into the functions. On failure nothing is left open.
+// With prev, share its maps of the same name and layout so that a reloaded
+// program keeps the data accumulated so far. The maps prev exports stay its
+// own until take_exports().
+int BPFModule::instantiate(BPFModule *prev) {
+  if (instantiated_)
+    return 0;
+  if (sections_.empty()) {
+    fprintf(stderr, "Program not loaded\n");
+    return -1;
+  }
+  if (prev && !prev->instantiated_) {
+    fprintf(stderr, "Cannot reuse the maps of a module that has none\n");
+    return -1;
+  }
+  CompileStats::Timer timer(&stats_, "instantiate");
+  vector<TableDesc> &tables = *tables_;
+
+  // tables that were optimized out of every function are created on the first
+  // table_fd() call instead, most are never asked for
+  std::set<int> used_fds;
+  for (auto &name : function_names_) {
+    auto &section = sections_[name];
+    const struct bpf_insn *insns = (const struct bpf_insn *)get<0>(section);
+    size_t cnt = get<1>(section) / sizeof(struct bpf_insn);
+    for (size_t i = 0; i < cnt; ++i) {
+      if (insns[i].code != (BPF_LD | BPF_DW | BPF_IMM))
+        continue;
+      if (insns[i].src_reg == BPF_PSEUDO_MAP_FD)
+        used_fds.insert(insns[i].imm);
+      ++i;
+    }
+  }
+
+  vector<int> new_fds(tables.size(), -1);
+  vector<TableDesc *> reused(tables.size(), nullptr);
+  size_t ncreated = 0;
+  size_t skipped_bytes = 0;
+  for (auto &table : tables) {
+    int fd = -1;
+    TableDesc *old = nullptr;
+    if (prev && !table.is_extern) {
+      size_t id = prev->table_id(table.name);
+      if (id < prev->tables_->size() && !(*prev->tables_)[id].is_extern)
+        old = &(*prev->tables_)[id];
+    }
+    if (old && !same_layout(table, *old)) {
+      fprintf(stderr, "bpf map %s does not match the one it replaces\n", table.name.c_str());
+      break;
+    }
+    if (old && old->fd >= 0) {
+      fd = old->fd;
+      reused[ncreated] = old;
+    } else if (table.is_extern) {
+      fd = SharedTables::instance()->lookup_fd(table.name);
+      if (fd < 0) {
+        fprintf(stderr, "could not find extern table %s\n", table.name.c_str());
+        break;
+      }
+    } else if (!table.is_shared && !used_fds.count(table.fd)) {
+      skipped_bytes += map_bytes(table);
+    } else {
+      fd = bpf_create_map((bpf_map_type)table.type, table.key_size, table.leaf_size,
+                          table.max_entries);
+      if (fd < 0) {
+        fprintf(stderr, "could not open bpf map %s: %s\n", table.name.c_str(), strerror(errno));
+        break;
+      }
+    }
+    new_fds[ncreated++] = fd;
+  }
+  // a reused map that prev exports is already exported
+  auto inherits_export = [&](size_t i) { return reused[i] && reused[i]->is_shared; };
+  size_t nexported = 0;
+  if (ncreated == tables.size()) {
+    for (size_t i = 0; i < tables.size(); ++i) {
+      if (tables[i].is_shared && !inherits_export(i) &&
+          !SharedTables::instance()->insert_fd(tables[i].name, new_fds[i])) {
+        fprintf(stderr, "could not export bpf map %s: already in use\n", tables[i].name.c_str());
+        break;
+      }
+      ++nexported;
+    }
+  }
+  if (nexported != tables.size()) {
+    for (size_t i = 0; i < ncreated; ++i) {
+      if (i < nexported && tables[i].is_shared && !inherits_export(i))
+        SharedTables::instance()->remove_fd(tables[i].name);
+      else if (!tables[i].is_extern && !reused[i] && new_fds[i] >= 0)
+        close(new_fds[i]);
+    }
+    return -1;
+  }
+  for (size_t i = 0; i < tables.size(); ++i) {
+    if (inherits_export(i))
+      tables[i].is_shared = false;
+  }
+
+  vector<int> old_fds, relocated_fds;
+  for (size_t i = 0; i < tables.size(); ++i) {
+    if (new_fds[i] < 0)
+      continue;
+    old_fds.push_back(tables[i].fd);
+    relocated_fds.push_back(new_fds[i]);
+  }
+  own_sections();
+  for (auto &name : function_names_) {
+    auto &section = sections_[name];
+    bpf_relocate_map_fds((struct bpf_insn *)get<0>(section), get<1>(section) / sizeof(struct bpf_insn),
+                         old_fds.data(), relocated_fds.data(), old_fds.size());
+  }
+  for (size_t i = 0; i < tables.size(); ++i)
+    tables[i].fd = new_fds[i];
+  skipped_map_bytes_ = skipped_bytes;
+  instantiated_ = true;
+  return 0;
+}
+
+// Removing an export closes the map, so the exports of the maps shared with
+// prev have to move here before prev is destroyed.
+int BPFModule::take_exports(BPFModule *prev) {
+  if (!instantiated_ || !prev->instantiated_)
+    return -1;
+  for (auto &table : *tables_) {
+    size_t id = prev->table_id(table.name);
+    if (id >= prev->tables_->size())
+      continue;
+    TableDesc &old = (*prev->tables_)[id];
+    if (old.is_shared && !old.is_extern && !table.is_extern && old.fd == table.fd) {
+      old.is_shared = false;
+      table.is_shared = true;
+    }
+  }
+  return 0;
+}
+
+// Keep only what a loaded module needs at runtime: the function sections are
+// copied out of the JIT memory and the formatters switch to TableFormat, then
+// the LLVM context, engines and frontends are released.
+int BPFModule::compact() {
+  if (!ctx_)
+    return 0;
+  if (sections_.empty()) {
+    fprintf(stderr, "Program not loaded\n");
+    return -1;
+  }
+  own_sections();
+
+  for (auto &table : *tables_)
+    table.key_sscanf = table.leaf_sscanf = table.key_snprintf = table.leaf_snprintf = nullptr;
+  for (auto &rw : rw_) {
+    rw.engine.reset();
+    rw.key_sscanf = rw.leaf_sscanf = rw.key_snprintf = rw.leaf_snprintf = nullptr;
+  }
+  readers_.clear();
+  writers_.clear();
+  rw_types_.clear();
+  engine_.reset();
+  b_loader_.reset();
+  clang_loader_.reset();
+  mod_.reset();
+  ctx_.reset();
+#ifdef __GLIBC__
+  // most of it was small allocations, give the freed arenas back
+  malloc_trim(0);
+#endif
+  return 0;
+}
+
+const char * BPFModule::compile_stats() {
+  stats_json_ = stats_.json();
+  return stats_json_.c_str();
+}
+
 size_t BPFModule::num_tables() const {
   return tables_->size();
 }
@@ -505,13 +973,30 @@ size_t BPFModule::table_id(const string &name) const {
   return it->second;
 }
 
-int BPFModule::table_fd(const string &name) const {
+int BPFModule::table_fd(const string &name) {
   return table_fd(table_id(name));
 }
 
-int BPFModule::table_fd(size_t id) const {
+int BPFModule::table_fd(size_t id) {
   if (id >= tables_->size()) return -1;
-  return (*tables_)[id].fd;
+  // before instantiate() the fd is only a placeholder
+  if (!instantiated_) return -1;
+  TableDesc &table = (*tables_)[id];
+  if (table.fd < 0 && !table.is_extern) {
+    // skipped by instantiate(), no function uses it
+    table.fd = bpf_create_map((bpf_map_type)table.type, table.key_size, table.leaf_size,
+                              table.max_entries);
+    if (table.fd < 0) {
+      fprintf(stderr, "could not open bpf map %s: %s\n", table.name.c_str(), strerror(errno));
+      return -1;
+    }
+    skipped_map_bytes_ -= map_bytes(table);
+  }
+  return table.fd;
+}
+
+size_t BPFModule::skipped_map_bytes() const {
+  return skipped_map_bytes_;
 }
 
 int BPFModule::table_type(const string &name) const {
@@ -583,16 +1068,14 @@ struct TableIterator {
 
 int BPFModule::table_key_printf(size_t id, char *buf, size_t buflen, const void *key) {
   if (id >= tables_->size()) return -1;
-  const TableDesc &desc = (*tables_)[id];
-  if (!desc.key_snprintf) {
+  if (!ctx_)
+    return native_printf(id, false, buf, buflen, key);
+  const TableRW *rw = table_rw(id);
+  if (!rw || !rw->key_snprintf) {
     fprintf(stderr, "Key snprintf not available\n");
     return -1;
   }
-  snprintf_fn fn = (snprintf_fn)rw_engine_->getPointerToFunction(desc.key_snprintf);
-  if (!fn) {
-    fprintf(stderr, "Key snprintf not available in JIT Engine\n");
-    return -1;
-  }
+  snprintf_fn fn = (snprintf_fn)rw->key_snprintf;
   int rc = (*fn)(buf, buflen, key);
   if (rc < 0) {
     perror("snprintf");
@@ -607,16 +1090,14 @@ int BPFModule::table_key_printf(size_t id, char *buf, size_t buflen, const void
 
 int BPFModule::table_leaf_printf(size_t id, char *buf, size_t buflen, const void *leaf) {
   if (id >= tables_->size()) return -1;
-  const TableDesc &desc = (*tables_)[id];
-  if (!desc.leaf_snprintf) {
-    fprintf(stderr, "Key snprintf not available\n");
-    return -1;
-  }
-  snprintf_fn fn = (snprintf_fn)rw_engine_->getPointerToFunction(desc.leaf_snprintf);
-  if (!fn) {
-    fprintf(stderr, "Leaf snprintf not available in JIT Engine\n");
+  if (!ctx_)
+    return native_printf(id, true, buf, buflen, leaf);
+  const TableRW *rw = table_rw(id);
+  if (!rw || !rw->leaf_snprintf) {
+    fprintf(stderr, "Leaf snprintf not available\n");
     return -1;
   }
+  snprintf_fn fn = (snprintf_fn)rw->leaf_snprintf;
   int rc = (*fn)(buf, buflen, leaf);
   if (rc < 0) {
     perror("snprintf");
@@ -631,18 +1112,33 @@ int BPFModule::table_leaf_printf(size_t id, char *buf, size_t buflen, const void
 
 int BPFModule::table_key_scanf(size_t id, const char *key_str, void *key) {
   if (id >= tables_->size()) return -1;
-  const TableDesc &desc = (*tables_)[id];
-  if (!desc.key_sscanf) {
+  if (!ctx_)
+    return native_scanf(id, false, key_str, key);
+  const TableRW *rw = table_rw(id);
+  if (!rw || !rw->key_sscanf) {
     fprintf(stderr, "Key sscanf not available\n");
     return -1;
   }
+  sscanf_fn fn = (sscanf_fn)rw->key_sscanf;
+  int rc = (*fn)(key_str, key);
+  if (rc != 0) {
+    perror("sscanf");
+    return -1;
+  }
+  return 0;
+}
 
-  sscanf_fn fn = (sscanf_fn)rw_engine_->getPointerToFunction(desc.key_sscanf);
-  if (!fn) {
-    fprintf(stderr, "Key sscanf not available in JIT Engine\n");
+int BPFModule::table_leaf_scanf(size_t id, const char *leaf_str, void *leaf) {
+  if (id >= tables_->size()) return -1;
+  if (!ctx_)
+    return native_scanf(id, true, leaf_str, leaf);
+  const TableRW *rw = table_rw(id);
+  if (!rw || !rw->leaf_sscanf) {
+    fprintf(stderr, "Leaf sscanf not available\n");
     return -1;
   }
-  int rc = (*fn)(key_str, key);
+  sscanf_fn fn = (sscanf_fn)rw->leaf_sscanf;
+  int rc = (*fn)(leaf_str, leaf);
   if (rc != 0) {
     perror("sscanf");
     return -1;
@@ -650,27 +1146,306 @@ int BPFModule::table_key_scanf(size_t id, const char *key_str, void *key) {
   return 0;
 }
 
-int BPFModule::table_leaf_scanf(size_t id, const char *leaf_str, void *leaf) {
+// Format count keys and/or leaves with the native formatters, one record per
+// line. Stops at the first record that doesn't fit in buf and returns the
+// number of records formatted.
+int BPFModule::table_format(size_t id, int kind, bool header, const void *keys,
+                            const void *leaves, size_t count, char *buf, size_t buflen) {
   if (id >= tables_->size()) return -1;
-  const TableDesc &desc = (*tables_)[id];
-  if (!desc.leaf_sscanf) {
-    fprintf(stderr, "Key sscanf not available\n");
+  if (kind < TableFormat::TEXT || kind > TableFormat::CSV || (!keys && !leaves)) return -1;
+  TableFormat::Kind k = (TableFormat::Kind)kind;
+  TableFormat *key_fmt = keys ? table_formatter(id, false) : nullptr;
+  TableFormat *leaf_fmt = leaves ? table_formatter(id, true) : nullptr;
+  if ((keys && !key_fmt) || (leaves && !leaf_fmt))
     return -1;
+  bool pair = keys && leaves;
+  const uint8_t *key_p = (const uint8_t *)keys;
+  const uint8_t *leaf_p = (const uint8_t *)leaves;
+
+  FormatBuf out(buf, buflen);
+  if (header && k == TableFormat::CSV) {
+    if (key_fmt)
+      key_fmt->header("key", &out);
+    if (pair)
+      out.put(',');
+    if (leaf_fmt)
+      leaf_fmt->header("leaf", &out);
+    out.put('\n');
   }
+  size_t n;
+  for (n = 0; n < count; ++n) {
+    size_t start = out.pos();
+    if (pair && k == TableFormat::JSON)
+      out.put("{\"key\": ", 8);
+    if (key_fmt)
+      key_fmt->format(k, key_p + n * key_fmt->size(), &out);
+    if (pair) {
+      if (k == TableFormat::JSON)
+        out.put(", \"leaf\": ", 10);
+      else
+        out.put(k == TableFormat::CSV ? ',' : ' ');
+    }
+    if (leaf_fmt)
+      leaf_fmt->format(k, leaf_p + n * leaf_fmt->size(), &out);
+    if (pair && k == TableFormat::JSON)
+      out.put('}');
+    out.put('\n');
+    if (out.full()) {
+      out.truncate(start);
+      break;
+    }
+  }
+  // a header without any record is of no use to the caller
+  if (n == 0)
+    out.truncate(0);
+  out.terminate();
+  return n;
+}
+
+// Cache entries and precompiled objects share the layout described in
+// bpf_object.h.
+class CacheWriter {
+ public:
+  explicit CacheWriter(string *out) : out_(out) {}
+  void u32(uint32_t v) { out_->append((const char *)&v, sizeof(v)); }
+  void str(const string &s) { u32(s.size()); out_->append(s); }
+  void str(const uint8_t *p, size_t n) { u32(n); out_->append((const char *)p, n); }
+ private:
+  string *out_;
+};
 
-  sscanf_fn fn = (sscanf_fn)rw_engine_->getPointerToFunction(desc.leaf_sscanf);
-  if (!fn) {
-    fprintf(stderr, "Leaf sscanf not available in JIT Engine\n");
+class CacheReader {
+ public:
+  explicit CacheReader(const string &in) : in_(in), pos_(0), ok_(true) {}
+  uint32_t u32() {
+    uint32_t v = 0;
+    if (!ok_ || in_.size() - pos_ < sizeof(v)) {
+      ok_ = false;
+      return 0;
+    }
+    memcpy(&v, in_.data() + pos_, sizeof(v));
+    pos_ += sizeof(v);
+    return v;
+  }
+  string str() {
+    uint32_t n = u32();
+    if (!ok_ || in_.size() - pos_ < n) {
+      ok_ = false;
+      return string();
+    }
+    string s = in_.substr(pos_, n);
+    pos_ += n;
+    return s;
+  }
+  bool ok() const { return ok_; }
+ private:
+  const string &in_;
+  size_t pos_;
+  bool ok_;
+};
+
+static string fn_name(Function *fn) {
+  return fn ? fn->getName().str() : string();
+}
+
+static bool is_cached_section(const string &name) {
+  return !strncmp(BPF_FN_PREFIX, name.c_str(), strlen(BPF_FN_PREFIX)) ||
+      name == "license" || name == "version";
+}
+
+string BPFModule::cache_key(const string &main_path, const string &text,
+                            const char *cflags[], int ncflags) {
+  // debug output is produced by the compiler itself, so always compile
+  if (flags_ & (0x1 | DEBUG_PREPROCESSOR | BPF_MODULE_TIME_PASSES))
+    return string();
+  if (!ModuleCache::enabled())
+    return string();
+  // the profile changes the generated code
+  vector<const char *> key_flags(cflags, cflags + (cflags ? ncflags : 0));
+  string profile = "-bcc-opt=" + std::to_string(flags_ & BPF_MODULE_OPT_MASK);
+  key_flags.push_back(profile.c_str());
+  // as does compiling against the type database or the header snapshot
+  // instead of the headers
+  string type_db = ClangLoader::type_db_stamp(flags_);
+  if (!type_db.empty())
+    key_flags.push_back(type_db.c_str());
+  return ModuleCache::make_key(main_path, text, key_flags.data(), key_flags.size());
+}
+
+void BPFModule::serialize(string *out) {
+  // the formatters are kept as IR, build all of them without JITing
+  auto m = make_unique<Module>("sscanf", *ctx_);
+  vector<string> rw_names;
+  readers_.clear();
+  writers_.clear();
+  for (auto &types : rw_types_) {
+    if (!types.first || !types.second) {
+      rw_names.insert(rw_names.end(), 4, string());
+      continue;
+    }
+    rw_names.push_back(fn_name(make_reader(&*m, types.first)));
+    rw_names.push_back(fn_name(make_reader(&*m, types.second)));
+    rw_names.push_back(fn_name(make_writer(&*m, types.first)));
+    rw_names.push_back(fn_name(make_writer(&*m, types.second)));
+  }
+  readers_.clear();
+  writers_.clear();
+  string bitcode;
+  if (!m->empty()) {
+    raw_string_ostream os(bitcode);
+    WriteBitcodeToFile(&*m, os);
+    os.flush();
+  }
+
+  CacheWriter w(out);
+  w.str(BPF_OBJECT_MAGIC);
+  w.u32(tables_->size());
+  size_t j = 0;
+  for (auto &table : *tables_) {
+    w.str(table.name);
+    w.u32(table.fd);
+    w.u32(table.type);
+    w.u32(table.key_size);
+    w.u32(table.leaf_size);
+    w.u32(table.max_entries);
+    w.str(table.key_desc);
+    w.str(table.leaf_desc);
+    w.u32((table.is_shared ? BPF_OBJECT_TABLE_SHARED : 0) |
+          (table.is_extern ? BPF_OBJECT_TABLE_EXTERN : 0));
+    for (int k = 0; k < 4; ++k)
+      w.str(rw_names[j++]);
+  }
+  vector<string> names;
+  for (auto &section : sections_)
+    if (is_cached_section(section.first))
+      names.push_back(section.first);
+  w.u32(names.size());
+  for (auto &name : names) {
+    w.str(name);
+    w.str(get<0>(sections_[name]), get<1>(sections_[name]));
+  }
+  w.str(bitcode);
+}
+
+int BPFModule::save_cache(const string &key) {
+  CompileStats::Timer timer(&stats_, "cache_save");
+  string out;
+  serialize(&out);
+  // the entry is only used once its dependencies are written, after it
+  if (!ModuleCache::write(key, out))
+    return -1;
+  if (!ModuleCache::write(key + ".deps", clang_loader_ ? clang_loader_->deps() : string()))
+    return -1;
+  return 0;
+}
+
+int BPFModule::write_object(const string &path) {
+  if (b_loader_ || !ctx_ || !tables_ || function_names_.empty()) {
+    fprintf(stderr, "Only compiled C modules that were not compacted can be written as objects\n");
     return -1;
   }
-  int rc = (*fn)(leaf_str, leaf);
-  if (rc != 0) {
-    perror("sscanf");
+  string out;
+  serialize(&out);
+  std::ofstream os(path, std::ios::binary | std::ios::trunc);
+  if (!os.write(out.data(), out.size())) {
+    fprintf(stderr, "Could not write object %s\n", path.c_str());
     return -1;
   }
   return 0;
 }
 
+int BPFModule::load_cache(const string &key) {
+  CompileStats::Timer timer(&stats_, "cache_load");
+  // the key covers the text, not the files it includes
+  string deps, data;
+  if (!ModuleCache::read(key + ".deps", &deps) || !ClangLoader::deps_ok(deps) ||
+      !ModuleCache::read(key, &data)) {
+    ModuleCache::record_miss();
+    return -1;
+  }
+
+  CacheReader r(data);
+  auto tables = make_unique<vector<TableDesc>>();
+  vector<string> rw_names;
+  if (r.str() != BPF_OBJECT_MAGIC) {
+    ModuleCache::record_miss();
+    return -1;
+  }
+  uint32_t ntables = r.u32();
+  for (uint32_t i = 0; i < ntables && r.ok(); ++i) {
+    TableDesc table = {};
+    table.name = r.str();
+    table.fd = r.u32();
+    table.type = r.u32();
+    table.key_size = r.u32();
+    table.leaf_size = r.u32();
+    table.max_entries = r.u32();
+    table.key_desc = r.str();
+    table.leaf_desc = r.str();
+    uint32_t flags = r.u32();
+    table.is_shared = flags & BPF_OBJECT_TABLE_SHARED;
+    table.is_extern = flags & BPF_OBJECT_TABLE_EXTERN;
+    for (int j = 0; j < 4; ++j)
+      rw_names.push_back(r.str());
+    tables->push_back(std::move(table));
+  }
+  vector<tuple<string, string>> sections;
+  uint32_t nsections = r.u32();
+  for (uint32_t i = 0; i < nsections && r.ok(); ++i) {
+    string name = r.str();
+    sections.push_back(make_tuple(name, r.str()));
+  }
+  string bitcode = r.str();
+  if (!r.ok()) {
+    ModuleCache::record_miss();
+    return -1;
+  }
+
+  // clang does not run, recover the key/leaf types from the formatter IR,
+  // table_rw() regenerates the formatters from them
+  vector<std::pair<Type *, Type *>> rw_types(tables->size(), std::make_pair(nullptr, nullptr));
+  if (!bitcode.empty()) {
+    auto m = parseBitcodeFile(MemoryBufferRef(bitcode, "sscanf"), *ctx_);
+    if (!m) {
+      ModuleCache::record_miss();
+      return -1;
+    }
+    unique_ptr<Module> rw_mod = move(*m);
+    for (size_t i = 0; i < tables->size(); ++i) {
+      // readers are int (const char *, Type *)
+      Function *key_reader = rw_mod->getFunction(rw_names[i * 4]);
+      Function *leaf_reader = rw_mod->getFunction(rw_names[i * 4 + 1]);
+      if (!key_reader || !leaf_reader)
+        continue;
+      rw_types[i] = std::make_pair(
+          key_reader->getFunctionType()->getParamType(1)->getPointerElementType(),
+          leaf_reader->getFunctionType()->getParamType(1)->getPointerElementType());
+    }
+  }
+
+  for (auto &section : sections) {
+    const string &name = get<0>(section);
+    const string &contents = get<1>(section);
+    unique_ptr<uint8_t[]> buf(new uint8_t[contents.size()]);
+    memcpy(buf.get(), contents.data(), contents.size());
+    if (!strncmp(FN_PREFIX.c_str(), name.c_str(), FN_PREFIX.size()))
+      function_names_.push_back(name);
+    sections_[name] = make_tuple(buf.get(), contents.size());
+    section_bufs_.push_back(move(buf));
+  }
+  sections_owned_ = true;
+
+  size_t id = 0;
+  for (auto &table : *tables)
+    table_names_[table.name] = id++;
+  tables_ = move(tables);
+  rw_types_ = move(rw_types);
+  rw_.resize(tables_->size());
+
+  ModuleCache::record_hit();
+  return 0;
+}
+
 // load a B file, which comes in two parts
 int BPFModule::load_b(const string &filename, const string &proto_filename) {
   if (!sections_.empty()) {
@@ -699,6 +1474,8 @@ int BPFModule::load_b(const string &filename, const string &proto_filename) {
     return rc;
   if (int rc = finalize())
     return rc;
+  // the B frontend creates its maps while generating code
+  instantiated_ = true;
   return 0;
 }
 
@@ -712,12 +1489,22 @@ int BPFModule::load_c(const string &filename, const char *cflags[], int ncflags)
     fprintf(stderr, "Invalid filename\n");
     return -1;
   }
+  string key;
+  std::ifstream in(filename);
+  if (in) {
+    string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    key = cache_key(filename, text, cflags, ncflags);
+    if (!key.empty() && load_cache(key) == 0)
+      return 0;
+  }
   if (int rc = load_cfile(filename, false, cflags, ncflags))
     return rc;
   if (int rc = annotate())
     return rc;
   if (int rc = finalize())
     return rc;
+  if (!key.empty())
+    save_cache(key);
   return 0;
 }
 
@@ -727,6 +1514,9 @@ int BPFModule::load_string(const string &text, const char *cflags[], int ncflags
     fprintf(stderr, "Program already initialized\n");
     return -1;
   }
+  string key = cache_key("/virtual/main.c", text, cflags, ncflags);
+  if (!key.empty() && load_cache(key) == 0)
+    return 0;
   if (int rc = load_cfile(text, true, cflags, ncflags))
     return rc;
   if (int rc = annotate())
@@ -734,6 +1524,8 @@ int BPFModule::load_string(const string &text, const char *cflags[], int ncflags
 
   if (int rc = finalize())
     return rc;
+  if (!key.empty())
+    save_cache(key);
   return 0;
 }
 
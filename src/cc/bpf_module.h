@@ -22,6 +22,8 @@
 #include <string>
 #include <vector>
 
+#include "compile_stats.h"
+
 namespace llvm {
 class ExecutionEngine;
 class Function;
@@ -34,9 +36,20 @@ namespace ebpf {
 struct TableDesc;
 class BLoader;
 class ClangLoader;
+class TableFormat;
 
 class BPFModule {
  private:
+  // formatters of a table, built on first use
+  struct TableRW {
+    std::unique_ptr<llvm::ExecutionEngine> engine;  // JIT'd sscanf/snprintf helpers
+    void *key_sscanf = nullptr;
+    void *leaf_sscanf = nullptr;
+    void *key_snprintf = nullptr;
+    void *leaf_snprintf = nullptr;
+    std::unique_ptr<TableFormat> key_format;  // interpreted key_desc/leaf_desc
+    std::unique_ptr<TableFormat> leaf_format;
+  };
   static const std::string FN_PREFIX;
   int init_engine();
   int parse(llvm::Module *mod);
@@ -45,28 +58,55 @@ class BPFModule {
   std::unique_ptr<llvm::ExecutionEngine> finalize_rw(std::unique_ptr<llvm::Module> mod);
   llvm::Function * make_reader(llvm::Module *mod, llvm::Type *type);
   llvm::Function * make_writer(llvm::Module *mod, llvm::Type *type);
+  const TableRW * table_rw(size_t id);
+  TableFormat * table_formatter(size_t id, bool leaf);
+  int native_printf(size_t id, bool leaf, char *buf, size_t buflen, const void *rec);
+  int native_scanf(size_t id, bool leaf, const char *str, void *rec);
+  void own_sections();
   void dump_ir(llvm::Module &mod);
+  int load_function(const std::string &name, int prog_type, const char *const_names[],
+                    const unsigned long long *const_values, int nconsts, unsigned log_level,
+                    std::string *log) const;
   int load_file_module(std::unique_ptr<llvm::Module> *mod, const std::string &file, bool in_memory);
   int load_includes(const std::string &text);
   int load_cfile(const std::string &file, bool in_memory, const char *cflags[], int ncflags);
   int kbuild_flags(const char *uname_release, std::vector<std::string> *cflags);
-  int run_pass_manager(llvm::Module &mod);
+  int run_pass_manager(llvm::Module &mod, bool bpf);
+  std::string cache_key(const std::string &main_path, const std::string &text,
+                        const char *cflags[], int ncflags);
+  int load_cache(const std::string &key);
+  int save_cache(const std::string &key);
+  void serialize(std::string *out);
  public:
   BPFModule(unsigned flags);
   ~BPFModule();
+  static int build_type_db(const std::string &path, const std::vector<std::string> &headers,
+                           const std::vector<std::string> &types);
+  static int build_header_archive(const std::string &path);
   int load_b(const std::string &filename, const std::string &proto_filename);
   int load_c(const std::string &filename, const char *cflags[], int ncflags);
   int load_string(const std::string &text, const char *cflags[], int ncflags);
+  int write_object(const std::string &path);
   size_t num_functions() const;
   uint8_t * function_start(size_t id) const;
   uint8_t * function_start(const std::string &name) const;
   const char * function_name(size_t id) const;
   size_t function_size(size_t id) const;
   size_t function_size(const std::string &name) const;
+  // valid until the next call of any of these
+  const char * function_disasm(const std::string &name);
+  const char * function_cost(const std::string &name);
+  const char * verifier_report(const std::string &name, const char *log);
+  // Load the functions as programs of prog_type on up to nthreads threads,
+  // see bpf_function_load_batch(). logs are valid until the next call.
+  int load_functions(const std::vector<std::string> &names, int prog_type,
+                     const char *const_names[], const unsigned long long *const_values,
+                     int nconsts, unsigned log_level, unsigned nthreads, int fds[],
+                     const char *logs[]);
   size_t num_tables() const;
   size_t table_id(const std::string &name) const;
-  int table_fd(size_t id) const;
-  int table_fd(const std::string &name) const;
+  int table_fd(size_t id);
+  int table_fd(const std::string &name);
   const char * table_name(size_t id) const;
   int table_type(const std::string &name) const;
   int table_type(size_t id) const;
@@ -84,15 +124,22 @@ class BPFModule {
   size_t table_leaf_size(const std::string &name) const;
   int table_leaf_printf(size_t id, char *buf, size_t buflen, const void *leaf);
   int table_leaf_scanf(size_t id, const char *buf, void *leaf);
+  int table_format(size_t id, int kind, bool header, const void *keys, const void *leaves,
+                   size_t count, char *buf, size_t buflen);
   char * license() const;
   unsigned kern_version() const;
+  const char * compile_stats();
+  int compact();
+  int instantiate(BPFModule *prev = nullptr);
+  int take_exports(BPFModule *prev);
+  size_t skipped_map_bytes() const;
  private:
   unsigned flags_;  // 0x1 for printing
   std::string filename_;
   std::string proto_filename_;
   std::unique_ptr<llvm::LLVMContext> ctx_;
   std::unique_ptr<llvm::ExecutionEngine> engine_;
-  std::unique_ptr<llvm::ExecutionEngine> rw_engine_;
+  std::vector<TableRW> rw_;
   std::unique_ptr<llvm::Module> mod_;
   std::unique_ptr<BLoader> b_loader_;
   std::unique_ptr<ClangLoader> clang_loader_;
@@ -102,6 +149,15 @@ class BPFModule {
   std::vector<std::string> function_names_;
   std::map<llvm::Type *, llvm::Function *> readers_;
   std::map<llvm::Type *, llvm::Function *> writers_;
+  std::vector<std::pair<llvm::Type *, llvm::Type *>> rw_types_;  // key and leaf type per table
+  std::vector<std::unique_ptr<uint8_t[]>> section_bufs_;  // sections restored from the cache
+  CompileStats stats_;
+  std::string stats_json_;
+  std::string analysis_;  // last function_disasm()/function_cost()/verifier_report()
+  std::vector<std::string> load_logs_;  // of the last load_functions()
+  bool sections_owned_;  // sections_ point into section_bufs_, not the JIT
+  bool instantiated_;  // maps created and the function sections patched
+  size_t skipped_map_bytes_;  // of the maps left for table_fd() to create
 };
 
 }  // namespace ebpf
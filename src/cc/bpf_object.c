@@ -0,0 +1,400 @@
+/*
+ * Copyright (c) 2016 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bpf_object.h"
+#include "libbpf.h"
+
+struct bpf_object_table {
+  char *name;
+  int fd;
+  int type;
+  size_t key_size;
+  size_t leaf_size;
+  size_t max_entries;
+  char *key_desc;
+  char *leaf_desc;
+};
+
+struct bpf_object_section {
+  char *name;
+  uint8_t *data;
+  size_t size;
+};
+
+struct bpf_object {
+  struct bpf_object_table *tables;
+  size_t num_tables;
+  struct bpf_object_section *sections;
+  size_t num_sections;
+  // indexes into sections of the function sections, in section order
+  size_t *functions;
+  size_t num_functions;
+};
+
+struct obj_reader {
+  const uint8_t *buf;
+  size_t size;
+  size_t pos;
+  int ok;
+};
+
+static uint32_t read_u32(struct obj_reader *r) {
+  uint32_t v = 0;
+  if (!r->ok || r->size - r->pos < sizeof(v)) {
+    r->ok = 0;
+    return 0;
+  }
+  memcpy(&v, r->buf + r->pos, sizeof(v));
+  r->pos += sizeof(v);
+  return v;
+}
+
+// returns a NUL-terminated copy of the next string field, *len excludes the NUL
+static char * read_str(struct obj_reader *r, size_t *len) {
+  uint32_t n = read_u32(r);
+  char *s;
+  if (!r->ok || r->size - r->pos < n) {
+    r->ok = 0;
+    return NULL;
+  }
+  s = malloc(n + 1);
+  if (!s) {
+    r->ok = 0;
+    return NULL;
+  }
+  memcpy(s, r->buf + r->pos, n);
+  s[n] = '\0';
+  r->pos += n;
+  if (len)
+    *len = n;
+  return s;
+}
+
+static void skip_str(struct obj_reader *r) {
+  uint32_t n = read_u32(r);
+  if (!r->ok || r->size - r->pos < n) {
+    r->ok = 0;
+    return;
+  }
+  r->pos += n;
+}
+
+static struct bpf_object_section * find_section(struct bpf_object *obj, const char *name) {
+  size_t i;
+  for (i = 0; i < obj->num_sections; ++i)
+    if (!strcmp(obj->sections[i].name, name))
+      return &obj->sections[i];
+  return NULL;
+}
+
+static struct bpf_object_section * find_function(struct bpf_object *obj, const char *name) {
+  size_t prefix_len = strlen(BPF_FN_PREFIX);
+  size_t i;
+  for (i = 0; i < obj->num_functions; ++i) {
+    struct bpf_object_section *s = &obj->sections[obj->functions[i]];
+    if (!strcmp(s->name + prefix_len, name))
+      return s;
+  }
+  return NULL;
+}
+
+static struct bpf_object_table * find_table(struct bpf_object *obj, const char *name) {
+  size_t i;
+  if (!obj || !name)
+    return NULL;
+  for (i = 0; i < obj->num_tables; ++i)
+    if (!strcmp(obj->tables[i].name, name))
+      return &obj->tables[i];
+  return NULL;
+}
+
+void bpf_object_close(struct bpf_object *obj) {
+  size_t i;
+  if (!obj)
+    return;
+  for (i = 0; i < obj->num_tables; ++i) {
+    if (obj->tables[i].fd >= 0)
+      close(obj->tables[i].fd);
+    free(obj->tables[i].name);
+    free(obj->tables[i].key_desc);
+    free(obj->tables[i].leaf_desc);
+  }
+  for (i = 0; i < obj->num_sections; ++i) {
+    free(obj->sections[i].name);
+    free(obj->sections[i].data);
+  }
+  free(obj->tables);
+  free(obj->sections);
+  free(obj->functions);
+  free(obj);
+}
+
+struct bpf_object * bpf_object_open_buffer(const void *buf, size_t size) {
+  struct obj_reader r = {buf, size, 0, 1};
+  struct bpf_object *obj = NULL;
+  int *compiled_fds = NULL, *new_fds = NULL;
+  char *magic;
+  uint32_t n, i;
+  size_t prefix_len = strlen(BPF_FN_PREFIX);
+
+  magic = read_str(&r, NULL);
+  if (!magic || strcmp(magic, BPF_OBJECT_MAGIC)) {
+    fprintf(stderr, "bpf_object: bad magic\n");
+    free(magic);
+    return NULL;
+  }
+  free(magic);
+
+  obj = calloc(1, sizeof(*obj));
+  if (!obj)
+    return NULL;
+
+  n = read_u32(&r);
+  if (!r.ok || n > size)
+    goto error;
+  obj->tables = calloc(n, sizeof(*obj->tables));
+  compiled_fds = calloc(n, sizeof(*compiled_fds));
+  if (n && (!obj->tables || !compiled_fds))
+    goto error;
+  for (i = 0; i < n && r.ok; ++i) {
+    struct bpf_object_table *t = &obj->tables[i];
+    uint32_t flags;
+    t->fd = -1;
+    ++obj->num_tables;
+    t->name = read_str(&r, NULL);
+    compiled_fds[i] = (int)read_u32(&r);
+    t->type = (int)read_u32(&r);
+    t->key_size = read_u32(&r);
+    t->leaf_size = read_u32(&r);
+    t->max_entries = read_u32(&r);
+    t->key_desc = read_str(&r, NULL);
+    t->leaf_desc = read_str(&r, NULL);
+    flags = read_u32(&r);
+    // formatter function names
+    skip_str(&r);
+    skip_str(&r);
+    skip_str(&r);
+    skip_str(&r);
+    if (r.ok && (flags & BPF_OBJECT_TABLE_EXTERN)) {
+      fprintf(stderr, "bpf_object: extern table %s is not supported\n", t->name);
+      goto error;
+    }
+  }
+
+  n = read_u32(&r);
+  if (!r.ok || n > size)
+    goto error;
+  obj->sections = calloc(n, sizeof(*obj->sections));
+  obj->functions = calloc(n, sizeof(*obj->functions));
+  if (n && (!obj->sections || !obj->functions))
+    goto error;
+  for (i = 0; i < n && r.ok; ++i) {
+    struct bpf_object_section *s = &obj->sections[i];
+    ++obj->num_sections;
+    s->name = read_str(&r, NULL);
+    s->data = (uint8_t *)read_str(&r, &s->size);
+    if (r.ok && !strncmp(s->name, BPF_FN_PREFIX, prefix_len))
+      obj->functions[obj->num_functions++] = i;
+  }
+  // formatter bitcode
+  skip_str(&r);
+  if (!r.ok) {
+    fprintf(stderr, "bpf_object: truncated object\n");
+    goto error;
+  }
+
+  for (i = 0; i < obj->num_tables; ++i) {
+    struct bpf_object_table *t = &obj->tables[i];
+    t->fd = bpf_create_map(t->type, t->key_size, t->leaf_size, t->max_entries);
+    if (t->fd < 0) {
+      fprintf(stderr, "bpf_object: could not create map %s: %s\n", t->name, strerror(errno));
+      goto error;
+    }
+  }
+
+  new_fds = calloc(obj->num_tables, sizeof(*new_fds));
+  if (obj->num_tables && !new_fds)
+    goto error;
+  for (i = 0; i < obj->num_tables; ++i)
+    new_fds[i] = obj->tables[i].fd;
+  for (i = 0; i < obj->num_functions; ++i) {
+    struct bpf_object_section *s = &obj->sections[obj->functions[i]];
+    bpf_relocate_map_fds((struct bpf_insn *)s->data, s->size / sizeof(struct bpf_insn),
+                         compiled_fds, new_fds, obj->num_tables);
+  }
+
+  free(compiled_fds);
+  free(new_fds);
+  return obj;
+
+error:
+  free(compiled_fds);
+  free(new_fds);
+  bpf_object_close(obj);
+  return NULL;
+}
+
+struct bpf_object * bpf_object_open(const char *path) {
+  struct bpf_object *obj = NULL;
+  struct stat st;
+  uint8_t *buf = NULL;
+  size_t off = 0;
+  int fd;
+
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    fprintf(stderr, "open(%s): %s\n", path, strerror(errno));
+    return NULL;
+  }
+  if (fstat(fd, &st) < 0) {
+    fprintf(stderr, "fstat(%s): %s\n", path, strerror(errno));
+    goto out;
+  }
+  buf = malloc(st.st_size);
+  if (!buf)
+    goto out;
+  while (off < (size_t)st.st_size) {
+    ssize_t ret = read(fd, buf + off, st.st_size - off);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0) {
+      fprintf(stderr, "read(%s): %s\n", path, strerror(errno));
+      goto out;
+    }
+    off += ret;
+  }
+  obj = bpf_object_open_buffer(buf, st.st_size);
+
+out:
+  free(buf);
+  close(fd);
+  return obj;
+}
+
+const char * bpf_object_license(struct bpf_object *obj) {
+  struct bpf_object_section *s;
+  if (!obj)
+    return NULL;
+  s = find_section(obj, "license");
+  return s ? (const char *)s->data : NULL;
+}
+
+unsigned bpf_object_kern_version(struct bpf_object *obj) {
+  struct bpf_object_section *s;
+  unsigned version = 0;
+  if (!obj)
+    return 0;
+  s = find_section(obj, "version");
+  if (s && s->size >= sizeof(version))
+    memcpy(&version, s->data, sizeof(version));
+  return version;
+}
+
+size_t bpf_object_num_functions(struct bpf_object *obj) {
+  return obj ? obj->num_functions : 0;
+}
+
+const char * bpf_object_function_name(struct bpf_object *obj, size_t id) {
+  if (!obj || id >= obj->num_functions)
+    return NULL;
+  return obj->sections[obj->functions[id]].name + strlen(BPF_FN_PREFIX);
+}
+
+void * bpf_object_function_start(struct bpf_object *obj, const char *name) {
+  struct bpf_object_section *s;
+  if (!obj || !name)
+    return NULL;
+  s = find_function(obj, name);
+  return s ? s->data : NULL;
+}
+
+size_t bpf_object_function_size(struct bpf_object *obj, const char *name) {
+  struct bpf_object_section *s;
+  if (!obj || !name)
+    return 0;
+  s = find_function(obj, name);
+  return s ? s->size : 0;
+}
+
+int bpf_object_prog_load(struct bpf_object *obj, const char *name,
+                         enum bpf_prog_type prog_type,
+                         char *log_buf, unsigned log_buf_size) {
+  struct bpf_object_section *s;
+  if (!obj || !name)
+    return -1;
+  s = find_function(obj, name);
+  if (!s) {
+    fprintf(stderr, "bpf_object: unknown function %s\n", name);
+    return -1;
+  }
+  return bpf_prog_load(prog_type, (const struct bpf_insn *)s->data, s->size,
+                       bpf_object_license(obj), bpf_object_kern_version(obj),
+                       log_buf, log_buf_size);
+}
+
+size_t bpf_object_num_tables(struct bpf_object *obj) {
+  return obj ? obj->num_tables : 0;
+}
+
+const char * bpf_object_table_name(struct bpf_object *obj, size_t id) {
+  if (!obj || id >= obj->num_tables)
+    return NULL;
+  return obj->tables[id].name;
+}
+
+int bpf_object_table_fd(struct bpf_object *obj, const char *name) {
+  struct bpf_object_table *t = find_table(obj, name);
+  return t ? t->fd : -1;
+}
+
+int bpf_object_table_type(struct bpf_object *obj, const char *name) {
+  struct bpf_object_table *t = find_table(obj, name);
+  return t ? t->type : -1;
+}
+
+const char * bpf_object_table_key_desc(struct bpf_object *obj, const char *name) {
+  struct bpf_object_table *t = find_table(obj, name);
+  return t ? t->key_desc : NULL;
+}
+
+const char * bpf_object_table_leaf_desc(struct bpf_object *obj, const char *name) {
+  struct bpf_object_table *t = find_table(obj, name);
+  return t ? t->leaf_desc : NULL;
+}
+
+size_t bpf_object_table_key_size(struct bpf_object *obj, const char *name) {
+  struct bpf_object_table *t = find_table(obj, name);
+  return t ? t->key_size : 0;
+}
+
+size_t bpf_object_table_leaf_size(struct bpf_object *obj, const char *name) {
+  struct bpf_object_table *t = find_table(obj, name);
+  return t ? t->leaf_size : 0;
+}
+
+size_t bpf_object_table_max_entries(struct bpf_object *obj, const char *name) {
+  struct bpf_object_table *t = find_table(obj, name);
+  return t ? t->max_entries : 0;
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2016 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Loader for precompiled bcc modules, does not depend on LLVM.
+ *
+ * Objects are written by bpf_module_write_object() and contain a flat
+ * sequence of fields in host byte order, where str is a u32 length followed
+ * by that many bytes:
+ *
+ *   str magic (BPF_OBJECT_MAGIC), u32 ntables,
+ *   ntables * { str name, u32 fd, u32 type, u32 key_size, u32 leaf_size,
+ *               u32 max_entries, str key_desc, str leaf_desc, u32 flags,
+ *               str key_sscanf, str leaf_sscanf, str key_snprintf,
+ *               str leaf_snprintf },
+ *   u32 nsections, nsections * { str name, str data },
+ *   str formatter bitcode
+ *
+ * The fd of each table is the one referenced by the BPF_PSEUDO_MAP_FD loads
+ * in the function sections, a placeholder unless the module was instantiated
+ * before it was written. The loader rewrites it to the map it creates.
+ * The formatter names and bitcode are only meaningful to libbcc and are
+ * skipped here.
+ */
+
+#ifndef BPF_OBJECT_H
+#define BPF_OBJECT_H
+
+#include <stddef.h>
+#include <linux/bpf.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BPF_OBJECT_MAGIC "bcc-module-2"
+
+#define BPF_OBJECT_TABLE_SHARED 0x1
+#define BPF_OBJECT_TABLE_EXTERN 0x2
+
+struct bpf_object;
+
+/* Parse an object and create its maps. Returns NULL on failure. */
+struct bpf_object * bpf_object_open(const char *path);
+struct bpf_object * bpf_object_open_buffer(const void *buf, size_t size);
+/* Close all maps and free the object */
+void bpf_object_close(struct bpf_object *obj);
+
+const char * bpf_object_license(struct bpf_object *obj);
+unsigned bpf_object_kern_version(struct bpf_object *obj);
+
+size_t bpf_object_num_functions(struct bpf_object *obj);
+const char * bpf_object_function_name(struct bpf_object *obj, size_t id);
+void * bpf_object_function_start(struct bpf_object *obj, const char *name);
+size_t bpf_object_function_size(struct bpf_object *obj, const char *name);
+/* Load the named function into the kernel, returns the prog fd or -1 */
+int bpf_object_prog_load(struct bpf_object *obj, const char *name,
+                         enum bpf_prog_type prog_type,
+                         char *log_buf, unsigned log_buf_size);
+
+size_t bpf_object_num_tables(struct bpf_object *obj);
+const char * bpf_object_table_name(struct bpf_object *obj, size_t id);
+int bpf_object_table_fd(struct bpf_object *obj, const char *name);
+int bpf_object_table_type(struct bpf_object *obj, const char *name);
+const char * bpf_object_table_key_desc(struct bpf_object *obj, const char *name);
+const char * bpf_object_table_leaf_desc(struct bpf_object *obj, const char *name);
+size_t bpf_object_table_key_size(struct bpf_object *obj, const char *name);
+size_t bpf_object_table_leaf_size(struct bpf_object *obj, const char *name);
+size_t bpf_object_table_max_entries(struct bpf_object *obj, const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2016 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <sys/resource.h>
+#include <time.h>
+
+#include "compile_stats.h"
+
+namespace ebpf {
+
+using std::string;
+using std::to_string;
+
+static uint64_t now_ns(clockid_t clk) {
+  struct timespec ts;
+  if (clock_gettime(clk, &ts) < 0)
+    return 0;
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static long maxrss_kb() {
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) < 0)
+    return 0;
+  return ru.ru_maxrss;
+}
+
+CompileStats::Timer::Timer(CompileStats *stats, const char *name)
+    : stats_(stats), name_(name), wall_ns_(0), cpu_ns_(0), maxrss_kb_(0) {
+  if (!stats_)
+    return;
+  wall_ns_ = now_ns(CLOCK_MONOTONIC);
+  cpu_ns_ = now_ns(CLOCK_THREAD_CPUTIME_ID);
+  maxrss_kb_ = maxrss_kb();
+}
+
+void CompileStats::Timer::stop() {
+  if (!stats_)
+    return;
+  stats_->add(name_, now_ns(CLOCK_MONOTONIC) - wall_ns_, now_ns(CLOCK_THREAD_CPUTIME_ID) - cpu_ns_,
+              maxrss_kb() - maxrss_kb_);
+  stats_ = nullptr;
+}
+
+void CompileStats::add(const char *name, uint64_t wall_ns, uint64_t cpu_ns, long maxrss_kb) {
+  for (auto &p : phases_) {
+    if (p.name == name) {
+      ++p.count;
+      p.wall_ns += wall_ns;
+      p.cpu_ns += cpu_ns;
+      p.maxrss_kb += maxrss_kb;
+      return;
+    }
+  }
+  phases_.push_back(Phase{name, 1, wall_ns, cpu_ns, maxrss_kb});
+}
+
+string CompileStats::json() const {
+  string s = "[";
+  for (auto &p : phases_) {
+    if (s.size() > 1)
+      s += ", ";
+    s += "{\"phase\": \"" + p.name + "\", \"count\": " + to_string(p.count);
+    s += ", \"wall_ns\": " + to_string(p.wall_ns) + ", \"cpu_ns\": " + to_string(p.cpu_ns);
+    s += ", \"maxrss_kb\": " + to_string(p.maxrss_kb) + "}";
+  }
+  s += "]";
+  return s;
+}
+
+}  // namespace ebpf
@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2016 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace ebpf {
+
+// Wall time, CPU time and memory growth of the phases of a module compile.
+// Phases that run more than once (e.g. the per table rw_jit) accumulate.
+class CompileStats {
+ public:
+  struct Phase {
+    std::string name;
+    unsigned count;
+    uint64_t wall_ns;
+    uint64_t cpu_ns;  // of the calling thread
+    long maxrss_kb;  // growth of the process peak RSS while in the phase
+  };
+
+  // Measures from construction until stop() or destruction. A null stats
+  // makes it a no-op.
+  class Timer {
+   public:
+    Timer(CompileStats *stats, const char *name);
+    ~Timer() { stop(); }
+    void stop();
+   private:
+    CompileStats *stats_;
+    const char *name_;
+    uint64_t wall_ns_;
+    uint64_t cpu_ns_;
+    long maxrss_kb_;
+  };
+
+  const std::vector<Phase> & phases() const { return phases_; }
+  // [{"phase": name, "count": n, "wall_ns": .., "cpu_ns": .., "maxrss_kb": ..}, ...]
+  std::string json() const;
+
+ private:
+  void add(const char *name, uint64_t wall_ns, uint64_t cpu_ns, long maxrss_kb);
+  std::vector<Phase> phases_;  // in order of first occurrence
+};
+
+}  // namespace ebpf
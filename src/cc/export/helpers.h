@@ -60,6 +60,19 @@ BPF_TABLE(_table_type, _key_type, _leaf_type, _name, _max_entries); \
 __attribute__((section("maps/export"))) \
 struct _name##_table_t __##_name
 
+// define a table kept in two copies, _name and _name##__1, of which the
+// program updates the one selected by _name##__active. User space resets
+// the idle copy and flips the index (table.swap() in python) to read the
+// other one without racing with the program.
+// Changes to the macro require changes in BFrontendAction classes
+#define BPF_TABLE_SWAP(_table_type, _key_type, _leaf_type, _name, _max_entries) \
+BPF_TABLE(_table_type, _key_type, _leaf_type, _name, _max_entries); \
+__attribute__((section("maps/" _table_type))) \
+struct _name##_table_t _name##__1; \
+BPF_TABLE("array", int, u32, _name##__active, 1); \
+__attribute__((section("maps/swap"))) \
+struct _name##_table_t __swap_##_name
+
 // Table for pushing custom events to userspace via ring buffer
 #define BPF_PERF_OUTPUT(_name) \
 struct _name##_table_t { \
@@ -118,6 +131,12 @@ struct bpf_stacktrace {
 #define BPF_STACK_TRACE(_name, _max_entries) \
   BPF_TABLE("stacktrace", int, struct bpf_stacktrace, _name, _max_entries);
 
+// A scalar whose value is supplied when the functions using it are loaded,
+// e.g. BPF_CONST(u32, target_pid); the same compiled module serves any value.
+// Changes to the macro require changes in BFrontendAction classes
+#define BPF_CONST(_type, _name) \
+  static _type _name __attribute__((section("consts/" #_name), unused))
+
 // packet parsing state machine helpers
 #define cursor_advance(_cursor, _len) \
   ({ void *_tmp = _cursor; _cursor += _len; _tmp; })
@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2016 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <functional>
+
+#include <llvm/Support/MemoryBuffer.h>
+
+#include "archive_fs.h"
+#include "header_archive.h"
+
+namespace ebpf {
+
+using std::string;
+using std::unique_ptr;
+using std::vector;
+using clang::vfs::Status;
+
+namespace {
+
+Status archive_status(const string &name, const HeaderArchive::File &f) {
+  namespace fs = llvm::sys::fs;
+  llvm::sys::TimeValue mtime;
+  mtime.fromEpochTime(f.mtime);
+  // files are told apart by the address of their contents, directories
+  // by their name
+  fs::UniqueID id(f.data ? 0xbcc00 : 0xbcc01,
+                  f.data ? (uint64_t)(uintptr_t)f.data : std::hash<string>()(f.name));
+  return Status(name, id, mtime, 0, 0, f.size,
+                f.data ? fs::file_type::regular_file : fs::file_type::directory_file,
+                fs::perms(fs::all_read | (f.data ? 0 : fs::all_exe)));
+}
+
+class ArchiveFile : public clang::vfs::File {
+ public:
+  ArchiveFile(const Status &st, const HeaderArchive::File &f) : status_(st), file_(f) {}
+  llvm::ErrorOr<Status> status() override { return status_; }
+  llvm::ErrorOr<unique_ptr<llvm::MemoryBuffer>> getBuffer(const llvm::Twine &name, int64_t,
+                                                          bool null_terminated, bool) override {
+    // the archive keeps a NUL after each file
+    return llvm::MemoryBuffer::getMemBuffer(llvm::StringRef(file_.data, file_.size), name.str(),
+                                            null_terminated);
+  }
+  std::error_code close() override { return std::error_code(); }
+ private:
+  Status status_;
+  HeaderArchive::File file_;
+};
+
+class ArchiveDirIter : public clang::vfs::detail::DirIterImpl {
+ public:
+  explicit ArchiveDirIter(vector<Status> &&entries) : entries_(std::move(entries)), next_(0) {
+    increment();
+  }
+  std::error_code increment() override {
+    CurrentEntry = next_ < entries_.size() ? entries_[next_++] : Status();
+    return std::error_code();
+  }
+ private:
+  vector<Status> entries_;
+  size_t next_;
+};
+
+}  // namespace
+
+ArchiveFileSystem::ArchiveFileSystem(const vector<std::shared_ptr<const HeaderArchive>> &archives,
+                                     llvm::IntrusiveRefCntPtr<clang::vfs::FileSystem> base)
+    : archives_(archives), base_(base) {
+  auto cwd = base_->getCurrentWorkingDirectory();
+  if (cwd)
+    cwd_ = *cwd;
+}
+
+const HeaderArchive * ArchiveFileSystem::find(const llvm::Twine &path, string *abs) const {
+  string p = path.str();
+  *abs = HeaderArchive::normalize(p.compare(0, 1, "/") ? cwd_ + "/" + p : p);
+  for (auto &a : archives_)
+    if (a->covers(*abs))
+      return &*a;
+  return nullptr;
+}
+
+llvm::ErrorOr<Status> ArchiveFileSystem::status(const llvm::Twine &path) {
+  string abs;
+  const HeaderArchive *a = find(path, &abs);
+  if (!a)
+    return base_->status(path);
+  HeaderArchive::File f;
+  if (!a->lookup(abs, &f))
+    return std::make_error_code(std::errc::no_such_file_or_directory);
+  return archive_status(path.str(), f);
+}
+
+llvm::ErrorOr<unique_ptr<clang::vfs::File>> ArchiveFileSystem::openFileForRead(const llvm::Twine &path) {
+  string abs;
+  const HeaderArchive *a = find(path, &abs);
+  if (!a)
+    return base_->openFileForRead(path);
+  HeaderArchive::File f;
+  if (!a->lookup(abs, &f))
+    return std::make_error_code(std::errc::no_such_file_or_directory);
+  if (!f.data)
+    return std::make_error_code(std::errc::is_a_directory);
+  return unique_ptr<clang::vfs::File>(new ArchiveFile(archive_status(path.str(), f), f));
+}
+
+clang::vfs::directory_iterator ArchiveFileSystem::dir_begin(const llvm::Twine &dir,
+                                                           std::error_code &ec) {
+  string abs;
+  const HeaderArchive *a = find(dir, &abs);
+  if (!a)
+    return base_->dir_begin(dir, ec);
+  HeaderArchive::File f;
+  if (!a->lookup(abs, &f)) {
+    ec = std::make_error_code(std::errc::no_such_file_or_directory);
+    return clang::vfs::directory_iterator();
+  }
+  if (f.data) {
+    ec = std::make_error_code(std::errc::not_a_directory);
+    return clang::vfs::directory_iterator();
+  }
+  // entries are named under dir as given, like the real filesystem does
+  string prefix = dir.str();
+  vector<Status> entries;
+  for (auto &e : a->list(abs))
+    entries.push_back(archive_status(prefix + e.name.substr(abs.size()), e));
+  ec = std::error_code();
+  return clang::vfs::directory_iterator(std::make_shared<ArchiveDirIter>(std::move(entries)));
+}
+
+llvm::ErrorOr<string> ArchiveFileSystem::getCurrentWorkingDirectory() const {
+  return cwd_;
+}
+
+std::error_code ArchiveFileSystem::setCurrentWorkingDirectory(const llvm::Twine &path) {
+  string p = path.str();
+  cwd_ = HeaderArchive::normalize(p.compare(0, 1, "/") ? cwd_ + "/" + p : p);
+  // the base resolves the program's relative includes
+  base_->setCurrentWorkingDirectory(cwd_);
+  return std::error_code();
+}
+
+}  // namespace ebpf
@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2016 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <clang/Basic/VirtualFileSystem.h>
+
+namespace ebpf {
+
+class HeaderArchive;
+
+// Serves the paths that the archives cover from their contents, and passes
+// everything else (the program's own includes) to the base filesystem.
+// Lookups below an archive's roots never reach the disk, including those of
+// the include directories that don't hold the header being searched for.
+class ArchiveFileSystem : public clang::vfs::FileSystem {
+ public:
+  ArchiveFileSystem(const std::vector<std::shared_ptr<const HeaderArchive>> &archives,
+                    llvm::IntrusiveRefCntPtr<clang::vfs::FileSystem> base);
+
+  llvm::ErrorOr<clang::vfs::Status> status(const llvm::Twine &path) override;
+  llvm::ErrorOr<std::unique_ptr<clang::vfs::File>> openFileForRead(const llvm::Twine &path) override;
+  clang::vfs::directory_iterator dir_begin(const llvm::Twine &dir, std::error_code &ec) override;
+  llvm::ErrorOr<std::string> getCurrentWorkingDirectory() const override;
+  std::error_code setCurrentWorkingDirectory(const llvm::Twine &path) override;
+
+ private:
+  // the archive covering path, which is made absolute and normalized
+  const HeaderArchive * find(const llvm::Twine &path, std::string *abs) const;
+
+  std::vector<std::shared_ptr<const HeaderArchive>> archives_;
+  llvm::IntrusiveRefCntPtr<clang::vfs::FileSystem> base_;
+  std::string cwd_;
+};
+
+}  // namespace ebpf
@@ -17,6 +17,7 @@
 #include <linux/version.h>
 #include <sys/utsname.h>
 #include <unistd.h>
+#include <algorithm>
 
 #include <clang/AST/ASTConsumer.h>
 #include <clang/AST/ASTContext.h>
@@ -26,7 +27,6 @@
 #include <clang/Rewrite/Core/Rewriter.h>
 
 #include "b_frontend_action.h"
-#include "shared_table.h"
 
 #include "libbpf.h"
 
@@ -145,7 +145,188 @@ class ProbeSetter : public RecursiveASTVisitor<ProbeSetter> {
   set<Decl *> *ptregs_;
 };
 
-ProbeVisitor::ProbeVisitor(Rewriter &rewriter) : rewriter_(rewriter) {}
+// Collect the variables whose value is modified in a function
+class ProbeModified : public RecursiveASTVisitor<ProbeModified> {
+ public:
+  explicit ProbeModified(set<Decl *> *modified) : modified_(modified) {}
+  bool VisitBinaryOperator(BinaryOperator *E) {
+    if (E->isAssignmentOp())
+      mark(E->getLHS());
+    return true;
+  }
+  bool VisitUnaryOperator(UnaryOperator *E) {
+    if (E->isIncrementDecrementOp() || E->getOpcode() == UO_AddrOf)
+      mark(E->getSubExpr());
+    return true;
+  }
+ private:
+  void mark(Expr *E) {
+    if (DeclRefExpr *Ref = dyn_cast<DeclRefExpr>(E->IgnoreParenImpCasts()))
+      modified_->insert(Ref->getDecl());
+  }
+  set<Decl *> *modified_;
+};
+
+// reads further apart than this through the same pointer are not merged
+static const uint64_t PROBE_CACHE_GAP = 16;
+static const uint64_t PROBE_CACHE_MAX = 128;
+// bytes of caches per function, which share the 512 byte stack with the
+// program's own variables and those of the inlined callees
+static const uint64_t PROBE_CACHE_STACK = 192;
+
+ProbeVisitor::ProbeVisitor(ASTContext &C, Rewriter &rewriter)
+    : C(C), rewriter_(rewriter), fn_(nullptr), collecting_(false), next_cache_id_(0) {}
+
+bool ProbeVisitor::TraverseFunctionDecl(FunctionDecl *D) {
+  CompoundStmt *Body = dyn_cast_or_null<CompoundStmt>(D->getBody());
+  FunctionDecl *outer = fn_;
+  fn_ = D;
+  if (!Body || collecting_) {
+    // callees are planned when they get rewritten
+    bool ret = RecursiveASTVisitor<ProbeVisitor>::TraverseFunctionDecl(D);
+    fn_ = outer;
+    return ret;
+  }
+
+  // the parameters and the variables of the outermost block hold the same
+  // value for the whole call unless assigned to, their reads can be cached
+  set<Decl *> modified;
+  ProbeModified(&modified).TraverseStmt(Body);
+  set<Decl *> &stable = stable_[D];
+  for (auto P : D->parameters())
+    if (!modified.count(P))
+      stable.insert(P);
+  for (auto S : Body->body()) {
+    if (DeclStmt *DS = dyn_cast<DeclStmt>(S)) {
+      for (auto V : DS->decls())
+        if (isa<VarDecl>(V) && !modified.count(V))
+          stable.insert(V);
+    }
+  }
+
+  // the collecting walk must leave no trace besides reads_
+  auto ptregs = ptregs_;
+  auto fn_visited = fn_visited_;
+  auto memb_visited = memb_visited_;
+  collecting_ = true;
+  bool ret = RecursiveASTVisitor<ProbeVisitor>::TraverseFunctionDecl(D);
+  collecting_ = false;
+  ptregs_ = ptregs;
+  fn_visited_ = fn_visited;
+  memb_visited_ = memb_visited;
+  if (!ret) {
+    fn_ = outer;
+    return false;
+  }
+  plan_caches(D);
+
+  ret = RecursiveASTVisitor<ProbeVisitor>::TraverseFunctionDecl(D);
+  string decls;
+  for (auto it = caches_.lower_bound(ProbeBase(D, "")); it != caches_.end() && it->first.first == D; ++it) {
+    for (auto &cache : it->second) {
+      if (cache.nreads < 2)
+        continue;
+      string name = "_pcache" + to_string(cache.id);
+      decls += " u64 " + name + "[" + to_string((cache.hi - cache.lo + 7) / 8) + "] = {};";
+      decls += " u8 " + name + "_ok = 0;";
+    }
+  }
+  if (!decls.empty())
+    rewriter_.InsertText(Body->getLBracLoc().getLocWithOffset(1), decls);
+  fn_ = outer;
+  return ret;
+}
+
+// Cluster the reads of each base pointer into ranges worth reading at once
+void ProbeVisitor::plan_caches(FunctionDecl *D) {
+  for (auto it = reads_.lower_bound(ProbeBase(D, "")); it != reads_.end() && it->first.first == D; ++it) {
+    auto &reads = it->second;
+    std::sort(reads.begin(), reads.end(),
+              [](const ProbeRead &a, const ProbeRead &b) { return a.offset < b.offset; });
+    vector<ProbeCache> &caches = caches_[it->first];
+    for (auto &r : reads) {
+      uint64_t end = r.offset + r.size;
+      if (!caches.empty()) {
+        ProbeCache &last = caches.back();
+        uint64_t hi = std::max(last.hi, end);
+        if (r.offset <= last.hi + PROBE_CACHE_GAP && hi - last.lo <= PROBE_CACHE_MAX) {
+          last.hi = hi;
+          ++last.nreads;
+          continue;
+        }
+      }
+      // start 8 byte aligned so that the copies keep the alignment of the fields
+      caches.push_back(ProbeCache{r.offset & ~7ull, end, 1, next_cache_id_++});
+    }
+  }
+
+  // keep the most used caches within the stack budget, the reads of the
+  // others go to bpf_probe_read directly
+  vector<ProbeCache *> used;
+  for (auto it = caches_.lower_bound(ProbeBase(D, "")); it != caches_.end() && it->first.first == D; ++it) {
+    for (auto &cache : it->second)
+      if (cache.nreads >= 2)
+        used.push_back(&cache);
+  }
+  std::stable_sort(used.begin(), used.end(),
+                   [](const ProbeCache *a, const ProbeCache *b) { return a->nreads > b->nreads; });
+  uint64_t total = 0;
+  for (auto cache : used) {
+    // the buffer and its _ok flag, which is padded to 8 bytes
+    uint64_t bytes = ((cache->hi - cache->lo + 7) & ~7ull) + 8;
+    if (total + bytes > PROBE_CACHE_STACK)
+      cache->nreads = 0;
+    else
+      total += bytes;
+  }
+}
+
+// Pointer chains made of stable variables and the fields read through them
+bool ProbeVisitor::stable_base(Expr *E, string *key) {
+  E = E->IgnoreParenImpCasts();
+  if (DeclRefExpr *Ref = dyn_cast<DeclRefExpr>(E)) {
+    if (!stable_[fn_].count(Ref->getDecl()))
+      return false;
+    *key = Ref->getDecl()->getName();
+    return true;
+  }
+  if (MemberExpr *M = dyn_cast<MemberExpr>(E)) {
+    if (!stable_base(M->getBase(), key))
+      return false;
+    *key += (M->isArrow() ? "->" : ".") + M->getMemberDecl()->getName().str();
+    return true;
+  }
+  return false;
+}
+
+// Byte range of E, a chain of member accesses ending in Arrow, relative to the
+// pointer Arrow dereferences. False if the read can't go through a cache.
+bool ProbeVisitor::cached_read(MemberExpr *E, MemberExpr *Arrow, string *key,
+                               uint64_t *offset, uint64_t *size) {
+  if (!fn_ || !stable_.count(fn_))
+    return false;
+  QualType T = E->getType();
+  if (T->isArrayType() || T->isIncompleteType() || lvalues_.count(E))
+    return false;
+  uint64_t off = 0;
+  for (MemberExpr *M = E; M; M = dyn_cast<MemberExpr>(M->getBase())) {
+    FieldDecl *F = dyn_cast<FieldDecl>(M->getMemberDecl());
+    if (!F || F->isBitField())
+      return false;
+    off += C.getFieldOffset(F) >> 3;
+    if (M == Arrow)
+      break;
+  }
+  uint64_t sz = C.getTypeSizeInChars(T).getQuantity();
+  uint64_t align = C.getTypeAlignInChars(T).getQuantity();
+  if (sz == 0 || sz > PROBE_CACHE_MAX || align > 8 || off % align)
+    return false;
+  if (!stable_base(Arrow->getBase(), key))
+    return false;
+  *offset = off;
+  *size = sz;
+  return true;
+}
 
 bool ProbeVisitor::VisitVarDecl(VarDecl *Decl) {
   if (Expr *E = Decl->getInit()) {
@@ -174,6 +355,7 @@ bool ProbeVisitor::VisitCallExpr(CallExpr *Call) {
 bool ProbeVisitor::VisitBinaryOperator(BinaryOperator *E) {
   if (!E->isAssignmentOp())
     return true;
+  lvalues_.insert(E->getLHS()->IgnoreParens());
   // copy probe attribute from RHS to LHS if present
   if (ProbeChecker(E->getRHS(), ptregs_).is_transitive()) {
     ProbeSetter setter(&ptregs_);
@@ -182,7 +364,10 @@ bool ProbeVisitor::VisitBinaryOperator(BinaryOperator *E) {
   return true;
 }
 bool ProbeVisitor::VisitUnaryOperator(UnaryOperator *E) {
-  if (E->getOpcode() == UO_AddrOf)
+  // a copy from the cache would take the address of, or modify, the cache
+  if (E->getOpcode() == UO_AddrOf || E->isIncrementDecrementOp())
+    lvalues_.insert(E->getSubExpr()->IgnoreParens());
+  if (E->getOpcode() == UO_AddrOf || collecting_)
     return true;
   if (memb_visited_.find(E) != memb_visited_.end())
     return true;
@@ -208,19 +393,45 @@ bool ProbeVisitor::VisitMemberExpr(MemberExpr *E) {
 
   Expr *base;
   SourceLocation rhs_start, op;
-  bool found = false;
+  MemberExpr *arrow = nullptr;
   for (MemberExpr *M = E; M; M = dyn_cast<MemberExpr>(M->getBase())) {
     memb_visited_.insert(M);
     rhs_start = M->getLocEnd();
     base = M->getBase();
     op = M->getOperatorLoc();
     if (M->isArrow()) {
-      found = true;
+      arrow = M;
       break;
     }
   }
-  if (!found)
+  if (!arrow)
+    return true;
+
+  string key;
+  uint64_t offset, size;
+  bool cacheable = cached_read(E, arrow, &key, &offset, &size);
+  if (collecting_) {
+    if (cacheable)
+      reads_[ProbeBase(fn_, key)].push_back(ProbeRead{offset, size});
     return true;
+  }
+  if (cacheable) {
+    for (auto &cache : caches_[ProbeBase(fn_, key)]) {
+      if (cache.nreads < 2 || offset < cache.lo || offset + size > cache.hi)
+        continue;
+      string name = "_pcache" + to_string(cache.id);
+      // the buffer is rounded up to u64s, read no further than the last field
+      string pre = "({ if (!" + name + "_ok) { bpf_probe_read(" + name + ", " +
+          to_string(cache.hi - cache.lo) + ", (u64)";
+      string post = " + " + to_string(cache.lo) + "); " + name + "_ok = 1; }";
+      post += " *(typeof(" + E->getType().getAsString() + ") *)((char *)" + name + " + " +
+          to_string(offset - cache.lo) + "); })";
+      rewriter_.InsertText(E->getLocStart(), pre);
+      rewriter_.ReplaceText(SourceRange(op, E->getLocEnd()), post);
+      return true;
+    }
+  }
+
   string rhs = rewriter_.getRewrittenText(SourceRange(rhs_start, E->getLocEnd()));
   string base_type = base->getType()->getPointeeType().getAsString();
   string pre, post;
@@ -302,7 +513,7 @@ bool BTypeVisitor::VisitCallExpr(CallExpr *Call) {
                              Call->getArg(Call->getNumArgs()-1)->getLocEnd());
         string args = rewriter_.getRewrittenText(argRange);
 
-        // find the table fd, which was opened at declaration time
+        // find the placeholder fd, assigned at declaration time
         auto table_it = tables_.begin();
         for (; table_it != tables_.end(); ++table_it)
           if (table_it->name == Ref->getDecl()->getName()) break;
@@ -312,6 +523,18 @@ bool BTypeVisitor::VisitCallExpr(CallExpr *Call) {
           return false;
         }
         string fd = to_string(table_it->fd);
+        // the map the call goes to, for a BPF_TABLE_SWAP the copy in use
+        string map = "bpf_pseudo_fd(1, " + fd + ")";
+        string map_decl;
+        auto swap_it = swaps_.find(table_it->name);
+        if (swap_it != swaps_.end()) {
+          map = "({ int _sw_key = 0; u32 *_sw = bpf_map_lookup_elem_(bpf_pseudo_fd(1, " +
+              to_string(swap_it->second.second) + "), &_sw_key); ";
+          map += "_sw && *_sw ? bpf_pseudo_fd(1, " + to_string(swap_it->second.first) + ") : " +
+              "bpf_pseudo_fd(1, " + fd + "); })";
+          // calls that use the map twice pick the copy once
+          map_decl = "u64 _sw_map = " + map + "; ";
+        }
         string prefix, suffix;
         string map_update_policy = "BPF_ANY";
         string txt;
@@ -324,9 +547,10 @@ bool BTypeVisitor::VisitCallExpr(CallExpr *Call) {
                                                                Call->getArg(0)->getLocEnd()));
           string arg1 = rewriter_.getRewrittenText(SourceRange(Call->getArg(1)->getLocStart(),
                                                                Call->getArg(1)->getLocEnd()));
-          string lookup = "bpf_map_lookup_elem_(bpf_pseudo_fd(1, " + fd + ")";
-          string update = "bpf_map_update_elem_(bpf_pseudo_fd(1, " + fd + ")";
-          txt  = "({typeof(" + name + ".leaf) *leaf = " + lookup + ", " + arg0 + "); ";
+          string m = map_decl.empty() ? map : "_sw_map";
+          string lookup = "bpf_map_lookup_elem_(" + m;
+          string update = "bpf_map_update_elem_(" + m;
+          txt  = "({" + map_decl + "typeof(" + name + ".leaf) *leaf = " + lookup + ", " + arg0 + "); ";
           txt += "if (!leaf) {";
           txt += " " + update + ", " + arg0 + ", " + arg1 + ", " + map_update_policy + ");";
           txt += " leaf = " + lookup + ", " + arg0 + ");";
@@ -337,9 +561,10 @@ bool BTypeVisitor::VisitCallExpr(CallExpr *Call) {
           string name = Ref->getDecl()->getName();
           string arg0 = rewriter_.getRewrittenText(SourceRange(Call->getArg(0)->getLocStart(),
                                                                Call->getArg(0)->getLocEnd()));
-          string lookup = "bpf_map_lookup_elem_(bpf_pseudo_fd(1, " + fd + ")";
-          string update = "bpf_map_update_elem_(bpf_pseudo_fd(1, " + fd + ")";
-          txt  = "({ typeof(" + name + ".key) _key = " + arg0 + "; ";
+          string m = map_decl.empty() ? map : "_sw_map";
+          string lookup = "bpf_map_lookup_elem_(" + m;
+          string update = "bpf_map_update_elem_(" + m;
+          txt  = "({ " + map_decl + "typeof(" + name + ".key) _key = " + arg0 + "; ";
           if (table_it->type == BPF_MAP_TYPE_HASH) {
             txt += "typeof(" + name + ".leaf) _zleaf; memset(&_zleaf, 0, sizeof(_zleaf)); ";
             txt += update + ", &_key, &_zleaf, BPF_NOEXIST); ";
@@ -388,7 +613,7 @@ bool BTypeVisitor::VisitCallExpr(CallExpr *Call) {
                 << "valid bpf_table operation";
             return false;
           }
-          prefix += "((void *)bpf_pseudo_fd(1, " + fd + "), ";
+          prefix += "((void *)" + map + ", ";
 
           txt = prefix + args + suffix;
         }
@@ -512,6 +737,44 @@ bool BTypeVisitor::VisitImplicitCastExpr(ImplicitCastExpr *E) {
   return true;
 }
 
+// convert references to a BPF_CONST (as denoted by section("consts/*")) into
+// a placeholder load, bound to the value when the function is loaded:
+//  ((type)bpf_pseudo_fd(BPF_PSEUDO_CONST, bpf_const_hash(name)))
+bool BTypeVisitor::VisitDeclRefExpr(DeclRefExpr *E) {
+  VarDecl *Decl = dyn_cast<VarDecl>(E->getDecl());
+  if (!Decl)
+    return true;
+  SectionAttr *A = Decl->getAttr<SectionAttr>();
+  if (!A || !A->getName().startswith("consts/"))
+    return true;
+  QualType T = Decl->getType();
+  if (!T->isIntegralOrEnumerationType() || C.getTypeSize(T) > 64) {
+    unsigned diag_id = diag_.getCustomDiagID(DiagnosticsEngine::Error,
+                                             "BPF_CONST type must be an integer of at most 64 bits, got %0");
+    diag_.Report(Decl->getLocStart(), diag_id) << T.getAsString();
+    return false;
+  }
+  if (!rewriter_.isRewritable(E->getLocStart())) {
+    C.getDiagnostics().Report(E->getLocStart(), diag::err_expected)
+        << "use of BPF_CONST not in a macro";
+    return false;
+  }
+  string name = Decl->getName();
+  unsigned hash = bpf_const_hash(name.c_str());
+  auto it = consts_.find(hash);
+  if (it != consts_.end() && it->second != name) {
+    unsigned diag_id = diag_.getCustomDiagID(DiagnosticsEngine::Error,
+                                             "BPF_CONST %0 collides with %1, rename one of them");
+    diag_.Report(Decl->getLocStart(), diag_id) << name << it->second;
+    return false;
+  }
+  consts_[hash] = name;
+  string text = "((" + T.getUnqualifiedType().getAsString() + ")bpf_pseudo_fd(" +
+      to_string(BPF_PSEUDO_CONST) + ", " + to_string(hash) + "u))";
+  rewriter_.ReplaceText(SourceRange(E->getLocStart(), E->getLocEnd()), text);
+  return true;
+}
+
 // Open table FDs when bpf tables (as denoted by section("maps*") attribute)
 // are declared.
 bool BTypeVisitor::VisitVarDecl(VarDecl *Decl) {
@@ -598,7 +861,7 @@ bool BTypeVisitor::VisitVarDecl(VarDecl *Decl) {
       map_type = BPF_MAP_TYPE_STACK_TRACE;
     } else if (A->getName() == "maps/extern") {
       is_extern = true;
-      table.fd = SharedTables::instance()->lookup_fd(table.name);
+      table.is_extern = true;
     } else if (A->getName() == "maps/export") {
       if (table.name.substr(0, 2) == "__")
         table.name = table.name.substr(2);
@@ -611,13 +874,32 @@ bool BTypeVisitor::VisitVarDecl(VarDecl *Decl) {
         C.getDiagnostics().Report(Decl->getLocStart(), diag_id);
         return false;
       }
-      if (!SharedTables::instance()->insert_fd(table.name, table_it->fd)) {
+      // exported by BPFModule::instantiate()
+      table_it->is_shared = true;
+      return true;
+    } else if (A->getName() == "maps/swap") {
+      // the copies and the index are declared before as regular tables
+      string name = table.name.substr(string("__swap_").size());
+      auto find = [&](const string &n) -> TableDesc * {
+        for (auto &t : tables_)
+          if (t.name == n) return &t;
+        return nullptr;
+      };
+      TableDesc *orig = find(name), *copy = find(name + "__1"), *active = find(name + "__active");
+      if (!orig || !copy || !active) {
         unsigned diag_id = C.getDiagnostics().getCustomDiagID(DiagnosticsEngine::Error,
-                                                              "could not export bpf map %0: %1");
-        C.getDiagnostics().Report(Decl->getLocStart(), diag_id) << table.name << "already in use";
+                                                              "reference to undefined table");
+        C.getDiagnostics().Report(Decl->getLocStart(), diag_id);
         return false;
       }
-      table_it->is_shared = true;
+      if (orig->type != BPF_MAP_TYPE_HASH && orig->type != BPF_MAP_TYPE_ARRAY &&
+          orig->type != BPF_MAP_TYPE_PERCPU_HASH && orig->type != BPF_MAP_TYPE_PERCPU_ARRAY) {
+        unsigned diag_id = diag_.getCustomDiagID(DiagnosticsEngine::Error,
+                                                 "BPF_TABLE_SWAP needs a hash or array table");
+        diag_.Report(Decl->getLocStart(), diag_id);
+        return false;
+      }
+      swaps_[name] = std::make_pair(copy->fd, active->fd);
       return true;
     }
 
@@ -630,14 +912,10 @@ bool BTypeVisitor::VisitVarDecl(VarDecl *Decl) {
       }
 
       table.type = map_type;
-      table.fd = bpf_create_map(map_type, table.key_size, table.leaf_size, table.max_entries);
-    }
-    if (table.fd < 0) {
-      unsigned diag_id = C.getDiagnostics().getCustomDiagID(DiagnosticsEngine::Error,
-                                                            "could not open bpf map: %0");
-      C.getDiagnostics().Report(Decl->getLocStart(), diag_id) << strerror(errno);
-      return false;
     }
+    // maps are created by BPFModule::instantiate(), until then the table is
+    // referred to by its index
+    table.fd = tables_.size();
 
     tables_.push_back(std::move(table));
   } else if (const PointerType *P = Decl->getType()->getAs<PointerType>()) {
@@ -667,7 +945,7 @@ bool BTypeConsumer::HandleTopLevelDecl(DeclGroupRef Group) {
 }
 
 ProbeConsumer::ProbeConsumer(ASTContext &C, Rewriter &rewriter)
-    : visitor_(rewriter) {}
+    : visitor_(C, rewriter) {}
 
 bool ProbeConsumer::HandleTopLevelDecl(DeclGroupRef Group) {
   for (auto D : Group) {
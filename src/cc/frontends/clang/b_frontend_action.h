@@ -71,6 +71,7 @@ class BTypeVisitor : public clang::RecursiveASTVisitor<BTypeVisitor> {
   bool VisitVarDecl(clang::VarDecl *Decl);
   bool VisitBinaryOperator(clang::BinaryOperator *E);
   bool VisitImplicitCastExpr(clang::ImplicitCastExpr *E);
+  bool VisitDeclRefExpr(clang::DeclRefExpr *E);
 
  private:
   clang::ASTContext &C;
@@ -80,12 +81,19 @@ class BTypeVisitor : public clang::RecursiveASTVisitor<BTypeVisitor> {
   std::vector<TableDesc> &tables_;  /// store the open FDs
   std::vector<clang::ParmVarDecl *> fn_args_;
   std::set<clang::Expr *> visited_;
+  std::map<unsigned, std::string> consts_;  /// BPF_CONST hash to name
+  std::map<std::string, std::pair<int, int>> swaps_;  /// BPF_TABLE_SWAP to its copy and index
 };
 
-// Do a depth-first search to rewrite all pointers that need to be probed
+// Do a depth-first search to rewrite all pointers that need to be probed.
+// Each function is walked twice: first to collect the field reads through
+// pointers that the function never modifies, then to rewrite. Reads of nearby
+// fields through the same pointer share one bpf_probe_read of the covering
+// range, done on first use, which also serves repeated reads.
 class ProbeVisitor : public clang::RecursiveASTVisitor<ProbeVisitor> {
  public:
-  explicit ProbeVisitor(clang::Rewriter &rewriter);
+  explicit ProbeVisitor(clang::ASTContext &C, clang::Rewriter &rewriter);
+  bool TraverseFunctionDecl(clang::FunctionDecl *D);
   bool VisitVarDecl(clang::VarDecl *Decl);
   bool VisitCallExpr(clang::CallExpr *Call);
   bool VisitBinaryOperator(clang::BinaryOperator *E);
@@ -93,10 +101,34 @@ class ProbeVisitor : public clang::RecursiveASTVisitor<ProbeVisitor> {
   bool VisitMemberExpr(clang::MemberExpr *E);
   void set_ptreg(clang::Decl *D) { ptregs_.insert(D); }
  private:
+  struct ProbeRead {
+    uint64_t offset;
+    uint64_t size;
+  };
+  struct ProbeCache {
+    uint64_t lo, hi;  // byte range read from the base pointer
+    unsigned nreads;
+    unsigned id;
+  };
+  typedef std::pair<clang::Decl *, std::string> ProbeBase;  // function, base
+
+  bool stable_base(clang::Expr *E, std::string *key);
+  bool cached_read(clang::MemberExpr *E, clang::MemberExpr *Arrow, std::string *key,
+                   uint64_t *offset, uint64_t *size);
+  void plan_caches(clang::FunctionDecl *D);
+
+  clang::ASTContext &C;
   clang::Rewriter &rewriter_;
   std::set<clang::Decl *> fn_visited_;
   std::set<clang::Expr *> memb_visited_;
   std::set<clang::Decl *> ptregs_;
+  std::set<clang::Expr *> lvalues_;  /// assigned to or address taken
+  clang::FunctionDecl *fn_;  /// function being walked
+  bool collecting_;
+  unsigned next_cache_id_;
+  std::map<clang::Decl *, std::set<clang::Decl *>> stable_;  /// unmodified pointers
+  std::map<ProbeBase, std::vector<ProbeRead>> reads_;
+  std::map<ProbeBase, std::vector<ProbeCache>> caches_;
 };
 
 // A helper class to the frontend action, walks the decls
@@ -30,33 +30,6 @@ struct FileDeleter {
 };
 typedef std::unique_ptr<FILE, FileDeleter> FILEPtr;
 
-// Helper with pushd/popd semantics
-class DirStack {
- public:
-  explicit DirStack(const std::string &dst) : ok_(false) {
-    if (getcwd(cwd_, sizeof(cwd_)) == NULL) {
-      ::perror("getcwd");
-      return;
-    }
-    if (::chdir(dst.c_str())) {
-      fprintf(stderr, "chdir(%s): %s\n", dst.c_str(), strerror(errno));
-      return;
-    }
-    ok_ = true;
-  }
-  ~DirStack() {
-    if (!ok_) return;
-    if (::chdir(cwd_)) {
-      fprintf(stderr, "chdir(%s): %s\n", cwd_, strerror(errno));
-    }
-  }
-  bool ok() const { return ok_; }
-  const char * cwd() const { return cwd_; }
- private:
-  bool ok_;
-  char cwd_[256];
-};
-
 static int ftw_cb(const char *path, const struct stat *, int, struct FTW *) {
   return ::remove(path);
 }
@@ -20,15 +20,23 @@
 #include <fcntl.h>
 #include <ftw.h>
 #include <map>
+#include <mutex>
+#include <sstream>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string>
 #include <sys/stat.h>
 #include <sys/utsname.h>
+#include <time.h>
 #include <unistd.h>
 #include <vector>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
 #include <linux/bpf.h>
 
 #include <clang/Basic/FileManager.h>
+#include <clang/Basic/SourceManager.h>
 #include <clang/Basic/TargetInfo.h>
 #include <clang/CodeGen/BackendUtil.h>
 #include <clang/CodeGen/CodeGenAction.h>
@@ -45,47 +53,369 @@
 
 #include <llvm/IR/Module.h>
 
+#include "archive_fs.h"
+#include "bpf_common.h"
 #include "common.h"
+#include "compile_stats.h"
 #include "exception.h"
 #include "exported_files.h"
+#include "header_archive.h"
 #include "kbuild_helper.h"
 #include "b_frontend_action.h"
 #include "loader.h"
+#include "module_cache.h"
+#include "type_db.h"
 
 using std::map;
+using std::shared_ptr;
 using std::string;
 using std::unique_ptr;
 using std::vector;
 
 namespace ebpf {
 
-map<string, unique_ptr<llvm::MemoryBuffer>> ClangLoader::remapped_files_;
+shared_ptr<const HeaderArchive> ClangLoader::exported_headers_;
+size_t ClangLoader::num_loaders_ = 0;
+// exported_headers_ only changes when the first loader is created or the
+// last one destroyed, the loaders in between read it without locking
+static std::mutex exported_headers_mutex;
 
-ClangLoader::ClangLoader(llvm::LLVMContext *ctx, unsigned flags)
-    : ctx_(ctx), flags_(flags)
+ClangLoader::ClangLoader(llvm::LLVMContext *ctx, unsigned flags, CompileStats *stats)
+    : ctx_(ctx), flags_(flags), stats_(stats)
 {
-  if (remapped_files_.empty()) {
-    for (auto f : ExportedFiles::headers())
-      remapped_files_[f.first] = llvm::MemoryBuffer::getMemBuffer(f.second);
+  std::lock_guard<std::mutex> lock(exported_headers_mutex);
+  if (num_loaders_++ == 0)
+    exported_headers_ = HeaderArchive::pack(ExportedFiles::headers(),
+                                            {"/virtual/include", "/virtual/lib"});
+}
+
+ClangLoader::~ClangLoader() {
+  std::lock_guard<std::mutex> lock(exported_headers_mutex);
+  if (--num_loaders_ == 0)
+    exported_headers_.reset();
+}
+
+namespace {
+
+// "<size> <mtime> <path>" of every file the compile read, one per line. The
+// embedded headers and those read from the archives are skipped since they
+// are covered by the cache keys.
+string list_deps(clang::CompilerInstance &ci, const vector<shared_ptr<const HeaderArchive>> &archives) {
+  clang::SourceManager &sm = ci.getSourceManager();
+  clang::FileManager &fm = ci.getFileManager();
+  std::ostringstream os;
+  for (auto it = sm.fileinfo_begin(); it != sm.fileinfo_end(); ++it) {
+    const clang::FileEntry *fe = it->first;
+    if (!strncmp(fe->getName(), "/virtual/", 9))
+      continue;
+    // kernel headers are named relative to the -working-directory
+    llvm::SmallString<256> path(fe->getName());
+    fm.makeAbsolutePath(path);
+    string abs = HeaderArchive::normalize(path.str().str());
+    if (std::any_of(archives.begin(), archives.end(),
+                    [&abs](const shared_ptr<const HeaderArchive> &a) { return a->covers(abs); }))
+      continue;
+    os << (long long)fe->getSize() << " " << (long long)fe->getModificationTime() << " "
+       << path.str().str() << "\n";
+  }
+  return os.str();
+}
+
+// Generates the PCH and records the files it was built from
+class PCHAction : public clang::GeneratePCHAction {
+ public:
+  PCHAction(const vector<shared_ptr<const HeaderArchive>> &archives, string *deps)
+      : archives_(archives), deps_(deps) {}
+  void EndSourceFileAction() override {
+    *deps_ = list_deps(getCompilerInstance(), archives_);
+    clang::GeneratePCHAction::EndSourceFileAction();
+  }
+ private:
+  const vector<shared_ptr<const HeaderArchive>> &archives_;
+  string *deps_;
+};
+
+// Extracts the type database once the kernel headers are parsed
+class TypeDBAction : public clang::SyntaxOnlyAction {
+ public:
+  TypeDBAction(const vector<string> &include_dirs, const vector<string> &types, string *data,
+               vector<string> *missing)
+      : include_dirs_(include_dirs), types_(types), data_(data), missing_(missing) {}
+  void EndSourceFileAction() override {
+    clang::CompilerInstance &ci = getCompilerInstance();
+    if (!ci.getDiagnostics().hasErrorOccurred())
+      *data_ = TypeDB::extract(ci.getASTContext(), ci.getPreprocessor(), include_dirs_, types_,
+                               missing_);
+    clang::SyntaxOnlyAction::EndSourceFileAction();
+  }
+ private:
+  const vector<string> &include_dirs_;
+  const vector<string> &types_;
+  string *data_;
+  vector<string> *missing_;
+};
+
+// The -cc1 job of the driver for flags, whose arguments live as long as
+// compilation. Returns null and reports why if there is not exactly one.
+const clang::driver::Command * clang_command(clang::driver::Driver &drv,
+                                             clang::DiagnosticsEngine &diags,
+                                             const vector<const char *> &flags,
+                                             unique_ptr<clang::driver::Compilation> *compilation) {
+  using namespace clang;
+
+  compilation->reset(drv.BuildCompilation(flags));
+  if (!*compilation)
+    return nullptr;
+
+  // expect exactly 1 job, otherwise error
+  const driver::JobList &jobs = (*compilation)->getJobs();
+  if (jobs.size() != 1 || !isa<driver::Command>(*jobs.begin())) {
+    SmallString<256> msg;
+    llvm::raw_svector_ostream os(msg);
+    jobs.Print(os, "; ", true);
+    diags.Report(diag::err_fe_expected_compiler_job) << os.str();
+    return nullptr;
   }
+
+  const driver::Command &cmd = cast<driver::Command>(*jobs.begin());
+  if (llvm::StringRef(cmd.getCreator().getName()) != "clang") {
+    diags.Report(diag::err_fe_expected_clang_command);
+    return nullptr;
+  }
+  return &cmd;
+}
+
+string kernel_modules_dir(const struct utsname &un) {
+  return string(KERNEL_MODULES_DIR) + "/" + un.release + "/" + KERNEL_MODULES_SUFFIX;
 }
 
-ClangLoader::~ClangLoader() {}
+// The compiler's view of the filesystem: the embedded headers and the
+// kernel header snapshot from their archives, the program's files from disk
+llvm::IntrusiveRefCntPtr<clang::vfs::FileSystem> archive_fs(
+    const vector<shared_ptr<const HeaderArchive>> &archives) {
+  return new ArchiveFileSystem(archives, clang::vfs::getRealFileSystem());
+}
+
+// The directories the kbuild flags search, which the header snapshot
+// covers, and the files that tell when it is out of date
+void kernel_tree(const string &kdir, const string &kmod_dir, const vector<string> &kflags,
+                 vector<string> *roots, vector<string> *witnesses) {
+  for (size_t i = 0; i < kflags.size(); ++i) {
+    string dir;
+    if (!kflags[i].compare(0, 2, "-I"))
+      dir = kflags[i].substr(2);
+    else if (kflags[i] == "-isystem" && i + 1 < kflags.size())
+      dir = kflags[++i];
+    if (dir.empty() || !dir.compare(0, 9, "/virtual/"))
+      continue;
+    roots->push_back(dir[0] == '/' ? dir : kmod_dir + "/" + dir);
+  }
+  witnesses->push_back(kmod_dir + "/include/generated/autoconf.h");
+  if (KERNEL_HAS_SOURCE_DIR)
+    witnesses->push_back(kdir + "/build/include/generated/autoconf.h");
+  witnesses->insert(witnesses->end(), roots->begin(), roots->end());
+}
+
+// The snapshot of the kernel headers that the kbuild flags point to, see
+// HeaderArchive. It is taken from $BCC_HEADER_ARCHIVE, or else kept in the
+// module cache per kernel release and taken again when the headers change.
+// An empty $BCC_HEADER_ARCHIVE reads the headers from disk.
+shared_ptr<const HeaderArchive> kernel_headers(const struct utsname &un, const string &kdir,
+                                               const vector<string> &kflags) {
+  static std::mutex mutex;
+  static shared_ptr<const HeaderArchive> cached;
+  static string cached_path;
+  // when the snapshot was last found fresh. A compile asks twice, for the
+  // cache key and for the parse, and the check stats every archived
+  // directory, so one from the last second or two is trusted.
+  static struct timespec checked;
+  const time_t fresh_for = 2;
+
+  const char *env = getenv("BCC_HEADER_ARCHIVE");
+  if (env && !env[0])
+    return nullptr;
+  string key = string("headers-") + un.release;
+  string path;
+  if (env)
+    path = env;
+  else if (!ModuleCache::path(key, &path))
+    return nullptr;
+  string kmod_dir = kernel_modules_dir(un);
+  // without the headers, the snapshot is all there is
+  bool have_headers = ::access(kmod_dir.c_str(), X_OK) == 0;
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  std::lock_guard<std::mutex> lock(mutex);
+  if (cached && cached_path == path) {
+    if (!have_headers || now.tv_sec - checked.tv_sec < fresh_for)
+      return cached;
+    if (cached->fresh()) {
+      checked = now;
+      return cached;
+    }
+  }
+  cached.reset();
+
+  shared_ptr<const HeaderArchive> archive;
+  if (env) {
+    archive = HeaderArchive::open(path);
+    if (!archive) {
+      fprintf(stderr, "Cannot use the header archive %s\n", path.c_str());
+      return nullptr;
+    }
+    if (have_headers && !archive->fresh()) {
+      fprintf(stderr, "%s: out of date, reading the kernel headers\n", path.c_str());
+      return nullptr;
+    }
+  } else {
+    int fd = ModuleCache::open(key);
+    if (fd >= 0)
+      archive = HeaderArchive::open(fd, path);
+    if (archive && have_headers && !archive->fresh())
+      archive.reset();
+    if (!archive && have_headers) {
+      vector<string> roots, witnesses;
+      kernel_tree(kdir, kmod_dir, kflags, &roots, &witnesses);
+      if (HeaderArchive::create(path, roots, witnesses) && (fd = ModuleCache::open(key)) >= 0)
+        archive = HeaderArchive::open(fd, path);
+    }
+  }
+  cached = archive;
+  cached_path = path;
+  checked = now;
+  return archive;
+}
+
+}  // namespace
+
+bool ClangLoader::deps_ok(const string &deps) {
+  std::istringstream is(deps);
+  string line;
+  while (std::getline(is, line)) {
+    long long size, mtime;
+    int off = 0;
+    if (sscanf(line.c_str(), "%lld %lld %n", &size, &mtime, &off) != 2 || !off)
+      return false;
+    struct stat st;
+    if (::stat(line.c_str() + off, &st) < 0 || st.st_size != size || st.st_mtime != mtime)
+      return false;
+  }
+  return true;
+}
+
+// The implicit includes (kconfig.h or the type database's kernel_types.h,
+// bcc/bpf.h, bcc/helpers.h and any -include from cflags) are identical for
+// every program built with the same flags against the same kernel, so they
+// are parsed once into a PCH that is kept in the module cache directory.
+// Returns the path of an up to date PCH, or an empty string if none could be
+// built, and the files it depends on.
+string ClangLoader::get_pch(const vector<const char *> &ccargs, const vector<string> &kflags,
+                            const char *cflags[], int ncflags,
+                            const map<string, unique_ptr<llvm::MemoryBuffer>> &files,
+                            const vector<shared_ptr<const HeaderArchive>> &archives,
+                            const string &salt, string *deps) {
+  using namespace clang;
+
+  if (!ModuleCache::enabled())
+    return "";
+
+  vector<const char *> key_flags;
+  for (auto &f : kflags)
+    key_flags.push_back(f.c_str());
+  for (int i = 0; cflags && i < ncflags; ++i)
+    key_flags.push_back(cflags[i]);
+  if (!salt.empty())
+    key_flags.push_back(salt.c_str());
+  string key = ModuleCache::make_key("/virtual/pch.h", "", key_flags.data(), key_flags.size());
+
+  string pch_path;
+  if (!ModuleCache::path(key + ".pch", &pch_path))
+    return "";
+  if (ModuleCache::read(key + ".pch.deps", deps) && deps_ok(*deps) &&
+      ::access(pch_path.c_str(), R_OK) == 0)
+    return pch_path;
+
+  // failures are reported by the real compile, keep this one quiet
+  IntrusiveRefCntPtr<DiagnosticOptions> diag_opts(new DiagnosticOptions());
+  IntrusiveRefCntPtr<DiagnosticIDs> DiagID(new DiagnosticIDs());
+  DiagnosticsEngine diags(DiagID, &*diag_opts, new IgnoringDiagConsumer());
+
+  auto invocation = make_unique<CompilerInvocation>();
+  if (!CompilerInvocation::CreateFromArgs(*invocation, ccargs.data(), ccargs.data() + ccargs.size(),
+                                          diags))
+    return "";
+
+  unique_ptr<llvm::MemoryBuffer> pch_buf = llvm::MemoryBuffer::getMemBuffer("");
+  invocation->getPreprocessorOpts().RetainRemappedFileBuffers = true;
+  for (const auto &f : files)
+    invocation->getPreprocessorOpts().addRemappedFile(f.first, &*f.second);
+  invocation->getPreprocessorOpts().addRemappedFile("/virtual/pch.h", &*pch_buf);
+  invocation->getFrontendOpts().Inputs.clear();
+  invocation->getFrontendOpts().Inputs.push_back(FrontendInputFile("/virtual/pch.h", IK_C));
+  invocation->getFrontendOpts().OutputFile = pch_path;
+  invocation->getFrontendOpts().DisableFree = false;
+
+  CompilerInstance compiler;
+  compiler.setInvocation(invocation.release());
+  compiler.setVirtualFileSystem(archive_fs(archives));
+  compiler.createDiagnostics(new IgnoringDiagConsumer());
+
+  // clang writes the output to a temporary and renames it into place
+  PCHAction pch_act(archives, deps);
+  if (!compiler.ExecuteAction(pch_act))
+    return "";
+  if (!ModuleCache::write(key + ".pch.deps", *deps))
+    return "";
+  return pch_path;
+}
 
 int ClangLoader::parse(unique_ptr<llvm::Module> *mod, unique_ptr<vector<TableDesc>> *tables,
                        const string &file, bool in_memory, const char *cflags[], int ncflags) {
   using namespace clang;
 
+  CompileStats::Timer driver_timer(stats_, "clang_driver");
   string main_path = "/virtual/main.c";
   unique_ptr<llvm::MemoryBuffer> main_buf;
   struct utsname un;
   uname(&un);
   string kdir = string(KERNEL_MODULES_DIR) + "/" + un.release;
 
-  // clang needs to run inside the kernel dir
-  DirStack dstack(kdir + "/" + KERNEL_MODULES_SUFFIX);
-  if (!dstack.ok())
+  // the kbuild flags are relative to the kernel dir. clang resolves them
+  // against -working-directory, so the process cwd is left alone and
+  // modules can be compiled from several threads.
+  string kmod_dir = kernel_modules_dir(un);
+  bool use_type_db = flags_ & BPF_MODULE_KERNEL_TYPES;
+  int kmod_errno = 0;
+  vector<string> kflags;
+  shared_ptr<const HeaderArchive> kheaders;
+  if (!use_type_db) {
+    KBuildHelper kbuild_helper(kdir);
+    if (kbuild_helper.get_flags(un.machine, &kflags))
+      return -1;
+    // the headers are read from their snapshot, which may outlive them
+    kheaders = kernel_headers(un, kdir, kflags);
+    if (!kheaders && ::access(kmod_dir.c_str(), X_OK) < 0) {
+      kmod_errno = errno;
+      use_type_db = true;
+      kflags.clear();
+    }
+  }
+  // without the headers, compile against the type database if there is one
+  std::shared_ptr<const TypeDB> type_db;
+  if (use_type_db && !(type_db = TypeDB::open())) {
+    if (kmod_errno)
+      fprintf(stderr, "%s: %s\n", kmod_dir.c_str(), strerror(kmod_errno));
+    else
+      fprintf(stderr, "No kernel type database for %s\n", un.release);
+    return -1;
+  }
+  char cwd[PATH_MAX];
+  if (::getcwd(cwd, sizeof(cwd)) == NULL) {
+    ::perror("getcwd");
     return -1;
+  }
 
   string abs_file;
   if (in_memory) {
@@ -95,18 +425,21 @@ int ClangLoader::parse(unique_ptr<llvm::Module> *mod, unique_ptr<vector<TableDes
     if (file.substr(0, 1) == "/")
       abs_file = file;
     else
-      abs_file = string(dstack.cwd()) + "/" + file;
+      abs_file = string(cwd) + "/" + file;
   }
 
-  vector<const char *> flags_cstr({"-O0", "-emit-llvm", "-I", dstack.cwd(),
+  vector<const char *> flags_cstr({"-O0", "-emit-llvm", "-I", cwd,
+                                   "-working-directory", type_db ? cwd : kmod_dir.c_str(),
                                    "-Wno-deprecated-declarations",
                                    "-Wno-gnu-variable-sized-type-not-at-end",
                                    "-x", "c", "-c", abs_file.c_str()});
 
-  KBuildHelper kbuild_helper(kdir);
-  vector<string> kflags;
-  if (kbuild_helper.get_flags(un.machine, &kflags))
-    return -1;
+  map<string, unique_ptr<llvm::MemoryBuffer>> type_db_files;
+  if (type_db) {
+    type_db->get_flags(&kflags);
+    for (auto &f : type_db->files())
+      type_db_files[f.first] = llvm::MemoryBuffer::getMemBuffer(f.second);
+  }
   kflags.push_back("-include");
   kflags.push_back("/virtual/include/bcc/bpf.h");
   kflags.push_back("-include");
@@ -132,28 +465,13 @@ int ClangLoader::parse(unique_ptr<llvm::Module> *mod, unique_ptr<vector<TableDes
   drv.setTitle("bcc-clang-driver");
   drv.setCheckInputsExist(false);
 
-  unique_ptr<driver::Compilation> compilation(drv.BuildCompilation(flags_cstr));
-  if (!compilation)
-    return -1;
-
-  // expect exactly 1 job, otherwise error
-  const driver::JobList &jobs = compilation->getJobs();
-  if (jobs.size() != 1 || !isa<driver::Command>(*jobs.begin())) {
-    SmallString<256> msg;
-    llvm::raw_svector_ostream os(msg);
-    jobs.Print(os, "; ", true);
-    diags.Report(diag::err_fe_expected_compiler_job) << os.str();
+  unique_ptr<driver::Compilation> compilation;
+  const driver::Command *cmd = clang_command(drv, diags, flags_cstr, &compilation);
+  if (!cmd)
     return -1;
-  }
-
-  const driver::Command &cmd = cast<driver::Command>(*jobs.begin());
-  if (llvm::StringRef(cmd.getCreator().getName()) != "clang") {
-    diags.Report(diag::err_fe_expected_clang_command);
-    return -1;
-  }
 
   // Initialize a compiler invocation object from the clang (-cc1) arguments.
-  const driver::ArgStringList &ccargs = cmd.getArguments();
+  const driver::ArgStringList &ccargs = cmd->getArguments();
 
   if (flags_ & DEBUG_PREPROCESSOR) {
     llvm::errs() << "clang";
@@ -162,17 +480,36 @@ int ClangLoader::parse(unique_ptr<llvm::Module> *mod, unique_ptr<vector<TableDes
     llvm::errs() << "\n";
   }
 
+  driver_timer.stop();
+
+  vector<shared_ptr<const HeaderArchive>> archives({exported_headers_});
+  if (kheaders)
+    archives.push_back(kheaders);
+
+  CompileStats::Timer pch_timer(stats_, "clang_pch");
+  vector<const char *> pch_args(ccargs.begin(), ccargs.end());
+  string pch_deps, pch_path;
+  // the preprocessor dump shows the implicit includes, which the PCH hides
+  if (!(flags_ & DEBUG_PREPROCESSOR))
+    pch_path = get_pch(pch_args, kflags, cflags, ncflags, type_db_files, archives,
+                       type_db ? type_db->stamp() : kheaders ? kheaders->stamp() : "",
+                       &pch_deps);
+  if (pch_path.empty())
+    pch_deps.clear();
+  pch_timer.stop();
+
   // first pass
+  CompileStats::Timer rewrite_timer(stats_, "clang_rewrite");
   auto invocation1 = make_unique<CompilerInvocation>();
   if (!CompilerInvocation::CreateFromArgs(*invocation1, const_cast<const char **>(ccargs.data()),
                                           const_cast<const char **>(ccargs.data()) + ccargs.size(), diags))
     return -1;
 
   // This option instructs clang whether or not to free the file buffers that we
-  // give to it. Since the embedded header files should be copied fewer times
+  // give to it. Since the type database headers should be copied fewer times
   // and reused if possible, set this flag to true.
   invocation1->getPreprocessorOpts().RetainRemappedFileBuffers = true;
-  for (const auto &f : remapped_files_)
+  for (const auto &f : type_db_files)
     invocation1->getPreprocessorOpts().addRemappedFile(f.first, &*f.second);
 
   if (in_memory) {
@@ -181,9 +518,14 @@ int ClangLoader::parse(unique_ptr<llvm::Module> *mod, unique_ptr<vector<TableDes
     invocation1->getFrontendOpts().Inputs.push_back(FrontendInputFile(main_path, IK_C));
   }
   invocation1->getFrontendOpts().DisableFree = false;
+  if (!pch_path.empty()) {
+    invocation1->getPreprocessorOpts().Includes.clear();
+    invocation1->getPreprocessorOpts().ImplicitPCHInclude = pch_path;
+  }
 
   CompilerInstance compiler1;
   compiler1.setInvocation(invocation1.release());
+  compiler1.setVirtualFileSystem(archive_fs(archives));
   compiler1.createDiagnostics();
 
   // capture the rewritten c file
@@ -195,30 +537,160 @@ int ClangLoader::parse(unique_ptr<llvm::Module> *mod, unique_ptr<vector<TableDes
   unique_ptr<llvm::MemoryBuffer> out_buf = llvm::MemoryBuffer::getMemBuffer(out_str);
   // this contains the open FDs
   *tables = bact.take_tables();
-
-  // second pass, clear input and take rewrite buffer
-  auto invocation2 = make_unique<CompilerInvocation>();
-  if (!CompilerInvocation::CreateFromArgs(*invocation2, const_cast<const char **>(ccargs.data()),
-                                          const_cast<const char **>(ccargs.data()) + ccargs.size(), diags))
-    return -1;
-  CompilerInstance compiler2;
-  invocation2->getPreprocessorOpts().RetainRemappedFileBuffers = true;
-  for (const auto &f : remapped_files_)
-    invocation2->getPreprocessorOpts().addRemappedFile(f.first, &*f.second);
-  invocation2->getPreprocessorOpts().addRemappedFile(main_path, &*out_buf);
-  invocation2->getFrontendOpts().Inputs.clear();
-  invocation2->getFrontendOpts().Inputs.push_back(FrontendInputFile(main_path, IK_C));
-  invocation2->getFrontendOpts().DisableFree = false;
+  rewrite_timer.stop();
+
+  // second pass, in the same instance: clear input and take rewrite buffer.
+  // The file and source managers survive between actions, so the headers
+  // stat'ed and read by the first pass, from disk or from the archives, are
+  // not opened again, and the PCH is validated against cached entries.
+  CompileStats::Timer ir_timer(stats_, "clang_ir");
+  CompilerInvocation &invocation2 = compiler1.getInvocation();
+  invocation2.getPreprocessorOpts().clearRemappedFiles();
+  for (const auto &f : type_db_files)
+    invocation2.getPreprocessorOpts().addRemappedFile(f.first, &*f.second);
+  invocation2.getPreprocessorOpts().addRemappedFile(main_path, &*out_buf);
+  invocation2.getFrontendOpts().Inputs.clear();
+  invocation2.getFrontendOpts().Inputs.push_back(FrontendInputFile(main_path, IK_C));
   // suppress warnings in the 2nd pass, but bail out on errors (our fault)
-  invocation2->getDiagnosticOpts().IgnoreWarnings = true;
-  compiler2.setInvocation(invocation2.release());
-  compiler2.createDiagnostics();
+  invocation2.getDiagnosticOpts().IgnoreWarnings = true;
+  compiler1.getDiagnostics().setIgnoreAllWarnings(true);
 
   EmitLLVMOnlyAction ir_act(&*ctx_);
-  if (!compiler2.ExecuteAction(ir_act))
+  if (!compiler1.ExecuteAction(ir_act))
     return -1;
   *mod = ir_act.takeModule();
+  // the source manager holds the files read by both passes, but not those
+  // that only the PCH was built from
+  deps_ = pch_deps + list_deps(compiler1, archives);
+
+  return 0;
+}
+
+string ClangLoader::type_db_stamp(unsigned flags) {
+  struct utsname un;
+  uname(&un);
+  if (!(flags & BPF_MODULE_KERNEL_TYPES)) {
+    // a snapshot of the headers is used before the headers and the type
+    // database. Taking it here retakes it if the headers changed.
+    string kdir = string(KERNEL_MODULES_DIR) + "/" + un.release;
+    KBuildHelper kbuild_helper(kdir);
+    vector<string> kflags;
+    if (!kbuild_helper.get_flags(un.machine, &kflags)) {
+      if (auto kheaders = kernel_headers(un, kdir, kflags))
+        return kheaders->stamp();
+    }
+    if (::access(kernel_modules_dir(un).c_str(), X_OK) == 0)
+      return "";
+  }
+  auto type_db = TypeDB::open();
+  return type_db ? type_db->stamp() : "";
+}
+
+// Parse the default headers and the given ones and keep the layouts of the
+// types the tools use, see TypeDB
+int ClangLoader::build_type_db(const string &path, const vector<string> &headers,
+                               const vector<string> &types) {
+  using namespace clang;
+
+  struct utsname un;
+  uname(&un);
+  string kdir = string(KERNEL_MODULES_DIR) + "/" + un.release;
+  string kmod_dir = kernel_modules_dir(un);
+  if (::access(kmod_dir.c_str(), X_OK) < 0) {
+    fprintf(stderr, "%s: %s\n", kmod_dir.c_str(), strerror(errno));
+    return -1;
+  }
+
+  string main_path = "/virtual/types.c";
+  string source = TypeDB::source(headers);
+  unique_ptr<llvm::MemoryBuffer> main_buf = llvm::MemoryBuffer::getMemBuffer(source);
+
+  KBuildHelper kbuild_helper(kdir);
+  vector<string> kflags;
+  if (kbuild_helper.get_flags(un.machine, &kflags))
+    return -1;
+  // the header names are relative to the include directories
+  vector<string> include_dirs;
+  for (size_t i = 0; i < kflags.size(); ++i) {
+    if (!kflags[i].compare(0, 2, "-I"))
+      include_dirs.push_back(kflags[i].substr(2));
+    else if (kflags[i] == "-isystem" && i + 1 < kflags.size())
+      include_dirs.push_back(kflags[++i]);
+  }
+
+  vector<const char *> flags_cstr({"-O0", "-emit-llvm", "-working-directory", kmod_dir.c_str(),
+                                   "-Wno-deprecated-declarations",
+                                   "-Wno-gnu-variable-sized-type-not-at-end",
+                                   "-x", "c", "-c", main_path.c_str()});
+  for (auto &f : kflags)
+    flags_cstr.push_back(f.c_str());
 
+  IntrusiveRefCntPtr<DiagnosticOptions> diag_opts(new DiagnosticOptions());
+  auto diag_client = new TextDiagnosticPrinter(llvm::errs(), &*diag_opts);
+  IntrusiveRefCntPtr<DiagnosticIDs> DiagID(new DiagnosticIDs());
+  DiagnosticsEngine diags(DiagID, &*diag_opts, diag_client);
+
+  driver::Driver drv("", "x86_64-unknown-linux-gnu", diags);
+  drv.setTitle("bcc-clang-driver");
+  drv.setCheckInputsExist(false);
+
+  unique_ptr<driver::Compilation> compilation;
+  const driver::Command *cmd = clang_command(drv, diags, flags_cstr, &compilation);
+  if (!cmd)
+    return -1;
+  const driver::ArgStringList &ccargs = cmd->getArguments();
+
+  auto invocation = make_unique<CompilerInvocation>();
+  if (!CompilerInvocation::CreateFromArgs(*invocation, const_cast<const char **>(ccargs.data()),
+                                          const_cast<const char **>(ccargs.data()) + ccargs.size(), diags))
+    return -1;
+  invocation->getPreprocessorOpts().RetainRemappedFileBuffers = true;
+  invocation->getPreprocessorOpts().addRemappedFile(main_path, &*main_buf);
+  invocation->getFrontendOpts().Inputs.clear();
+  invocation->getFrontendOpts().Inputs.push_back(FrontendInputFile(main_path, IK_C));
+  invocation->getFrontendOpts().DisableFree = false;
+
+  CompilerInstance compiler;
+  compiler.setInvocation(invocation.release());
+  compiler.setVirtualFileSystem(archive_fs({exported_headers_}));
+  compiler.createDiagnostics();
+
+  string data;
+  vector<string> missing;
+  TypeDBAction act(include_dirs, types, &data, &missing);
+  if (!compiler.ExecuteAction(act) || data.empty())
+    return -1;
+  for (auto &t : missing)
+    fprintf(stderr, "No type %s in the kernel headers\n", t.c_str());
+  if (!missing.empty())
+    return -1;
+  if (!TypeDB::store(path, data))
+    return -1;
+  return 0;
+}
+
+int ClangLoader::build_header_archive(const string &path) {
+  struct utsname un;
+  uname(&un);
+  string kdir = string(KERNEL_MODULES_DIR) + "/" + un.release;
+  string kmod_dir = kernel_modules_dir(un);
+  if (::access(kmod_dir.c_str(), X_OK) < 0) {
+    fprintf(stderr, "%s: %s\n", kmod_dir.c_str(), strerror(errno));
+    return -1;
+  }
+  string archive_path = path;
+  if (archive_path.empty() && !ModuleCache::path(string("headers-") + un.release, &archive_path)) {
+    fprintf(stderr, "No module cache to store the header archive in\n");
+    return -1;
+  }
+
+  KBuildHelper kbuild_helper(kdir);
+  vector<string> kflags, roots, witnesses;
+  if (kbuild_helper.get_flags(un.machine, &kflags))
+    return -1;
+  kernel_tree(kdir, kmod_dir, kflags, &roots, &witnesses);
+  if (!HeaderArchive::create(archive_path, roots, witnesses))
+    return -1;
   return 0;
 }
 
@@ -19,6 +19,7 @@
 #include <map>
 #include <memory>
 #include <string>
+#include <vector>
 
 namespace llvm {
 class Module;
@@ -28,6 +29,8 @@ class MemoryBuffer;
 
 namespace ebpf {
 
+class CompileStats;
+class HeaderArchive;
 struct TableDesc;
 
 namespace cc {
@@ -37,14 +40,37 @@ class CodegenLLVM;
 
 class ClangLoader {
  public:
-  explicit ClangLoader(llvm::LLVMContext *ctx, unsigned flags);
+  explicit ClangLoader(llvm::LLVMContext *ctx, unsigned flags, CompileStats *stats = nullptr);
   ~ClangLoader();
   int parse(std::unique_ptr<llvm::Module> *mod, std::unique_ptr<std::vector<TableDesc>> *tables,
             const std::string &file, bool in_memory, const char *cflags[], int ncflags);
+  // Extract the type database of the running kernel from its headers and
+  // store it at path, or in the module cache if empty
+  int build_type_db(const std::string &path, const std::vector<std::string> &headers,
+                    const std::vector<std::string> &types);
+  // The stamp of the type database or of the header snapshot parse()
+  // compiles against with these flags, empty if it reads the kernel headers
+  static std::string type_db_stamp(unsigned flags);
+  // "<size> <mtime> <path>" of each file the last parse() read from disk,
+  // one per line
+  const std::string & deps() const { return deps_; }
+  // Whether none of the files listed by deps() changed
+  static bool deps_ok(const std::string &deps);
+  // Snapshot the kernel headers into a HeaderArchive at path, or in the
+  // module cache if empty
+  static int build_header_archive(const std::string &path);
  private:
-  static std::map<std::string, std::unique_ptr<llvm::MemoryBuffer>> remapped_files_;
+  std::string get_pch(const std::vector<const char *> &ccargs, const std::vector<std::string> &kflags,
+                      const char *cflags[], int ncflags,
+                      const std::map<std::string, std::unique_ptr<llvm::MemoryBuffer>> &files,
+                      const std::vector<std::shared_ptr<const HeaderArchive>> &archives,
+                      const std::string &salt, std::string *deps);
+  static std::shared_ptr<const HeaderArchive> exported_headers_;
+  static size_t num_loaders_;  // exported_headers_ is dropped with the last loader
   llvm::LLVMContext *ctx_;
   unsigned flags_;
+  CompileStats *stats_;
+  std::string deps_;
 };
 
 }  // namespace ebpf
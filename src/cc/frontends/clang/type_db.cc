@@ -0,0 +1,777 @@
+/*
+ * Copyright (c) 2016 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <errno.h>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+#include <clang/AST/ASTContext.h>
+#include <clang/AST/RecordLayout.h>
+#include <clang/AST/RecursiveASTVisitor.h>
+#include <clang/Basic/SourceManager.h>
+#include <clang/Lex/MacroInfo.h>
+#include <clang/Lex/Preprocessor.h>
+
+#include "module_cache.h"
+#include "type_db.h"
+
+namespace ebpf {
+
+using std::map;
+using std::set;
+using std::string;
+using std::to_string;
+using std::vector;
+using namespace clang;
+
+#define TYPE_DB_MAGIC "bcc-typedb-1"
+#define TYPE_DB_DIR "/virtual/kheaders"
+
+// the pointers of the roots are followed this many times, beyond that the
+// records are only declared
+#define TYPE_DB_DEPTH 1
+
+namespace {
+
+const char *default_headers[] = {
+  "uapi/linux/ptrace.h", "linux/sched.h", "linux/fs.h", "linux/dcache.h", "linux/mount.h",
+  "linux/fdtable.h", "linux/binfmts.h", "linux/cred.h", "linux/mm.h", "linux/blkdev.h",
+  "linux/genhd.h", "linux/bio.h", "linux/skbuff.h", "linux/netdevice.h", "linux/socket.h",
+  "linux/in.h", "linux/in6.h", "linux/ip.h", "linux/ipv6.h", "linux/tcp.h", "linux/udp.h",
+  "linux/if_ether.h", "net/sock.h", "net/inet_sock.h", "net/tcp_states.h",
+  "linux/nsproxy.h", "linux/pid_namespace.h", "linux/version.h",
+};
+
+const char *default_types[] = {
+  "pt_regs", "task_struct", "cred", "mm_struct", "vm_area_struct", "nsproxy",
+  "pid_namespace", "files_struct", "fdtable", "file", "inode", "dentry", "qstr", "path",
+  "vfsmount", "super_block", "linux_binprm", "kiocb", "page", "request", "gendisk",
+  "block_device", "bio", "sk_buff", "net_device", "socket", "sock", "sock_common",
+  "inet_sock", "tcp_sock", "msghdr", "sockaddr", "sockaddr_in", "sockaddr_in6", "in6_addr",
+  "ethhdr", "iphdr", "ipv6hdr", "tcphdr", "udphdr", "timespec", "timeval",
+};
+
+// declared by uapi/linux/bpf.h, which the programs get from bcc/bpf.h
+bool from_bpf_h(SourceManager &sm, SourceLocation loc) {
+  PresumedLoc ploc = sm.getPresumedLoc(sm.getSpellingLoc(loc));
+  if (ploc.isInvalid())
+    return false;
+  llvm::StringRef file(ploc.getFilename());
+  return file.endswith("uapi/linux/bpf.h");
+}
+
+string normalize(string path) {
+  while (path.compare(0, 2, "./") == 0)
+    path = path.substr(2);
+  size_t pos;
+  while ((pos = path.find("/./")) != string::npos)
+    path.erase(pos, 2);
+  while (path.size() > 1 && path.back() == '/')
+    path.pop_back();
+  return path;
+}
+
+// Collects the named records, typedefs and enumerators of the translation
+// unit, leaving out function bodies
+class DeclIndex : public RecursiveASTVisitor<DeclIndex> {
+ public:
+  bool TraverseFunctionDecl(FunctionDecl *) { return true; }
+  bool VisitRecordDecl(RecordDecl *rd) {
+    if (rd->isCompleteDefinition() && !rd->getName().empty())
+      records[rd->getName()] = rd;
+    return true;
+  }
+  bool VisitTypedefNameDecl(TypedefNameDecl *td) {
+    if (!td->isImplicit() && td->getDeclContext()->isFileContext())
+      typedefs.push_back(td);
+    return true;
+  }
+  bool VisitEnumConstantDecl(EnumConstantDecl *ecd) {
+    enumerators.push_back(ecd);
+    return true;
+  }
+
+  map<string, const RecordDecl *> records;
+  vector<const TypedefNameDecl *> typedefs;
+  vector<const EnumConstantDecl *> enumerators;
+};
+
+class TypeExtractor {
+ public:
+  TypeExtractor(ASTContext &ctx, const DeclIndex &index)
+      : ctx_(ctx), sm_(ctx.getSourceManager()), index_(index), levels_(TYPE_DB_DEPTH + 1) {}
+
+  bool add_root(const string &name) {
+    auto it = index_.records.find(name);
+    if (it == index_.records.end())
+      return false;
+    enqueue(it->second, 0);
+    return true;
+  }
+
+  // The records reachable from the roots, by value or through at most
+  // TYPE_DB_DEPTH pointers
+  void run(std::ostream &os) {
+    for (unsigned depth = 0; depth < levels_.size(); ++depth) {
+      // records embedded by value are appended to the current level
+      for (size_t i = 0; i < levels_[depth].size(); ++i) {
+        const RecordDecl *rd = levels_[depth][i];
+        if (done_.insert(rd).second)
+          serialize(rd, depth);
+      }
+    }
+    for (auto td : index_.typedefs) {
+      if (from_bpf_h(sm_, td->getLocation()))
+        continue;
+      string type = encode(td->getUnderlyingType(), TYPE_DB_DEPTH + 1, true);
+      if (!type.empty())
+        types_ << "T " << td->getName().str() << " " << type << "\n";
+    }
+    os << records_.str() << types_.str();
+  }
+
+ private:
+  void enqueue(const RecordDecl *rd, unsigned depth) {
+    if (depth < levels_.size() && !done_.count(rd))
+      levels_[depth].push_back(rd);
+  }
+
+  string tag(const RecordDecl *rd) {
+    if (!rd->getName().empty())
+      return rd->getName();
+    auto it = anon_.find(rd);
+    if (it != anon_.end())
+      return it->second;
+    string name = "." + to_string(anon_.size());
+    anon_[rd] = name;
+    return name;
+  }
+
+  // the encoding of qt, empty if it has no size; depth counts the pointers
+  // followed from a root
+  string encode(QualType qt, unsigned depth, bool by_value) {
+    qt = qt.getCanonicalType();
+    const Type *t = qt.getTypePtr();
+    if (const BuiltinType *bt = dyn_cast<BuiltinType>(t)) {
+      if (bt->isVoidType())
+        return "v";
+      if (bt->getKind() == BuiltinType::Bool)
+        return "b";
+      if (bt->getKind() == BuiltinType::Char_S || bt->getKind() == BuiltinType::Char_U)
+        return "c";
+      string size = to_string(ctx_.getTypeSize(qt) / 8);
+      if (bt->isInteger())
+        return (bt->isSignedInteger() ? "i" : "u") + size;
+      if (bt->isFloatingPoint())
+        return "f" + size;
+    } else if (const PointerType *pt = dyn_cast<PointerType>(t)) {
+      QualType pointee = pt->getPointeeType().getCanonicalType();
+      const RecordType *rt = pointee->getAs<RecordType>();
+      if (pointee->isFunctionType() || (rt && rt->getDecl()->getName().empty()))
+        return "pv";
+      string sub = encode(pointee, depth + 1, false);
+      return sub.empty() ? "pv" : "p" + sub;
+    } else if (const ConstantArrayType *at = dyn_cast<ConstantArrayType>(t)) {
+      string sub = encode(at->getElementType(), depth, by_value);
+      if (sub.empty())
+        return sub;
+      return "a" + at->getSize().toString(10, false) + "_" + sub;
+    } else if (const IncompleteArrayType *at = dyn_cast<IncompleteArrayType>(t)) {
+      string sub = encode(at->getElementType(), depth, by_value);
+      return sub.empty() ? sub : "a0_" + sub;
+    } else if (const EnumType *et = dyn_cast<EnumType>(t)) {
+      if (!et->getDecl()->isComplete())
+        return "u4";
+      return encode(et->getDecl()->getIntegerType(), depth, by_value);
+    } else if (const RecordType *rt = dyn_cast<RecordType>(t)) {
+      const RecordDecl *rd = rt->getDecl();
+      const char *kind = rd->isUnion() ? "n" : "s";
+      if (const RecordDecl *def = rd->getDefinition())
+        rd = def;
+      if (rd->getName().empty()) {
+        // anonymous records are declared where they are used
+        string name = tag(rd);
+        if (done_.insert(rd).second)
+          serialize(rd, depth);
+        return kind + name + ";";
+      }
+      if (by_value && rd->isCompleteDefinition() && from_bpf_h(sm_, rd->getLocation()))
+        return "a" + to_string(ctx_.getTypeSize(qt) / 8) + "_u1";
+      if (rd->isCompleteDefinition())
+        enqueue(rd, depth);
+      return kind + tag(rd) + ";";
+    }
+    if (qt->isIncompleteType() || qt->isFunctionType())
+      return "";
+    // vectors and the like, only their size matters
+    return "a" + to_string(ctx_.getTypeSize(qt) / 8) + "_u1";
+  }
+
+  void serialize(const RecordDecl *rd, unsigned depth) {
+    const ASTRecordLayout &layout = ctx_.getASTRecordLayout(rd);
+    std::ostringstream fields;
+    unsigned nfields = 0;
+    for (auto f : rd->fields()) {
+      if (f->isUnnamedBitfield())
+        continue;
+      string type = encode(f->getType(), depth, true);
+      if (type.empty())
+        continue;
+      uint64_t bits = 0;
+      if (f->isBitField())
+        bits = f->getBitWidthValue(ctx_);
+      else if (!f->getType()->isIncompleteArrayType())
+        bits = ctx_.getTypeSize(f->getType());
+      fields << "F " << layout.getFieldOffset(f->getFieldIndex()) << " " << bits << " "
+             << (f->isBitField() ? "b" : "-") << " "
+             << (f->getName().empty() ? string("-") : f->getName().str()) << " " << type << "\n";
+      ++nfields;
+    }
+    records_ << "R " << (rd->isUnion() ? "u" : "s") << " " << tag(rd) << " "
+             << layout.getSize().getQuantity() << " " << layout.getAlignment().getQuantity() << " "
+             << nfields << "\n" << fields.str();
+  }
+
+  ASTContext &ctx_;
+  SourceManager &sm_;
+  const DeclIndex &index_;
+  vector<vector<const RecordDecl *>> levels_;
+  set<const RecordDecl *> done_;
+  map<const RecordDecl *, string> anon_;
+  std::ostringstream records_;
+  std::ostringstream types_;
+};
+
+// macros that expand to a number, e.g. "(-1UL)", or name a member, e.g.
+// "__sk_common.skc_family"
+bool macro_text(Preprocessor &pp, const MacroInfo *mi, string *text) {
+  if (!mi->isObjectLike() || mi->isBuiltinMacro() || mi->getNumTokens() == 0)
+    return false;
+  bool number = false, member = false;
+  for (unsigned i = 0; i < mi->getNumTokens(); ++i) {
+    const Token &tok = mi->getReplacementToken(i);
+    if (tok.is(tok::numeric_constant))
+      number = true;
+    else if (tok.is(tok::identifier) || tok.is(tok::period))
+      member = member || tok.is(tok::period);
+    else if (!tok.is(tok::l_paren) && !tok.is(tok::r_paren) && !tok.is(tok::minus))
+      return false;
+  }
+  for (unsigned i = 0; i < mi->getNumTokens(); ++i) {
+    const Token &tok = mi->getReplacementToken(i);
+    if (number && tok.is(tok::identifier))
+      return false;
+    text->append(pp.getSpelling(tok));
+  }
+  return number || member;
+}
+
+struct Field {
+  uint64_t offset;  // bits
+  uint64_t bits;
+  bool bitfield;
+  string name;
+  string type;
+};
+
+struct Record {
+  bool is_union;
+  uint64_t size;
+  uint64_t align;
+  vector<Field> fields;
+};
+
+// Renders the database as C
+class Renderer {
+ public:
+  explicit Renderer(const map<string, Record> &records) : records_(records) {}
+
+  // the C declaration of decl with type t, consumed from t
+  string declare(const char *&t, const string &decl) {
+    char kind = *t++;
+    char *end;
+    switch (kind) {
+    case 'p':
+      return declare(t, *t == 'a' ? "(*" + decl + ")" : "*" + decl);
+    case 'a': {
+      unsigned long long n = strtoull(t, &end, 10);
+      t = end + 1;
+      return declare(t, decl + "[" + to_string(n) + "]");
+    }
+    case 'i':
+    case 'u':
+    case 'f': {
+      unsigned long long n = strtoull(t, &end, 10);
+      t = end;
+      return scalar(kind, n) + " " + decl;
+    }
+    case 's':
+    case 'n': {
+      const char *semi = strchr(t, ';');
+      string name(t, semi - t);
+      t = semi + 1;
+      auto it = records_.find(name);
+      if (name[0] == '.' && it != records_.end())
+        return decl.empty() ? body(it->second) : body(it->second) + " " + decl;
+      return (kind == 's' ? "struct " : "union ") + name + " " + decl;
+    }
+    case 'b':
+      return "_Bool " + decl;
+    case 'c':
+      return "char " + decl;
+    default:
+      return "void " + decl;
+    }
+  }
+
+  // Consume the type at t, collecting the records it names in refs and the
+  // ones it embeds by value in deps. Returns false if one of those is not in
+  // the database.
+  bool deps(const char *&t, bool by_value, set<string> *refs, set<string> *deps) {
+    char kind = *t++;
+    char *end;
+    switch (kind) {
+    case 'p':
+      return this->deps(t, false, refs, deps);
+    case 'a':
+      strtoull(t, &end, 10);
+      t = end + 1;
+      return this->deps(t, by_value, refs, deps);
+    case 'i':
+    case 'u':
+    case 'f':
+      strtoull(t, &end, 10);
+      t = end;
+      return true;
+    case 's':
+    case 'n': {
+      const char *semi = strchr(t, ';');
+      string name(t, semi - t);
+      t = semi + 1;
+      auto it = records_.find(name);
+      if (name[0] != '.') {
+        refs->insert((kind == 's' ? "struct " : "union ") + name);
+        if (by_value)
+          deps->insert(name);
+        return !by_value || it != records_.end();
+      }
+      if (it == records_.end())
+        return false;
+      bool ok = true;
+      for (auto &f : it->second.fields) {
+        const char *ft = f.type.c_str();
+        ok = this->deps(ft, true, refs, deps) && ok;
+      }
+      return ok;
+    }
+    default:
+      return true;
+    }
+  }
+
+  // struct __attribute__((packed, aligned(n))) { fields }
+  string body(const Record &r, const string &name = "") {
+    string s = r.is_union ? "union" : "struct";
+    s += " __attribute__((packed, aligned(" + to_string(r.align) + ")))";
+    if (!name.empty())
+      s += " " + name;
+    s += " {\n";
+    // anonymous records nest
+    string indent = indent_;
+    indent_ += "  ";
+    uint64_t bit = 0;
+    unsigned npad = 0;
+    for (auto &f : r.fields) {
+      string decl = f.name == "-" ? "" : f.name;
+      const char *t = f.type.c_str();
+      if (r.is_union) {
+        s += indent_ + declare(t, f.bitfield ? decl + " : " + to_string(f.bits) : decl) + ";\n";
+        continue;
+      }
+      if (f.bitfield) {
+        if (f.offset < bit)
+          continue;
+        for (uint64_t gap = f.offset - bit; gap; ) {
+          uint64_t n = gap > 64 ? 64 : gap;
+          s += indent_ + "unsigned long long : " + to_string(n) + ";\n";
+          gap -= n;
+        }
+        s += indent_ + declare(t, decl + " : " + to_string(f.bits)) + ";\n";
+        bit = f.offset + f.bits;
+        continue;
+      }
+      bit = (bit + 7) & ~7ull;
+      if (f.offset < bit)
+        continue;
+      if (f.offset > bit)
+        s += indent_ + "char __bcc_pad" + to_string(npad++) + "[" + to_string((f.offset - bit) / 8) + "];\n";
+      s += indent_ + declare(t, decl) + ";\n";
+      bit = f.offset + f.bits;
+    }
+    bit = (bit + 7) & ~7ull;
+    if (r.is_union)
+      s += indent_ + "char __bcc_size[" + to_string(r.size) + "];\n";
+    else if (r.size * 8 > bit)
+      s += indent_ + "char __bcc_pad" + to_string(npad) + "[" + to_string(r.size - bit / 8) + "];\n";
+    indent_ = indent;
+    return s + indent + "}";
+  }
+
+  // named records, each after the ones it embeds
+  void define(const string &name, set<string> *visited, string *out) {
+    if (!visited->insert(name).second)
+      return;
+    auto it = records_.find(name);
+    set<string> refs, deps;
+    for (auto &f : it->second.fields) {
+      const char *t = f.type.c_str();
+      this->deps(t, true, &refs, &deps);
+    }
+    for (auto &dep : deps) {
+      if (records_.count(dep))
+        define(dep, visited, out);
+    }
+    *out += body(it->second, name) + ";\n\n";
+  }
+
+ private:
+  static string scalar(char kind, unsigned long long n) {
+    if (kind == 'f')
+      return n == 4 ? "float" : n == 8 ? "double" : "long double";
+    string s = kind == 'u' ? "unsigned " : "signed ";
+    switch (n) {
+    case 1: return s + "char";
+    case 2: return s + "short";
+    case 4: return s + "int";
+    case 8: return s + "long long";
+    default: return s + "__int128";
+    }
+  }
+
+  const map<string, Record> &records_;
+  string indent_;
+};
+
+// Consume the type at t, false if it is malformed. The anonymous records it
+// embeds must be in done: they precede their users in the database, which
+// also keeps them from embedding themselves.
+bool valid_type(const char *&t, const set<string> &done) {
+  char kind = *t++;
+  char *end;
+  switch (kind) {
+  case 'p':
+    return valid_type(t, done);
+  case 'a':
+    strtoull(t, &end, 10);
+    if (end == t || *end != '_')
+      return false;
+    t = end + 1;
+    return valid_type(t, done);
+  case 'i':
+  case 'u':
+  case 'f':
+    strtoull(t, &end, 10);
+    if (end == t)
+      return false;
+    t = end;
+    return true;
+  case 's':
+  case 'n': {
+    const char *semi = strchr(t, ';');
+    if (!semi || semi == t)
+      return false;
+    string name(t, semi - t);
+    t = semi + 1;
+    return name[0] != '.' || done.count(name);
+  }
+  case 'b':
+  case 'c':
+  case 'v':
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool valid_type(const string &type, const set<string> &done) {
+  const char *t = type.c_str();
+  return valid_type(t, done) && !*t;
+}
+
+std::mutex open_mutex;
+std::shared_ptr<const TypeDB> open_db;
+
+}  // namespace
+
+string TypeDB::source(const vector<string> &headers) {
+  string s;
+  for (auto h : default_headers)
+    s += "#if __has_include(<" + string(h) + ">)\n#include <" + h + ">\n#endif\n";
+  for (auto &h : headers)
+    s += "#include <" + h + ">\n";
+  return s;
+}
+
+string TypeDB::extract(ASTContext &ctx, Preprocessor &pp, const vector<string> &include_dirs,
+                       const vector<string> &types, vector<string> *missing) {
+  SourceManager &sm = ctx.getSourceManager();
+  std::ostringstream os;
+  struct utsname un;
+  uname(&un);
+  os << TYPE_DB_MAGIC << "\nmachine " << un.machine << "\nrelease " << un.release << "\n";
+
+  // the names the headers can be included by
+  vector<string> dirs;
+  for (auto &d : include_dirs)
+    dirs.push_back(normalize(d) + "/");
+  set<string> headers;
+  for (auto it = sm.fileinfo_begin(); it != sm.fileinfo_end(); ++it) {
+    string file = normalize(it->first->getName());
+    if (!file.compare(0, 9, "/virtual/"))
+      continue;
+    for (auto &d : dirs) {
+      if (!file.compare(0, d.size(), d))
+        headers.insert(file.substr(d.size()));
+    }
+  }
+  for (auto &h : headers)
+    os << "H " << h << "\n";
+
+  DeclIndex index;
+  index.TraverseDecl(ctx.getTranslationUnitDecl());
+  TypeExtractor extractor(ctx, index);
+  for (auto t : default_types)
+    extractor.add_root(t);
+  for (auto &t : types) {
+    if (!extractor.add_root(t))
+      missing->push_back(t);
+  }
+  extractor.run(os);
+
+  for (auto ecd : index.enumerators) {
+    if (!from_bpf_h(sm, ecd->getLocation()))
+      os << "E " << ecd->getName().str() << " " << ecd->getInitVal().toString(10) << "\n";
+  }
+  for (auto it = pp.macro_begin(); it != pp.macro_end(); ++it) {
+    const MacroInfo *mi = pp.getMacroInfo(it->first);
+    if (!mi)
+      continue;
+    // leave out the compiler's own and the -D flags
+    PresumedLoc ploc = sm.getPresumedLoc(mi->getDefinitionLoc());
+    if (ploc.isInvalid() || ploc.getFilename()[0] == '<' || from_bpf_h(sm, mi->getDefinitionLoc()))
+      continue;
+    string text;
+    if (macro_text(pp, mi, &text))
+      os << "M " << it->first->getName().str() << " " << text << "\n";
+  }
+  return os.str();
+}
+
+bool TypeDB::store(const string &path, const string &data) {
+  if (path.empty()) {
+    struct utsname un;
+    uname(&un);
+    return ModuleCache::write(string("types-") + un.release, data);
+  }
+  string tmp = path + ".tmp";
+  {
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    if (!out || !out.write(data.data(), data.size())) {
+      fprintf(stderr, "%s: %s\n", tmp.c_str(), strerror(errno));
+      return false;
+    }
+  }
+  if (::rename(tmp.c_str(), path.c_str()) < 0) {
+    fprintf(stderr, "%s: %s\n", path.c_str(), strerror(errno));
+    ::unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+std::shared_ptr<const TypeDB> TypeDB::open() {
+  struct utsname un;
+  uname(&un);
+  const char *env = getenv("BCC_TYPE_DB");
+  string path;
+  if (env && env[0])
+    path = env;
+  else if (!ModuleCache::path(string("types-") + un.release, &path))
+    return nullptr;
+
+  struct stat st;
+  if (::stat(path.c_str(), &st) < 0)
+    return nullptr;
+  string stamp = to_string((long long)st.st_size) + " " + to_string((long long)st.st_mtime) + " " +
+      path;
+
+  // rendering is done once per version of the database
+  std::lock_guard<std::mutex> lock(open_mutex);
+  if (open_db && open_db->stamp_ == stamp)
+    return open_db;
+
+  string data;
+  if (env && env[0]) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+      return nullptr;
+    data.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+  } else if (!ModuleCache::read(string("types-") + un.release, &data)) {
+    return nullptr;
+  }
+
+  std::shared_ptr<TypeDB> db(new TypeDB);
+  db->stamp_ = stamp;
+  if (!db->render(data)) {
+    fprintf(stderr, "%s: not a valid type database for %s, ignored\n", path.c_str(), un.machine);
+    return nullptr;
+  }
+  open_db = db;
+  return open_db;
+}
+
+bool TypeDB::render(const string &data) {
+  std::istringstream in(data);
+  string line;
+  if (!std::getline(in, line) || line != TYPE_DB_MAGIC)
+    return false;
+
+  struct utsname un;
+  uname(&un);
+  // the database may have been written by hand, anything malformed
+  // rejects all of it
+  map<string, Record> records;
+  set<string> done;  // the records before the current one
+  vector<string> record_order, headers;
+  vector<std::pair<string, string>> typedefs, enumerators, macros;
+  Record *record = nullptr;
+  while (std::getline(in, line)) {
+    std::istringstream ls(line);
+    string kind, name;
+    ls >> kind >> name;
+    if (kind == "machine") {
+      if (name != un.machine)
+        return false;
+    } else if (kind == "H") {
+      headers.push_back(name);
+    } else if (kind == "R") {
+      Record r;
+      string tag;
+      size_t nfields;
+      if (!(ls >> tag >> r.size >> r.align >> nfields) || records.count(tag))
+        return false;
+      if (!record_order.empty())
+        done.insert(record_order.back());
+      r.is_union = name == "u";
+      record_order.push_back(tag);
+      record = &records[tag];
+      *record = r;
+    } else if (kind == "F" && record) {
+      Field f;
+      string bitfield;
+      char *end;
+      f.offset = strtoull(name.c_str(), &end, 10);
+      if (name.empty() || *end || !(ls >> f.bits >> bitfield >> f.name >> f.type) ||
+          !valid_type(f.type, done))
+        return false;
+      f.bitfield = bitfield == "b";
+      record->fields.push_back(f);
+    } else if (kind == "T" || kind == "E" || kind == "M") {
+      string value;
+      if (!(ls >> value))
+        return false;
+      auto &list = kind == "T" ? typedefs : kind == "E" ? enumerators : macros;
+      list.push_back(std::make_pair(name, value));
+    }
+  }
+  if (!record_order.empty())
+    done.insert(record_order.back());
+  for (auto &td : typedefs) {
+    if (!valid_type(td.second, done))
+      return false;
+  }
+
+  Renderer renderer(records);
+  string defs, types, record_types;
+  set<string> refs, visited;
+  for (auto &name : record_order) {
+    if (name[0] != '.')
+      renderer.define(name, &visited, &defs);
+    for (auto &f : records[name].fields) {
+      const char *t = f.type.c_str();
+      set<string> deps;
+      renderer.deps(t, true, &refs, &deps);
+    }
+  }
+  // typedefs of records the database does not have are left out
+  for (auto &td : typedefs) {
+    const char *t = td.second.c_str();
+    set<string> deps;
+    if (!renderer.deps(t, true, &refs, &deps))
+      continue;
+    t = td.second.c_str();
+    string decl = "typedef " + renderer.declare(t, td.first) + ";\n";
+    (deps.empty() ? types : record_types) += decl;
+  }
+
+  string h = "#ifndef __BCC_KERNEL_TYPES_H\n#define __BCC_KERNEL_TYPES_H\n"
+      "#pragma clang system_header\n\n"
+      "#define NULL ((void *)0)\n"
+      "#define KERNEL_VERSION(a, b, c) (((a) << 16) + ((b) << 8) + (c))\n"
+      "#define offsetof(type, member) __builtin_offsetof(type, member)\n\n";
+  for (auto &r : refs)
+    h += r + ";\n";
+  h += "\n" + types + "\nenum {\n";
+  for (auto &e : enumerators)
+    h += "  " + e.first + " = " + e.second + ",\n";
+  h += "};\n\n" + defs + record_types + "\n";
+  // after the records, since some name members
+  for (auto &m : macros)
+    h += "#define " + m.first + " " + m.second + "\n";
+  h += "\n#endif\n";
+
+  files_[TYPE_DB_DIR "/bcc/kernel_types.h"] = h;
+  for (auto &name : headers)
+    files_[TYPE_DB_DIR "/" + name] = "#include <bcc/kernel_types.h>\n";
+  return true;
+}
+
+void TypeDB::get_flags(vector<string> *cflags) const {
+  cflags->push_back("-nostdinc");
+  cflags->push_back("-isystem");
+  cflags->push_back("/virtual/lib/clang/include");
+  cflags->push_back("-isystem");
+  cflags->push_back(TYPE_DB_DIR);
+  cflags->push_back("-include");
+  cflags->push_back(TYPE_DB_DIR "/bcc/kernel_types.h");
+  cflags->push_back("-D__KERNEL__");
+  cflags->push_back("-D__HAVE_BUILTIN_BSWAP16__");
+  cflags->push_back("-D__HAVE_BUILTIN_BSWAP32__");
+  cflags->push_back("-D__HAVE_BUILTIN_BSWAP64__");
+  cflags->push_back("-Wno-unused-value");
+  cflags->push_back("-Wno-pointer-sign");
+}
+
+}  // namespace ebpf
@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2016 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace clang {
+class ASTContext;
+class Preprocessor;
+}
+
+namespace ebpf {
+
+// Layouts of the kernel types that tools use, extracted once per kernel
+// release so that programs can be compiled without the kernel headers.
+//
+// The database is taken from $BCC_TYPE_DB, or else from the "types-<release>"
+// entry of the module cache. It is a text file:
+//
+//   bcc-typedb-1
+//   machine <uname -m>
+//   release <uname -r>
+//   H <include name>                        a header the types came from
+//   R <s|u> <tag> <size> <align> <nfields>  a struct or union, in bytes
+//   F <offset> <bits> <b|-> <name|-> <type> its fields, in bits, b for bitfields
+//   T <name> <type>                         typedef
+//   E <name> <value>                        enumerator
+//   M <name> <text>                         numeric or member alias macro
+//
+// Types are encoded without spaces: v void, b _Bool, c char, i<n>/u<n>/f<n>
+// integers and floats of n bytes, p<type> pointer, a<n>_<type> array,
+// s<tag>; and n<tag>; struct and union. Tags starting with '.' are anonymous
+// records, which are declared inline.
+//
+// Programs then compile against a generated bcc/kernel_types.h holding all
+// of it, and every recorded header name resolves to that header. The
+// records are declared packed with each field at its recorded offset, so
+// the layout does not depend on the types of the fields matching the
+// kernel's exactly.
+class TypeDB {
+ public:
+  // The database for the running kernel, or null if there is none
+  static std::shared_ptr<const TypeDB> open();
+  // The program to parse with the kernel headers for extract(): the default
+  // headers if they exist and the given ones
+  static std::string source(const std::vector<std::string> &headers);
+  // Extract the database from a program parsed with the kernel headers.
+  // types are added to the default set, those not found are put in missing.
+  // include_dirs are the -I directories the header names are relative to.
+  static std::string extract(clang::ASTContext &ctx, clang::Preprocessor &pp,
+                             const std::vector<std::string> &include_dirs,
+                             const std::vector<std::string> &types,
+                             std::vector<std::string> *missing);
+  // Store data as the database at path, or of the running kernel if empty
+  static bool store(const std::string &path, const std::string &data);
+
+  // The flags that replace KBuildHelper's
+  void get_flags(std::vector<std::string> *cflags) const;
+  // generated headers by path
+  const std::map<std::string, std::string> & files() const { return files_; }
+  // "<size> <mtime> <path>" of the database, changes with its contents
+  const std::string & stamp() const { return stamp_; }
+
+ private:
+  TypeDB() {}
+  bool render(const std::string &data);
+
+  std::map<std::string, std::string> files_;
+  std::string stamp_;
+};
+
+}  // namespace ebpf
@@ -0,0 +1,463 @@
+/*
+ * Copyright (c) 2016 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <algorithm>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <set>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "header_archive.h"
+
+namespace ebpf {
+
+using std::map;
+using std::set;
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+static const char ARCHIVE_MAGIC[16] = "bcc-headers-1";
+
+struct ArchiveHeader {
+  char magic[16];
+  uint32_t nroots;
+  uint32_t nwitnesses;
+  uint32_t nentries;
+  uint32_t reserved;
+  uint64_t strings;  // offset of the names
+  uint64_t length;   // of the whole archive
+};
+
+struct ArchiveEntry {
+  uint64_t name;  // offset of the name, relative to the strings
+  uint32_t name_len;
+  uint32_t dir;
+  uint64_t data;  // offset of the contents
+  uint64_t size;
+  int64_t mtime;
+};
+
+namespace {
+
+// A file or directory to be archived, read from data or else from src
+struct Item {
+  string name;
+  bool dir;
+  uint64_t size;
+  int64_t mtime;
+  const char *data;
+  string src;
+};
+
+// append to out, or write to fd if out is null
+bool emit(int fd, string *out, const void *p, size_t n) {
+  if (out) {
+    out->append((const char *)p, n);
+    return true;
+  }
+  const char *c = (const char *)p;
+  while (n > 0) {
+    ssize_t r = ::write(fd, c, n);
+    if (r < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    c += r;
+    n -= r;
+  }
+  return true;
+}
+
+bool emit_contents(int fd, string *out, const Item &item) {
+  if (item.data)
+    return emit(fd, out, item.data, item.size);
+  int src = ::open(item.src.c_str(), O_RDONLY | O_CLOEXEC);
+  if (src < 0)
+    return false;
+  char buf[65536];
+  uint64_t left = item.size;
+  while (left > 0) {
+    ssize_t n = ::read(src, buf, std::min<uint64_t>(left, sizeof(buf)));
+    if (n < 0 && errno == EINTR)
+      continue;
+    // the file changed while it was archived
+    if (n <= 0 || !emit(fd, out, buf, n)) {
+      ::close(src);
+      return false;
+    }
+    left -= n;
+  }
+  ::close(src);
+  return true;
+}
+
+// Lay out and write the archive. The names of roots and witnesses are
+// normalized, items must be sorted by name.
+bool write_archive(int fd, string *out, const vector<string> &roots,
+                   const vector<Item> &witnesses, const vector<Item> &items) {
+  string strings;
+  vector<ArchiveEntry> ents;
+  ents.reserve(roots.size() + witnesses.size() + items.size());
+  uint64_t data_off = 0;
+  auto add = [&](const string &name, bool dir, uint64_t size, int64_t mtime, bool has_data) {
+    ArchiveEntry e = {strings.size(), (uint32_t)name.size(), dir, 0, size, mtime};
+    strings += name;
+    if (has_data) {
+      e.data = data_off;
+      data_off = (data_off + size + 1 + 7) & ~7ULL;
+    }
+    ents.push_back(e);
+  };
+  for (auto &r : roots)
+    add(r, true, 0, 0, false);
+  for (auto &w : witnesses)
+    add(w.name, false, w.size, w.mtime, false);
+  for (auto &i : items)
+    add(i.name, i.dir, i.dir ? 0 : i.size, i.mtime, !i.dir);
+
+  ArchiveHeader header;
+  uint64_t strings_off = sizeof(header) + ents.size() * sizeof(ArchiveEntry);
+  uint64_t data_start = (strings_off + strings.size() + 7) & ~7ULL;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, ARCHIVE_MAGIC, sizeof(header.magic));
+  header.nroots = roots.size();
+  header.nwitnesses = witnesses.size();
+  header.nentries = items.size();
+  header.strings = strings_off;
+  header.length = data_start + data_off;
+  for (size_t i = roots.size() + witnesses.size(); i < ents.size(); ++i)
+    if (!ents[i].dir)
+      ents[i].data += data_start;
+
+  static const char zeros[8] = {};
+  if (!emit(fd, out, &header, sizeof(header)) ||
+      !emit(fd, out, ents.data(), ents.size() * sizeof(ArchiveEntry)) ||
+      !emit(fd, out, strings.data(), strings.size()) ||
+      !emit(fd, out, zeros, data_start - strings_off - strings.size()))
+    return false;
+  uint64_t pos = data_start;
+  for (size_t i = 0; i < items.size(); ++i) {
+    const ArchiveEntry &e = ents[roots.size() + witnesses.size() + i];
+    if (e.dir)
+      continue;
+    uint64_t end = (e.data + e.size + 1 + 7) & ~7ULL;
+    if (!emit_contents(fd, out, items[i]) || !emit(fd, out, zeros, end - e.data - e.size))
+      return false;
+    pos = end;
+  }
+  return pos == header.length;
+}
+
+// Add dir and everything below it. active holds the directories being
+// walked, to stop at symbolic link loops.
+bool walk(const string &dir, const struct stat &st, set<std::pair<dev_t, ino_t>> *active,
+          vector<Item> *items) {
+  items->push_back({dir, true, 0, (int64_t)st.st_mtime, nullptr, ""});
+  auto id = std::make_pair(st.st_dev, st.st_ino);
+  if (!active->insert(id).second)
+    return true;
+  DIR *d = ::opendir(dir.c_str());
+  if (!d) {
+    active->erase(id);
+    return false;
+  }
+  bool ok = true;
+  while (struct dirent *de = ::readdir(d)) {
+    if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+      continue;
+    string path = dir + "/" + de->d_name;
+    struct stat sub;
+    // dangling links are left out
+    if (::stat(path.c_str(), &sub) < 0)
+      continue;
+    if (S_ISDIR(sub.st_mode))
+      ok = walk(path, sub, active, items) && ok;
+    else if (S_ISREG(sub.st_mode))
+      items->push_back({path, false, (uint64_t)sub.st_size, (int64_t)sub.st_mtime, nullptr, path});
+  }
+  ::closedir(d);
+  active->erase(id);
+  return ok;
+}
+
+bool by_name(const Item &a, const Item &b) { return a.name < b.name; }
+
+}  // namespace
+
+HeaderArchive::~HeaderArchive() {
+  if (mapped_)
+    ::munmap((void *)base_, len_);
+}
+
+string HeaderArchive::normalize(const string &path) {
+  vector<string> parts;
+  size_t pos = 0;
+  while (pos <= path.size()) {
+    size_t end = path.find('/', pos);
+    if (end == string::npos)
+      end = path.size();
+    string part = path.substr(pos, end - pos);
+    pos = end + 1;
+    if (part.empty() || part == ".")
+      continue;
+    if (part == "..") {
+      if (!parts.empty())
+        parts.pop_back();
+      continue;
+    }
+    parts.push_back(part);
+  }
+  string out;
+  for (auto &p : parts)
+    out += "/" + p;
+  return out.empty() ? "/" : out;
+}
+
+bool HeaderArchive::create(const string &path, const vector<string> &roots,
+                           const vector<string> &witnesses) {
+  // nested roots are walked with the one that holds them
+  vector<string> sorted;
+  for (auto &r : roots)
+    sorted.push_back(normalize(r));
+  std::sort(sorted.begin(), sorted.end());
+  vector<string> top;
+  for (auto &r : sorted) {
+    bool nested = false;
+    for (auto &t : top)
+      nested = nested || r == t || !r.compare(0, t.size() + 1, t + "/");
+    if (!nested)
+      top.push_back(r);
+  }
+
+  vector<Item> items;
+  for (auto &r : top) {
+    struct stat st;
+    // a root that does not exist is recorded as empty
+    if (::stat(r.c_str(), &st) < 0 || !S_ISDIR(st.st_mode))
+      continue;
+    set<std::pair<dev_t, ino_t>> active;
+    if (!walk(r, st, &active, &items)) {
+      fprintf(stderr, "%s: %s\n", r.c_str(), strerror(errno));
+      return false;
+    }
+  }
+  std::sort(items.begin(), items.end(), by_name);
+  // the same path reached through two links is kept once
+  items.erase(std::unique(items.begin(), items.end(),
+                          [](const Item &a, const Item &b) { return a.name == b.name; }),
+              items.end());
+
+  vector<Item> wit;
+  for (auto &w : witnesses) {
+    struct stat st;
+    if (::stat(w.c_str(), &st) < 0)
+      wit.push_back({normalize(w), false, (uint64_t)-1, 0, nullptr, ""});
+    else
+      wit.push_back({normalize(w), false, (uint64_t)st.st_size, (int64_t)st.st_mtime, nullptr, ""});
+  }
+
+  string tmp_path = path + ".XXXXXX";
+  int fd = ::mkstemp(&tmp_path[0]);
+  if (fd < 0) {
+    fprintf(stderr, "%s: %s\n", tmp_path.c_str(), strerror(errno));
+    return false;
+  }
+  bool ok = write_archive(fd, nullptr, top, wit, items);
+  if (::close(fd) < 0)
+    ok = false;
+  if (!ok) {
+    fprintf(stderr, "Failed to write the header archive %s\n", path.c_str());
+    ::unlink(tmp_path.c_str());
+    return false;
+  }
+  if (::rename(tmp_path.c_str(), path.c_str()) < 0) {
+    fprintf(stderr, "%s: %s\n", path.c_str(), strerror(errno));
+    ::unlink(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+unique_ptr<HeaderArchive> HeaderArchive::pack(const map<string, const char *> &files,
+                                               const vector<string> &roots) {
+  vector<Item> items;
+  set<string> dirs;
+  for (auto &f : files) {
+    string name = normalize(f.first);
+    items.push_back({name, false, strlen(f.second), 0, f.second, ""});
+    for (size_t slash = name.rfind('/'); slash != string::npos && slash > 0;
+         slash = name.rfind('/', slash - 1))
+      dirs.insert(name.substr(0, slash));
+  }
+  for (auto &d : dirs)
+    items.push_back({d, true, 0, 0, nullptr, ""});
+  std::sort(items.begin(), items.end(), by_name);
+  vector<string> norm_roots;
+  for (auto &r : roots)
+    norm_roots.push_back(normalize(r));
+
+  unique_ptr<HeaderArchive> archive(new HeaderArchive());
+  if (!write_archive(-1, &archive->image_, norm_roots, {}, items))
+    return nullptr;
+  archive->base_ = archive->image_.data();
+  archive->len_ = archive->image_.size();
+  if (!archive->init())
+    return nullptr;
+  return archive;
+}
+
+unique_ptr<HeaderArchive> HeaderArchive::open(const string &path) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return nullptr;
+  return open(fd, path);
+}
+
+unique_ptr<HeaderArchive> HeaderArchive::open(int fd, const string &path) {
+  struct stat st;
+  if (::fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || (size_t)st.st_size < sizeof(ArchiveHeader)) {
+    ::close(fd);
+    return nullptr;
+  }
+  void *base = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (base == MAP_FAILED)
+    return nullptr;
+  unique_ptr<HeaderArchive> archive(new HeaderArchive());
+  archive->base_ = (const char *)base;
+  archive->len_ = st.st_size;
+  archive->mapped_ = true;
+  archive->stamp_ = std::to_string((long long)st.st_size) + " " +
+                    std::to_string((long long)st.st_mtime) + " " + path;
+  if (!archive->init()) {
+    fprintf(stderr, "%s: not a valid header archive\n", path.c_str());
+    return nullptr;
+  }
+  return archive;
+}
+
+// check the bounds of everything once, so that lookups need not
+bool HeaderArchive::init() {
+  const ArchiveHeader *h = (const ArchiveHeader *)base_;
+  if (len_ < sizeof(ArchiveHeader) || memcmp(h->magic, ARCHIVE_MAGIC, sizeof(h->magic)) ||
+      h->length != len_)
+    return false;
+  uint64_t n = (uint64_t)h->nroots + h->nwitnesses + h->nentries;
+  if (h->strings < sizeof(ArchiveHeader) || (h->strings - sizeof(ArchiveHeader)) / sizeof(ArchiveEntry) < n ||
+      h->strings > len_)
+    return false;
+  const ArchiveEntry *ents = (const ArchiveEntry *)(base_ + sizeof(ArchiveHeader));
+  uint64_t strings_len = len_ - h->strings;
+  for (uint64_t i = 0; i < n; ++i) {
+    const ArchiveEntry &e = ents[i];
+    if (e.name > strings_len || e.name_len > strings_len - e.name)
+      return false;
+    if (i >= h->nroots + h->nwitnesses && !e.dir &&
+        (e.data > len_ || e.size >= len_ - e.data || base_[e.data + e.size] != '\0'))
+      return false;
+  }
+  roots_ = ents;
+  witnesses_ = roots_ + h->nroots;
+  entries_ = witnesses_ + h->nwitnesses;
+  nroots_ = h->nroots;
+  nwitnesses_ = h->nwitnesses;
+  nentries_ = h->nentries;
+  for (size_t i = 1; i < nentries_; ++i)
+    if (name(entries_[i - 1]) >= name(entries_[i]))
+      return false;
+  return true;
+}
+
+string HeaderArchive::name(const ArchiveEntry &e) const {
+  const ArchiveHeader *h = (const ArchiveHeader *)base_;
+  return string(base_ + h->strings + e.name, e.name_len);
+}
+
+HeaderArchive::File HeaderArchive::file(const ArchiveEntry &e) const {
+  return {name(e), e.dir ? nullptr : base_ + e.data, e.dir ? 0 : e.size, e.mtime};
+}
+
+bool HeaderArchive::covers(const string &path) const {
+  for (size_t i = 0; i < nroots_; ++i) {
+    string root = name(roots_[i]);
+    if (!path.compare(0, root.size(), root) && (path.size() == root.size() || path[root.size()] == '/'))
+      return true;
+  }
+  return false;
+}
+
+bool HeaderArchive::lookup(const string &path, File *f) const {
+  const ArchiveEntry *end = entries_ + nentries_;
+  const ArchiveEntry *e = std::lower_bound(entries_, end, path, [this](const ArchiveEntry &e, const string &p) {
+    return name(e) < p;
+  });
+  if (e == end || name(*e) != path)
+    return false;
+  *f = file(*e);
+  return true;
+}
+
+vector<HeaderArchive::File> HeaderArchive::list(const string &dir) const {
+  vector<File> files;
+  string prefix = dir == "/" ? dir : dir + "/";
+  const ArchiveEntry *end = entries_ + nentries_;
+  const ArchiveEntry *e = std::lower_bound(entries_, end, prefix, [this](const ArchiveEntry &e, const string &p) {
+    return name(e) < p;
+  });
+  for (; e != end; ++e) {
+    string n = name(*e);
+    if (n.compare(0, prefix.size(), prefix))
+      break;
+    if (n.find('/', prefix.size()) == string::npos)
+      files.push_back(file(*e));
+  }
+  return files;
+}
+
+bool HeaderArchive::fresh() const {
+  for (size_t i = 0; i < nwitnesses_; ++i) {
+    const ArchiveEntry &w = witnesses_[i];
+    struct stat st;
+    bool exists = ::stat(name(w).c_str(), &st) == 0;
+    if (exists != (w.size != (uint64_t)-1))
+      return false;
+    if (exists && ((uint64_t)st.st_size != w.size || (int64_t)st.st_mtime != w.mtime))
+      return false;
+  }
+  // a file added, removed or replaced below a root changes the mtime of its
+  // directory. Packed archives have nothing on disk to compare with.
+  if (stamp_.empty())
+    return true;
+  for (size_t i = 0; i < nentries_; ++i) {
+    const ArchiveEntry &e = entries_[i];
+    if (!e.dir)
+      continue;
+    struct stat st;
+    if (::stat(name(e).c_str(), &st) < 0 || !S_ISDIR(st.st_mode) ||
+        (int64_t)st.st_mtime != e.mtime)
+      return false;
+  }
+  return true;
+}
+
+}  // namespace ebpf
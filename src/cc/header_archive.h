@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2016 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace ebpf {
+
+struct ArchiveEntry;
+
+// A read-only snapshot of header trees in one indexed file, which the
+// compiler reads through a single mapping instead of opening and stat'ing
+// every header.
+//
+// The archive covers a set of root directories: every file and directory
+// below them is in the index, and anything else below them is known not to
+// exist. Witnesses are files whose size and mtime are recorded to tell when
+// the snapshot is out of date, along with the mtimes of the directories. The layout, in host byte order:
+//
+//   header     magic "bcc-headers-1", counts and the offset of the strings
+//   roots      one Entry each, only the name is used
+//   witnesses  one Entry each, size -1 if the file did not exist
+//   entries    files and directories, sorted by name
+//   strings    the names
+//   data       the contents of the files, each followed by a NUL
+class HeaderArchive {
+ public:
+  struct File {
+    std::string name;
+    const char *data;  // null for directories
+    uint64_t size;
+    int64_t mtime;
+  };
+
+  ~HeaderArchive();
+  // Map the archive at path, null if it is missing or malformed
+  static std::unique_ptr<HeaderArchive> open(const std::string &path);
+  // Same for an open file, which is closed
+  static std::unique_ptr<HeaderArchive> open(int fd, const std::string &path);
+  // An archive of files held in memory, e.g. the embedded headers, with
+  // the directories holding them
+  static std::unique_ptr<HeaderArchive> pack(const std::map<std::string, const char *> &files,
+                                             const std::vector<std::string> &roots);
+  // Snapshot everything below roots, following symbolic links, into an
+  // archive at path. The file is written to a temporary and renamed.
+  static bool create(const std::string &path, const std::vector<std::string> &roots,
+                     const std::vector<std::string> &witnesses);
+  // The absolute path with "." and ".." resolved and duplicate slashes removed
+  static std::string normalize(const std::string &path);
+
+  // Whether path, as returned by normalize(), is below a root. If so
+  // lookup() is authoritative for it.
+  bool covers(const std::string &path) const;
+  // Find the file or directory at a normalized path
+  bool lookup(const std::string &path, File *file) const;
+  // The entries directly inside the directory at a normalized path
+  std::vector<File> list(const std::string &dir) const;
+  // Whether the witnesses and the mtimes of the archived directories still
+  // match the filesystem
+  bool fresh() const;
+  // "<size> <mtime> <path>" of the archive file, empty for packed ones
+  const std::string & stamp() const { return stamp_; }
+  size_t size() const { return nentries_; }
+
+ private:
+  HeaderArchive() {}
+  bool init();
+  std::string name(const ArchiveEntry &e) const;
+  File file(const ArchiveEntry &e) const;
+
+  const char *base_ = nullptr;
+  size_t len_ = 0;
+  bool mapped_ = false;
+  std::string image_;  // the contents of packed archives
+  const ArchiveEntry *roots_ = nullptr;
+  const ArchiveEntry *witnesses_ = nullptr;
+  const ArchiveEntry *entries_ = nullptr;
+  size_t nroots_ = 0, nwitnesses_ = 0, nentries_ = 0;
+  std::string stamp_;
+};
+
+}  // namespace ebpf
@@ -127,6 +127,324 @@ int bpf_get_next_key(int fd, void *key, void *next_key)
   return syscall(__NR_bpf, BPF_MAP_GET_NEXT_KEY, &attr, sizeof(attr));
 }
 
+int bpf_get_first_key(int fd, void *key, size_t key_size)
+{
+  int i;
+
+  // kernels since 4.12 return the first key for a NULL one
+  if (bpf_get_next_key(fd, NULL, key) == 0)
+    return 0;
+  if (errno == ENOENT)
+    return -1;
+
+  // older ones do the same for any key not in the map. Looking a key up
+  // into a NULL value fails with ENOENT if it is missing and EFAULT if not,
+  // which tells without knowing the size of the values.
+  for (i = 0; i < 256; ++i) {
+    memset(key, i, key_size);
+    if (bpf_lookup_elem(fd, key, NULL) == 0 || errno == EFAULT)
+      continue;
+    if (errno != ENOENT)
+      return -1;
+    return bpf_get_next_key(fd, key, key);
+  }
+  errno = ENOENT;
+  return -1;
+}
+
+int bpf_count_elems(int fd, size_t key_size)
+{
+  // the walk alternates between two keys
+  char *keys = malloc(key_size * 2);
+  int n = 0, err;
+
+  if (!keys)
+    return -1;
+  if (bpf_get_first_key(fd, keys, key_size) == 0) {
+    do {
+      ++n;
+    } while (bpf_get_next_key(fd, keys + (n - 1) % 2 * key_size,
+                              keys + n % 2 * key_size) == 0);
+  }
+  err = errno;
+  free(keys);
+  if (err != ENOENT) {
+    errno = err;
+    return -1;
+  }
+  return n;
+}
+
+int bpf_lookup_batch(int fd, void *start_key, void *keys, void *values,
+                     size_t key_size, size_t value_size, unsigned max)
+{
+  unsigned n = 0;
+  void *key = start_key;
+  char *next;
+  int res;
+
+  while (n < max) {
+    next = (char *)keys + (size_t)n * key_size;
+    // the kernel copies key in before writing next_key, so they may overlap
+    res = key ? bpf_get_next_key(fd, key, next) : bpf_get_first_key(fd, next, key_size);
+    if (res < 0) {
+      if (errno == ENOENT)
+        break;
+      return -1;
+    }
+    key = next;
+    if (values && bpf_lookup_elem(fd, next, (char *)values + (size_t)n * value_size) < 0) {
+      // deleted since get_next_key, its slot is reused for the next one
+      if (errno == ENOENT)
+        continue;
+      return -1;
+    }
+    ++n;
+  }
+  return n;
+}
+
+int bpf_update_batch(int fd, void *keys, void *values, size_t key_size,
+                     size_t value_size, unsigned n, unsigned long long flags)
+{
+  unsigned i;
+  for (i = 0; i < n; ++i) {
+    if (bpf_update_elem(fd, (char *)keys + (size_t)i * key_size,
+                        (char *)values + (size_t)i * value_size, flags) < 0)
+      return -1;
+  }
+  return n;
+}
+
+int bpf_delete_batch(int fd, void *keys, size_t key_size, unsigned n)
+{
+  unsigned i;
+  int deleted = 0;
+  for (i = 0; i < n; ++i) {
+    if (bpf_delete_elem(fd, (char *)keys + (size_t)i * key_size) < 0) {
+      if (errno == ENOENT)
+        continue;
+      return -1;
+    }
+    ++deleted;
+  }
+  return deleted;
+}
+
+int bpf_num_possible_cpus(void)
+{
+  static int possible;
+  FILE *f;
+  int lo, hi, c, n = 0;
+
+  if (possible)
+    return possible;
+  // a list of ranges, e.g. 0-3,6
+  f = fopen("/sys/devices/system/cpu/possible", "r");
+  if (!f)
+    return -1;
+  while (fscanf(f, "%d", &lo) == 1) {
+    hi = lo;
+    c = fgetc(f);
+    if (c == '-') {
+      if (fscanf(f, "%d", &hi) != 1)
+        break;
+      c = fgetc(f);
+    }
+    n += hi - lo + 1;
+    if (c != ',')
+      break;
+  }
+  fclose(f);
+  if (n <= 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  possible = n;
+  return n;
+}
+
+static __u64 load_unsigned(const char *p, unsigned size)
+{
+  __u8 v8; __u16 v16; __u32 v32; __u64 v64;
+  switch (size) {
+    case 1: memcpy(&v8, p, 1); return v8;
+    case 2: memcpy(&v16, p, 2); return v16;
+    case 4: memcpy(&v32, p, 4); return v32;
+    default: memcpy(&v64, p, 8); return v64;
+  }
+}
+
+static __s64 load_signed(const char *p, unsigned size)
+{
+  __s8 v8; __s16 v16; __s32 v32; __s64 v64;
+  switch (size) {
+    case 1: memcpy(&v8, p, 1); return v8;
+    case 2: memcpy(&v16, p, 2); return v16;
+    case 4: memcpy(&v32, p, 4); return v32;
+    default: memcpy(&v64, p, 8); return v64;
+  }
+}
+
+static double load_float(const char *p, unsigned size)
+{
+  float f;
+  double d;
+  if (size == 4) {
+    memcpy(&f, p, 4);
+    return f;
+  }
+  memcpy(&d, p, 8);
+  return d;
+}
+
+// stores keep the low bytes, i.e. the value truncated to the field
+static void store_unsigned(char *p, unsigned size, __u64 v)
+{
+  __u8 v8 = v; __u16 v16 = v; __u32 v32 = v;
+  switch (size) {
+    case 1: memcpy(p, &v8, 1); break;
+    case 2: memcpy(p, &v16, 2); break;
+    case 4: memcpy(p, &v32, 4); break;
+    default: memcpy(p, &v, 8); break;
+  }
+}
+
+static void store_float(char *p, unsigned size, double v)
+{
+  float f = v;
+  if (size == 4)
+    memcpy(p, &f, 4);
+  else
+    memcpy(p, &v, 8);
+}
+
+#define REDUCE_STEP(op, acc, v) \
+  ((op) == BPF_REDUCE_MIN ? ((v) < (acc) ? (v) : (acc)) : \
+   (op) == BPF_REDUCE_MAX ? ((v) > (acc) ? (v) : (acc)) : (acc) + (v))
+
+int bpf_percpu_reduce(const void *values, void *out, unsigned n, unsigned ncpus,
+                      size_t leaf_size, const unsigned *offsets, const unsigned *sizes,
+                      const int *kinds, unsigned nfields, int op)
+{
+  size_t stride = (leaf_size + 7) & ~(size_t)7;
+  unsigned i, f, cpu;
+
+  if (!ncpus || op < BPF_REDUCE_SUM || op > BPF_REDUCE_AVG) {
+    errno = EINVAL;
+    return -1;
+  }
+  for (f = 0; f < nfields; ++f) {
+    if ((sizes[f] != 1 && sizes[f] != 2 && sizes[f] != 4 && sizes[f] != 8) ||
+        (kinds[f] == BPF_FIELD_FLOAT && sizes[f] < 4) ||
+        offsets[f] + sizes[f] > leaf_size) {
+      errno = EINVAL;
+      return -1;
+    }
+  }
+
+  for (i = 0; i < n; ++i) {
+    const char *row = (const char *)values + (size_t)i * stride * ncpus;
+    char *leaf = (char *)out + (size_t)i * leaf_size;
+    // the bytes outside of the fields keep the value of the first cpu
+    memcpy(leaf, row, leaf_size);
+    for (f = 0; f < nfields; ++f) {
+      const char *p = row + offsets[f];
+      if (kinds[f] == BPF_FIELD_FLOAT) {
+        double acc = load_float(p, sizes[f]), v;
+        for (cpu = 1; cpu < ncpus; ++cpu) {
+          v = load_float(p + cpu * stride, sizes[f]);
+          acc = REDUCE_STEP(op, acc, v);
+        }
+        if (op == BPF_REDUCE_AVG)
+          acc /= ncpus;
+        store_float(leaf + offsets[f], sizes[f], acc);
+      } else if (kinds[f] == BPF_FIELD_SIGNED) {
+        __s64 acc = load_signed(p, sizes[f]), v;
+        for (cpu = 1; cpu < ncpus; ++cpu) {
+          v = load_signed(p + cpu * stride, sizes[f]);
+          acc = REDUCE_STEP(op, acc, v);
+        }
+        if (op == BPF_REDUCE_AVG)
+          acc /= (__s64)ncpus;
+        store_unsigned(leaf + offsets[f], sizes[f], (__u64)acc);
+      } else {
+        __u64 acc = load_unsigned(p, sizes[f]), v;
+        for (cpu = 1; cpu < ncpus; ++cpu) {
+          v = load_unsigned(p + cpu * stride, sizes[f]);
+          acc = REDUCE_STEP(op, acc, v);
+        }
+        if (op == BPF_REDUCE_AVG)
+          acc /= ncpus;
+        store_unsigned(leaf + offsets[f], sizes[f], acc);
+      }
+    }
+  }
+  return 0;
+}
+
+void bpf_relocate_map_fds(struct bpf_insn *insns, int insn_cnt,
+                          const int *old_fds, const int *new_fds, int nfds)
+{
+  int i, j;
+  for (i = 0; i < insn_cnt; ++i) {
+    if (insns[i].code != (BPF_LD | BPF_DW | BPF_IMM))
+      continue;
+    if (insns[i].src_reg == BPF_PSEUDO_MAP_FD) {
+      for (j = 0; j < nfds; ++j) {
+        if (insns[i].imm == old_fds[j]) {
+          insns[i].imm = new_fds[j];
+          break;
+        }
+      }
+    }
+    // ld_imm64 occupies two instruction slots
+    ++i;
+  }
+}
+
+unsigned bpf_const_hash(const char *name)
+{
+  /* 32-bit FNV-1a */
+  unsigned h = 2166136261u;
+  for (; *name; ++name) {
+    h ^= (unsigned char)*name;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+int bpf_bind_consts(struct bpf_insn *insns, int insn_cnt, const char *names[],
+                    const unsigned long long *values, int n)
+{
+  unsigned *hashes = NULL;
+  int i, j, unbound = 0;
+  if (n > 0 && !(hashes = calloc(n, sizeof(*hashes))))
+    return -1;
+  for (j = 0; j < n; ++j)
+    hashes[j] = bpf_const_hash(names[j]);
+  for (i = 0; i + 1 < insn_cnt; ++i) {
+    if (insns[i].code != (BPF_LD | BPF_DW | BPF_IMM))
+      continue;
+    if (insns[i].src_reg == BPF_PSEUDO_CONST) {
+      for (j = 0; j < n; ++j) {
+        if ((unsigned)insns[i].imm == hashes[j]) {
+          insns[i].src_reg = 0;
+          insns[i].imm = (int)(unsigned)values[j];
+          insns[i + 1].imm = (int)(unsigned)(values[j] >> 32);
+          break;
+        }
+      }
+      if (j == n)
+        ++unbound;
+    }
+    // ld_imm64 occupies two instruction slots
+    ++i;
+  }
+  free(hashes);
+  return unbound;
+}
+
 #define ROUND_UP(x, n) (((x) + (n) - 1u) & ~((n) - 1u))
 
 char bpf_log_buf[LOG_BUF_SIZE];
@@ -135,6 +453,23 @@ int bpf_prog_load(enum bpf_prog_type prog_type,
                   const struct bpf_insn *insns, int prog_len,
                   const char *license, unsigned kern_version,
                   char *log_buf, unsigned log_buf_size)
+{
+  int ret = bpf_prog_load_level(prog_type, insns, prog_len, license, kern_version,
+                                log_buf ? 1 : 0, log_buf, log_buf_size);
+  if (ret < 0 && !log_buf) {
+    // caller did not specify log_buf but failure should be printed,
+    // so call recursively and print the result to stderr
+    bpf_prog_load(prog_type, insns, prog_len, license, kern_version,
+        bpf_log_buf, LOG_BUF_SIZE);
+    fprintf(stderr, "bpf: %s\n%s\n", strerror(errno), bpf_log_buf);
+  }
+  return ret;
+}
+
+int bpf_prog_load_level(enum bpf_prog_type prog_type,
+                        const struct bpf_insn *insns, int prog_len,
+                        const char *license, unsigned kern_version,
+                        unsigned log_level, char *log_buf, unsigned log_buf_size)
 {
   union bpf_attr attr;
   memset(&attr, 0, sizeof(attr));
@@ -142,13 +477,14 @@ int bpf_prog_load(enum bpf_prog_type prog_type,
   attr.insns = ptr_to_u64((void *) insns);
   attr.insn_cnt = prog_len / sizeof(struct bpf_insn);
   attr.license = ptr_to_u64((void *) license);
-  attr.log_buf = ptr_to_u64(log_buf);
-  attr.log_size = log_buf_size;
-  attr.log_level = log_buf ? 1 : 0;
+  if (log_buf && log_level) {
+    attr.log_buf = ptr_to_u64(log_buf);
+    attr.log_size = log_buf_size;
+    attr.log_level = log_level;
+    log_buf[0] = 0;
+  }
 
   attr.kern_version = kern_version;
-  if (log_buf)
-    log_buf[0] = 0;
 
   int ret = syscall(__NR_bpf, BPF_PROG_LOAD, &attr, sizeof(attr));
   if (ret < 0 && errno == EPERM) {
@@ -168,14 +504,6 @@ int bpf_prog_load(enum bpf_prog_type prog_type,
         ret = syscall(__NR_bpf, BPF_PROG_LOAD, &attr, sizeof(attr));
     }
   }
-
-  if (ret < 0 && !log_buf) {
-    // caller did not specify log_buf but failure should be printed,
-    // so call recursively and print the result to stderr
-    bpf_prog_load(prog_type, insns, prog_len, license, kern_version,
-        bpf_log_buf, LOG_BUF_SIZE);
-    fprintf(stderr, "bpf: %s\n%s\n", strerror(errno), bpf_log_buf);
-  }
   return ret;
 }
 
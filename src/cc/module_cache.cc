@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2016 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/Support/MD5.h>
+
+#include "exported_files.h"
+#include "module_cache.h"
+
+namespace ebpf {
+
+using std::string;
+
+// bump whenever the rewriter or the cache entry layout changes
+static const char *CACHE_FORMAT = "bcc-module-cache-4";
+static const char *DEFAULT_CACHE_DIR = "/var/tmp/bcc-cache";
+
+std::atomic<size_t> ModuleCache::hits_(0);
+std::atomic<size_t> ModuleCache::misses_(0);
+
+static void hash_str(llvm::MD5 *h, const string &s) {
+  // length-prefix each component so that adjacent fields can't alias
+  uint64_t len = s.size();
+  h->update(llvm::ArrayRef<uint8_t>((const uint8_t *)&len, sizeof(len)));
+  h->update(s);
+}
+
+string ModuleCache::make_key(const string &main_path, const string &text,
+                             const char *cflags[], int ncflags) {
+  llvm::MD5 h;
+  hash_str(&h, CACHE_FORMAT);
+  hash_str(&h, LLVM_VERSION_STRING);
+
+  struct utsname un;
+  if (uname(&un) == 0) {
+    hash_str(&h, un.release);
+    hash_str(&h, un.version);
+    hash_str(&h, un.machine);
+  }
+  // bpf_num_cpus() and perf output tables are sized at compile time
+  hash_str(&h, std::to_string(sysconf(_SC_NPROCESSORS_ONLN)));
+
+  for (auto f : ExportedFiles::headers()) {
+    hash_str(&h, f.first);
+    hash_str(&h, f.second);
+  }
+
+  hash_str(&h, main_path);
+  hash_str(&h, text);
+  hash_str(&h, std::to_string(ncflags));
+  for (int i = 0; cflags && i < ncflags; ++i)
+    hash_str(&h, cflags[i] ? cflags[i] : "");
+
+  llvm::MD5::MD5Result res;
+  h.final(res);
+  llvm::SmallString<32> hex;
+  llvm::MD5::stringifyResult(res, hex);
+  return hex.str().str();
+}
+
+static bool is_private(const struct stat &st) {
+  return st.st_uid == geteuid() && !(st.st_mode & (S_IWGRP | S_IWOTH));
+}
+
+bool ModuleCache::enabled() {
+  const char *env = getenv("BCC_CACHE_DIR");
+  return !env || env[0] != '\0';
+}
+
+bool ModuleCache::dir(string *path) {
+  const char *env = getenv("BCC_CACHE_DIR");
+  if (env && env[0] == '\0')
+    return false;
+  *path = env ? env : DEFAULT_CACHE_DIR;
+  if (::mkdir(path->c_str(), 0700) < 0 && errno != EEXIST)
+    return false;
+  struct stat st;
+  if (::lstat(path->c_str(), &st) < 0)
+    return false;
+  if (!S_ISDIR(st.st_mode) || !is_private(st))
+    return false;
+  return true;
+}
+
+bool ModuleCache::path(const string &key, string *path) {
+  if (!dir(path))
+    return false;
+  *path += "/" + key;
+  return true;
+}
+
+int ModuleCache::open(const string &key) {
+  string path;
+  if (!dir(&path))
+    return -1;
+  path += "/" + key;
+
+  int fd = ::open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  struct stat st;
+  if (::fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || !is_private(st)) {
+    ::close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+bool ModuleCache::read(const string &key, string *data) {
+  int fd = open(key);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (::fstat(fd, &st) < 0) {
+    ::close(fd);
+    return false;
+  }
+  data->resize(st.st_size);
+  size_t off = 0;
+  while (off < data->size()) {
+    ssize_t n = ::read(fd, &(*data)[off], data->size() - off);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR)
+        continue;
+      ::close(fd);
+      return false;
+    }
+    off += n;
+  }
+  ::close(fd);
+  return true;
+}
+
+bool ModuleCache::write(const string &key, const string &data) {
+  string path;
+  if (!dir(&path))
+    return false;
+  string final_path = path + "/" + key;
+  string tmp_path = final_path + ".XXXXXX";
+
+  int fd = ::mkstemp(&tmp_path[0]);
+  if (fd < 0)
+    return false;
+  size_t off = 0;
+  while (off < data.size()) {
+    ssize_t n = ::write(fd, data.data() + off, data.size() - off);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      ::close(fd);
+      ::unlink(tmp_path.c_str());
+      return false;
+    }
+    off += n;
+  }
+  ::close(fd);
+  // concurrent writers of the same key produce identical content, so last
+  // rename wins
+  if (::rename(tmp_path.c_str(), final_path.c_str()) < 0) {
+    ::unlink(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+}  // namespace ebpf
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2016 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+namespace ebpf {
+
+// Content-addressed on-disk cache of compiled modules.
+//
+// The cache directory is taken from $BCC_CACHE_DIR, defaulting to
+// /var/tmp/bcc-cache. Setting BCC_CACHE_DIR to the empty string disables the
+// cache. Since cached entries are loaded into the kernel, the directory (and
+// each entry) must be owned by the current user and not be writable by
+// anyone else, otherwise the cache is silently bypassed.
+class ModuleCache {
+ public:
+  // Compute the cache key for a C program. The key covers the source text,
+  // cflags, the running kernel, the embedded bcc headers and the LLVM
+  // version. The files the program includes are not known until it is
+  // compiled, callers keep them alongside the entry.
+  static std::string make_key(const std::string &main_path, const std::string &text,
+                              const char *cflags[], int ncflags);
+  // return true and fill in data if an entry for key exists
+  static bool read(const std::string &key, std::string *data);
+  // return a read-only descriptor of the entry for key, or -1 if there is
+  // none, for entries that are mapped rather than read
+  static int open(const std::string &key);
+  // atomically store data as the entry for key, return true on success
+  static bool write(const std::string &key, const std::string &data);
+  // return true and fill in the on-disk location of the entry for key, for
+  // entries that are produced and consumed by external tools (e.g. clang)
+  static bool path(const std::string &key, std::string *path);
+  static bool enabled();
+
+  static void record_hit() { ++hits_; }
+  static void record_miss() { ++misses_; }
+  static size_t hits() { return hits_; }
+  static size_t misses() { return misses_; }
+ private:
+  static bool dir(std::string *path);
+  static std::atomic<size_t> hits_;
+  static std::atomic<size_t> misses_;
+};
+
+}  // namespace ebpf
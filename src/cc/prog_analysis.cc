@@ -0,0 +1,391 @@
+/*
+ * Copyright (c) 2016 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <linux/bpf.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <algorithm>
+#include <vector>
+
+#include "libbpf.h"
+#include "prog_analysis.h"
+
+// newer than the compat header, emitted by recent llvm
+#ifndef BPF_JLT
+#define BPF_JLT 0xa0
+#define BPF_JLE 0xb0
+#define BPF_JSLT 0xc0
+#define BPF_JSLE 0xd0
+#endif
+
+namespace ebpf {
+
+using std::string;
+using std::to_string;
+using std::vector;
+
+static const char * helper_name(int id) {
+  switch (id) {
+#define HELPER(_name) case BPF_FUNC_##_name: return #_name;
+  HELPER(map_lookup_elem)
+  HELPER(map_update_elem)
+  HELPER(map_delete_elem)
+  HELPER(probe_read)
+  HELPER(ktime_get_ns)
+  HELPER(trace_printk)
+  HELPER(get_prandom_u32)
+  HELPER(get_smp_processor_id)
+  HELPER(skb_store_bytes)
+  HELPER(l3_csum_replace)
+  HELPER(l4_csum_replace)
+  HELPER(tail_call)
+  HELPER(clone_redirect)
+  HELPER(get_current_pid_tgid)
+  HELPER(get_current_uid_gid)
+  HELPER(get_current_comm)
+  HELPER(get_cgroup_classid)
+  HELPER(skb_vlan_push)
+  HELPER(skb_vlan_pop)
+  HELPER(skb_get_tunnel_key)
+  HELPER(skb_set_tunnel_key)
+  HELPER(perf_event_read)
+  HELPER(redirect)
+  HELPER(get_route_realm)
+  HELPER(perf_event_output)
+  HELPER(skb_load_bytes)
+  HELPER(get_stackid)
+  HELPER(csum_diff)
+  HELPER(skb_get_tunnel_opt)
+  HELPER(skb_set_tunnel_opt)
+#undef HELPER
+  }
+  return nullptr;
+}
+
+static string helper_str(int id) {
+  const char *name = helper_name(id);
+  return name ? string(name) : "helper_" + to_string(id);
+}
+
+static const char * alu_op(int op) {
+  switch (op) {
+  case BPF_ADD: return "+=";
+  case BPF_SUB: return "-=";
+  case BPF_MUL: return "*=";
+  case BPF_DIV: return "/=";
+  case BPF_OR: return "|=";
+  case BPF_AND: return "&=";
+  case BPF_LSH: return "<<=";
+  case BPF_RSH: return ">>=";
+  case BPF_MOD: return "%=";
+  case BPF_XOR: return "^=";
+  case BPF_MOV: return "=";
+  case BPF_ARSH: return "s>>=";
+  }
+  return nullptr;
+}
+
+static const char * jmp_op(int op) {
+  switch (op) {
+  case BPF_JEQ: return "==";
+  case BPF_JGT: return ">";
+  case BPF_JGE: return ">=";
+  case BPF_JSET: return "&";
+  case BPF_JNE: return "!=";
+  case BPF_JSGT: return "s>";
+  case BPF_JSGE: return "s>=";
+  case BPF_JLT: return "<";
+  case BPF_JLE: return "<=";
+  case BPF_JSLT: return "s<";
+  case BPF_JSLE: return "s<=";
+  }
+  return nullptr;
+}
+
+static const char * size_str(int size) {
+  switch (size) {
+  case BPF_B: return "u8";
+  case BPF_H: return "u16";
+  case BPF_W: return "u32";
+  case BPF_DW: return "u64";
+  }
+  return "?";
+}
+
+static string reg(int r) { return "r" + to_string(r); }
+
+static string mem(const struct bpf_insn &insn, int base) {
+  char off[16];
+  snprintf(off, sizeof(off), "%+d", insn.off);
+  return string("*(") + size_str(BPF_SIZE(insn.code)) + " *)(" + reg(base) + " " + off + ")";
+}
+
+static string hex(long long v) {
+  char buf[24];
+  snprintf(buf, sizeof(buf), v < 0 ? "-0x%llx" : "0x%llx", v < 0 ? -(unsigned long long)v : v);
+  return buf;
+}
+
+// text of insns[i], *width is set to the number of slots it takes
+static string disasm_insn(const struct bpf_insn *insns, size_t cnt, size_t i, size_t *width) {
+  const struct bpf_insn &insn = insns[i];
+  int cls = BPF_CLASS(insn.code);
+  *width = 1;
+  switch (cls) {
+  case BPF_ALU:
+  case BPF_ALU64: {
+    string dst = cls == BPF_ALU ? "(u32) " + reg(insn.dst_reg) : reg(insn.dst_reg);
+    int op = BPF_OP(insn.code);
+    if (op == BPF_NEG)
+      return dst + " = -" + dst;
+    if (op == BPF_END)
+      return dst + " = " + (BPF_SRC(insn.code) == BPF_TO_BE ? "be" : "le") + to_string(insn.imm) +
+          " " + reg(insn.dst_reg);
+    const char *s = alu_op(op);
+    if (!s)
+      break;
+    string src;
+    if (BPF_SRC(insn.code) == BPF_X)
+      src = cls == BPF_ALU ? "(u32) " + reg(insn.src_reg) : reg(insn.src_reg);
+    else
+      src = hex(insn.imm);
+    return dst + " " + s + " " + src;
+  }
+  case BPF_LDX:
+    if (BPF_MODE(insn.code) != BPF_MEM)
+      break;
+    return reg(insn.dst_reg) + " = " + mem(insn, insn.src_reg);
+  case BPF_ST:
+    if (BPF_MODE(insn.code) != BPF_MEM)
+      break;
+    return mem(insn, insn.dst_reg) + " = " + hex(insn.imm);
+  case BPF_STX:
+    if (BPF_MODE(insn.code) == BPF_MEM)
+      return mem(insn, insn.dst_reg) + " = " + reg(insn.src_reg);
+    if (BPF_MODE(insn.code) == BPF_XADD)
+      return "lock " + mem(insn, insn.dst_reg) + " += " + reg(insn.src_reg);
+    break;
+  case BPF_LD:
+    if (insn.code == (BPF_LD | BPF_DW | BPF_IMM)) {
+      if (i + 1 >= cnt)
+        break;
+      *width = 2;
+      unsigned long long imm = (unsigned)insn.imm | ((unsigned long long)(unsigned)insns[i + 1].imm << 32);
+      if (insn.src_reg == BPF_PSEUDO_MAP_FD)
+        return reg(insn.dst_reg) + " = map_fd " + to_string(insn.imm);
+      if (insn.src_reg == BPF_PSEUDO_CONST)
+        return reg(insn.dst_reg) + " = const " + hex(imm);
+      return reg(insn.dst_reg) + " = " + hex(imm) + "ll";
+    }
+    if (BPF_MODE(insn.code) == BPF_ABS)
+      return string("r0 = *(") + size_str(BPF_SIZE(insn.code)) + " *)skb[" + to_string(insn.imm) + "]";
+    if (BPF_MODE(insn.code) == BPF_IND)
+      return string("r0 = *(") + size_str(BPF_SIZE(insn.code)) + " *)skb[" + reg(insn.src_reg) + " + " +
+          to_string(insn.imm) + "]";
+    break;
+  case BPF_JMP: {
+    int op = BPF_OP(insn.code);
+    char target[16];
+    snprintf(target, sizeof(target), "pc%+d", insn.off);
+    if (op == BPF_JA)
+      return string("goto ") + target;
+    if (op == BPF_EXIT)
+      return "exit";
+    if (op == BPF_CALL)
+      return "call " + helper_str(insn.imm) + "#" + to_string(insn.imm);
+    const char *s = jmp_op(op);
+    if (!s)
+      break;
+    string src = BPF_SRC(insn.code) == BPF_X ? reg(insn.src_reg) : hex(insn.imm);
+    return "if " + reg(insn.dst_reg) + " " + s + " " + src + " goto " + target;
+  }
+  }
+  return "unknown";
+}
+
+string disassemble(const struct bpf_insn *insns, size_t cnt) {
+  string s;
+  for (size_t i = 0; i < cnt;) {
+    size_t width;
+    string text = disasm_insn(insns, cnt, i, &width);
+    char prefix[32];
+    snprintf(prefix, sizeof(prefix), "%4zu: (%02x) ", i, insns[i].code);
+    s += prefix + text + "\n";
+    i += width;
+  }
+  return s;
+}
+
+static bool is_ld_imm64(const struct bpf_insn &insn) {
+  return insn.code == (BPF_LD | BPF_DW | BPF_IMM);
+}
+
+static bool is_call(const struct bpf_insn &insn) {
+  return insn.code == (BPF_JMP | BPF_CALL);
+}
+
+// instructions control may continue at after insns[i]
+static void successors(const struct bpf_insn *insns, size_t cnt, size_t i, vector<size_t> *out) {
+  out->clear();
+  const struct bpf_insn &insn = insns[i];
+  if (is_ld_imm64(insn)) {
+    if (i + 2 < cnt)
+      out->push_back(i + 2);
+    return;
+  }
+  if (BPF_CLASS(insn.code) != BPF_JMP || is_call(insn)) {
+    if (i + 1 < cnt)
+      out->push_back(i + 1);
+    return;
+  }
+  int op = BPF_OP(insn.code);
+  if (op == BPF_EXIT)
+    return;
+  long target = (long)i + 1 + insn.off;
+  if (op != BPF_JA && i + 1 < cnt)
+    out->push_back(i + 1);
+  if (target >= 0 && (size_t)target < cnt)
+    out->push_back(target);
+}
+
+// Lowest stack offset used through r10 or a copy of it adjusted by a
+// constant, tracked linearly and forgotten at jump targets
+static size_t stack_depth(const struct bpf_insn *insns, size_t cnt) {
+  vector<bool> is_target(cnt, false);
+  for (size_t i = 0; i < cnt; ++i) {
+    if (BPF_CLASS(insns[i].code) == BPF_JMP && !is_call(insns[i])) {
+      long target = (long)i + 1 + insns[i].off;
+      if (target >= 0 && (size_t)target < cnt)
+        is_target[target] = true;
+    }
+  }
+  const long UNKNOWN = 1;  // stack offsets are <= 0
+  long fp[MAX_BPF_REG];
+  auto reset = [&]() {
+    std::fill(fp, fp + MAX_BPF_REG, UNKNOWN);
+    fp[BPF_REG_10] = 0;
+  };
+  reset();
+  long lowest = 0;
+  auto use = [&](int r, long off) {
+    if (fp[r] != UNKNOWN)
+      lowest = std::min(lowest, fp[r] + off);
+  };
+  for (size_t i = 0; i < cnt; ++i) {
+    const struct bpf_insn &insn = insns[i];
+    if (is_target[i])
+      reset();
+    int cls = BPF_CLASS(insn.code);
+    if (cls == BPF_LDX) {
+      use(insn.src_reg, insn.off);
+      fp[insn.dst_reg] = UNKNOWN;
+    } else if (cls == BPF_ST || cls == BPF_STX) {
+      use(insn.dst_reg, insn.off);
+    } else if (cls == BPF_ALU64 && BPF_OP(insn.code) == BPF_MOV && BPF_SRC(insn.code) == BPF_X) {
+      fp[insn.dst_reg] = fp[insn.src_reg];
+    } else if (cls == BPF_ALU64 && BPF_SRC(insn.code) == BPF_K &&
+               (BPF_OP(insn.code) == BPF_ADD || BPF_OP(insn.code) == BPF_SUB)) {
+      if (fp[insn.dst_reg] != UNKNOWN)
+        fp[insn.dst_reg] += BPF_OP(insn.code) == BPF_ADD ? insn.imm : -(long)insn.imm;
+      use(insn.dst_reg, 0);
+    } else if (is_call(insn)) {
+      // r1-r5 are the arguments, a stack pointer among them may be written
+      for (int r = BPF_REG_1; r <= BPF_REG_5; ++r)
+        use(r, 0);
+      for (int r = BPF_REG_0; r <= BPF_REG_5; ++r)
+        fp[r] = UNKNOWN;
+    } else if (cls == BPF_ALU || cls == BPF_ALU64 || cls == BPF_LD) {
+      if (cls == BPF_LD && !is_ld_imm64(insn))
+        fp[BPF_REG_0] = UNKNOWN;
+      else
+        fp[insn.dst_reg] = UNKNOWN;
+      if (is_ld_imm64(insn))
+        ++i;
+    }
+  }
+  return -lowest;
+}
+
+ProgCost ProgCost::analyze(const struct bpf_insn *insns, size_t cnt) {
+  ProgCost cost;
+  cost.insns = cnt;
+  for (size_t i = 0; i < cnt; ++i) {
+    if (is_call(insns[i])) {
+      ++cost.calls;
+      ++cost.helpers[helper_str(insns[i].imm)];
+    } else if (is_ld_imm64(insns[i])) {
+      ++i;
+    }
+  }
+  cost.stack_bytes = stack_depth(insns, cnt);
+  if (!cnt)
+    return cost;
+
+  // longest paths from each instruction to an exit, by an iterative DFS that
+  // finishes an instruction after all its successors; back edges are dropped
+  enum { NEW, OPEN, DONE };
+  vector<int> state(cnt, NEW);
+  vector<size_t> path_insns(cnt, 0), path_calls(cnt, 0);
+  vector<std::pair<size_t, size_t>> stack;  // insn, next successor to visit
+  vector<size_t> succ;
+  stack.push_back(std::make_pair(0, 0));
+  state[0] = OPEN;
+  while (!stack.empty()) {
+    size_t i = stack.back().first;
+    successors(insns, cnt, i, &succ);
+    if (stack.back().second < succ.size()) {
+      size_t next = succ[stack.back().second++];
+      if (state[next] == NEW) {
+        state[next] = OPEN;
+        stack.push_back(std::make_pair(next, 0));
+      } else if (state[next] == OPEN) {
+        cost.has_loops = true;
+      }
+      continue;
+    }
+    size_t best_insns = 0, best_calls = 0;
+    for (size_t next : succ) {
+      if (state[next] != DONE)
+        continue;
+      best_insns = std::max(best_insns, path_insns[next]);
+      best_calls = std::max(best_calls, path_calls[next]);
+    }
+    path_insns[i] = best_insns + 1;
+    path_calls[i] = best_calls + (is_call(insns[i]) ? 1 : 0);
+    state[i] = DONE;
+    stack.pop_back();
+  }
+  cost.max_path_insns = path_insns[0];
+  cost.max_path_calls = path_calls[0];
+  return cost;
+}
+
+string ProgCost::json() const {
+  string s = "{\"insns\": " + to_string(insns) + ", \"calls\": " + to_string(calls) + ", \"helpers\": {";
+  bool first = true;
+  for (auto &h : helpers) {
+    if (!first)
+      s += ", ";
+    first = false;
+    s += "\"" + h.first + "\": " + to_string(h.second);
+  }
+  s += "}, \"max_path_insns\": " + to_string(max_path_insns);
+  s += ", \"max_path_calls\": " + to_string(max_path_calls);
+  s += ", \"stack_bytes\": " + to_string(stack_bytes);
+  s += string(", \"has_loops\": ") + (has_loops ? "true" : "false") + "}";
+  return s;
+}
+
+}  // namespace ebpf
@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2016 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <map>
+#include <string>
+
+struct bpf_insn;
+
+namespace ebpf {
+
+// Text listing of a function, one instruction per line in the style of the
+// verifier log: "   3: (85) call probe_read#4"
+std::string disassemble(const struct bpf_insn *insns, size_t cnt);
+
+// Static cost estimate of a function, computed from its bytecode only. The
+// path figures assume the worst branch is taken everywhere; loops, which the
+// verifier rejects anyway, are followed once.
+class ProgCost {
+ public:
+  static ProgCost analyze(const struct bpf_insn *insns, size_t cnt);
+
+  size_t insns;  // instruction slots, ld_imm64 takes two
+  size_t calls;  // helper call sites
+  std::map<std::string, size_t> helpers;  // call sites by helper name
+  size_t max_path_insns;  // instructions on the longest path to an exit
+  size_t max_path_calls;  // helper calls on the path with the most of them
+  size_t stack_bytes;  // deepest stack slot accessed or passed to a helper
+  bool has_loops;
+
+  // {"insns": n, "calls": n, "helpers": {"probe_read": n, ...},
+  //  "max_path_insns": n, "max_path_calls": n, "stack_bytes": n, "has_loops": b}
+  std::string json() const;
+
+ private:
+  ProgCost() : insns(0), calls(0), max_path_insns(0), max_path_calls(0), stack_bytes(0),
+               has_loops(false) {}
+};
+
+}  // namespace ebpf
@@ -22,16 +22,13 @@ namespace ebpf {
 
 using std::string;
 
-SharedTables * SharedTables::instance_;
-
 SharedTables * SharedTables::instance() {
-  if (!instance_) {
-    instance_ = new SharedTables;
-  }
-  return instance_;
+  static SharedTables *instance = new SharedTables;
+  return instance;
 }
 
 int SharedTables::lookup_fd(const string &name) const {
+  std::lock_guard<std::mutex> lock(mutex_);
   auto table = tables_.find(name);
   if (table == tables_.end())
     return -1;
@@ -39,6 +36,7 @@ int SharedTables::lookup_fd(const string &name) const {
 }
 
 bool SharedTables::insert_fd(const string &name, int fd) {
+  std::lock_guard<std::mutex> lock(mutex_);
   if (tables_.find(name) != tables_.end())
     return false;
   tables_[name] = fd;
@@ -46,6 +44,7 @@ bool SharedTables::insert_fd(const string &name, int fd) {
 }
 
 bool SharedTables::remove_fd(const string &name) {
+  std::lock_guard<std::mutex> lock(mutex_);
   auto table = tables_.find(name);
   if (table == tables_.end())
     return false;
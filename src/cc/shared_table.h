@@ -17,6 +17,7 @@
 #pragma once
 
 #include <map>
+#include <mutex>
 #include <string>
 
 namespace ebpf {
@@ -33,7 +34,7 @@ class SharedTables {
   // close and remove a shared fd. return true if the value was found
   bool remove_fd(const std::string &name);
  private:
-  static SharedTables *instance_;
+  mutable std::mutex mutex_;  // modules may be compiled from several threads
   std::map<std::string, int> tables_;
 };
 
@@ -0,0 +1,615 @@
+/*
+ * Copyright (c) 2016 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <algorithm>
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "table_format.h"
+
+namespace ebpf {
+
+using std::string;
+using std::unique_ptr;
+using std::vector;
+
+// deepest struct/array nesting that is formatted
+static const int MAX_DEPTH = 32;
+
+void FormatBuf::put(const char *s, size_t n) {
+  if (pos_ + n >= len_) {
+    full_ = true;
+    return;
+  }
+  memcpy(buf_ + pos_, s, n);
+  pos_ += n;
+}
+
+void FormatBuf::put_dec(uint64_t v, bool neg) {
+  char tmp[24];
+  int i = sizeof(tmp);
+  do {
+    tmp[--i] = '0' + v % 10;
+    v /= 10;
+  } while (v);
+  if (neg)
+    tmp[--i] = '-';
+  put(tmp + i, sizeof(tmp) - i);
+}
+
+void FormatBuf::put_hex(uint64_t v) {
+  static const char digits[] = "0123456789abcdef";
+  char tmp[16];
+  int i = sizeof(tmp);
+  do {
+    tmp[--i] = digits[v & 0xf];
+    v >>= 4;
+  } while (v);
+  put(tmp + i, sizeof(tmp) - i);
+}
+
+namespace {
+
+// the subset of json that is produced by BMapDeclVisitor
+struct Desc {
+  enum Type { STR, NUM, LIST } type;
+  string str;
+  long long num;
+  vector<Desc> list;
+};
+
+bool parse_desc(const char **p, Desc *d, int depth) {
+  while (**p == ' ')
+    ++*p;
+  if (depth > MAX_DEPTH * 2)
+    return false;
+  if (**p == '"') {
+    d->type = Desc::STR;
+    for (++*p; **p != '"'; ++*p) {
+      if (!**p)
+        return false;
+      if (**p == '\\' && (*p)[1])
+        ++*p;
+      d->str += **p;
+    }
+    ++*p;
+    return true;
+  }
+  if (**p == '[') {
+    d->type = Desc::LIST;
+    ++*p;
+    while (**p == ' ')
+      ++*p;
+    if (**p == ']') {
+      ++*p;
+      return true;
+    }
+    for (;;) {
+      d->list.emplace_back();
+      if (!parse_desc(p, &d->list.back(), depth + 1))
+        return false;
+      while (**p == ' ')
+        ++*p;
+      if (**p == ']') {
+        ++*p;
+        return true;
+      }
+      if (**p != ',')
+        return false;
+      ++*p;
+    }
+  }
+  char *end;
+  d->type = Desc::NUM;
+  d->num = strtoll(*p, &end, 10);
+  if (end == *p)
+    return false;
+  *p = end;
+  return true;
+}
+
+struct Scalar {
+  const char *name;
+  uint32_t size;
+  bool is_signed;
+  bool is_float;
+};
+
+// sizes and alignments of the x86_64 and bpf targets
+const Scalar scalars[] = {
+  {"_Bool", 1, false, false},
+  {"char", 1, true, false},
+  {"signed char", 1, true, false},
+  {"unsigned char", 1, false, false},
+  {"short", 2, true, false},
+  {"unsigned short", 2, false, false},
+  {"int", 4, true, false},
+  {"unsigned int", 4, false, false},
+  {"wchar_t", 4, true, false},
+  {"long", 8, true, false},
+  {"unsigned long", 8, false, false},
+  {"long long", 8, true, false},
+  {"unsigned long long", 8, false, false},
+  {"__int128", 16, true, false},
+  {"unsigned __int128", 16, false, false},
+  {"float", 4, false, true},
+  {"double", 8, false, true},
+  {"long double", 16, false, true},
+};
+
+const Scalar * find_scalar(const string &name) {
+  for (auto &s : scalars)
+    if (name == s.name)
+      return &s;
+  return nullptr;
+}
+
+// arrays of plain characters are strings, byte buffers (u8 addresses,
+// hashes) are not: they may hold NULs and are printed as arrays
+bool is_char(const Scalar *s) {
+  return !strcmp(s->name, "char") || !strcmp(s->name, "signed char");
+}
+
+uint32_t round_up(uint32_t v, uint32_t align) {
+  return (v + align - 1) / align * align;
+}
+
+void skip_space(const char **p) {
+  while (isspace((unsigned char)**p))
+    ++*p;
+}
+
+// integer in any base, like %i
+bool scan_int(const char **p, uint64_t *v) {
+  char *end;
+  skip_space(p);
+  *v = strtoull(*p, &end, 0);
+  if (end == *p)
+    return false;
+  *p = end;
+  return true;
+}
+
+bool scan_char(const char **p, char c) {
+  skip_space(p);
+  if (**p != c)
+    return false;
+  ++*p;
+  return true;
+}
+
+}  // namespace
+
+// Lays out a parsed desc following the C rules and emits the fields. With a
+// null out, only the size and alignment are computed.
+struct TableFormat::Parser {
+  static bool layout(const Desc &d, const string &name, uint32_t base, int depth,
+                     uint32_t *size, uint32_t *align, vector<Field> *out) {
+    if (depth > MAX_DEPTH)
+      return false;
+    if (d.type == Desc::STR) {
+      const Scalar *s = find_scalar(d.str);
+      if (!s)
+        return false;
+      *size = *align = s->size;
+      if (out)
+        out->push_back(Field{Field::SCALAR, name, base, s->size, s->is_signed, s->is_float, 0, 0});
+      return true;
+    }
+    // [ "name", [ fields... ], "struct"|"union" ]
+    if (d.type != Desc::LIST || d.list.size() < 2 || d.list[1].type != Desc::LIST)
+      return false;
+    bool is_union = d.list.size() > 2 && d.list[2].type == Desc::STR && d.list[2].str == "union";
+    if (out)
+      out->push_back(Field{Field::BEGIN_STRUCT, name, base, 0, false, false, 0, 0});
+    uint32_t bit_pos = 0, end = 0;
+    *align = 1;
+    for (auto &f : d.list[1].list) {
+      if (f.type != Desc::LIST || f.list.size() < 2 || f.list[0].type != Desc::STR)
+        return false;
+      const string &fname = f.list[0].str;
+      const Desc &ftype = f.list[1];
+      uint32_t fsize, falign;
+      if (!layout(ftype, fname, 0, depth + 1, &fsize, &falign, nullptr))
+        return false;
+      *align = std::max(*align, falign);
+      if (is_union)
+        bit_pos = 0;
+
+      if (f.list.size() > 2 && f.list[2].type == Desc::NUM) {
+        // bitfield, packed into storage units of the declared type
+        const Scalar *s = ftype.type == Desc::STR ? find_scalar(ftype.str) : nullptr;
+        long long width = f.list[2].num;
+        if (!s || s->is_float || width < 0 || width > s->size * 8 || s->size > 8)
+          return false;
+        uint32_t unit_bits = s->size * 8;
+        if (width == 0) {
+          bit_pos = round_up(bit_pos, unit_bits);
+          continue;
+        }
+        uint32_t unit = bit_pos / unit_bits * unit_bits;
+        if (bit_pos + width > unit + unit_bits)
+          unit = bit_pos = unit + unit_bits;
+        if (out)
+          out->push_back(Field{Field::SCALAR, fname, base + unit / 8, s->size, s->is_signed, false,
+                               (uint8_t)(bit_pos - unit), (uint8_t)width});
+        bit_pos += width;
+        end = std::max(end, round_up(bit_pos, 8) / 8);
+        continue;
+      }
+
+      uint32_t offset = round_up(round_up(bit_pos, 8) / 8, falign);
+      if (f.list.size() > 2) {
+        // fixed size array
+        const Desc &dim = f.list[2];
+        if (dim.type != Desc::LIST || dim.list.size() != 1 || dim.list[0].type != Desc::NUM ||
+            dim.list[0].num < 0)
+          return false;
+        uint32_t n = dim.list[0].num;
+        const Scalar *s = ftype.type == Desc::STR ? find_scalar(ftype.str) : nullptr;
+        if (s && is_char(s)) {
+          if (out)
+            out->push_back(Field{Field::STRING, fname, base + offset, n, s->is_signed, false, 0, 0});
+        } else if (out) {
+          out->push_back(Field{Field::BEGIN_ARRAY, fname, base + offset, n, false, false, 0, 0});
+          for (uint32_t i = 0; i < n; ++i) {
+            uint32_t esize, ealign;
+            if (!layout(ftype, "", base + offset + i * fsize, depth + 1, &esize, &ealign, out))
+              return false;
+          }
+          out->push_back(Field{Field::END_ARRAY, fname, base + offset, n, false, false, 0, 0});
+        }
+        fsize *= n;
+      } else if (out) {
+        if (!layout(ftype, fname, base + offset, depth + 1, &fsize, &falign, out))
+          return false;
+      }
+      bit_pos = (offset + fsize) * 8;
+      end = std::max(end, offset + fsize);
+    }
+    *size = round_up(end, *align);
+    if (out)
+      out->push_back(Field{Field::END_STRUCT, name, base, *size, false, false, 0, 0});
+    return true;
+  }
+};
+
+unique_ptr<TableFormat> TableFormat::create(const string &desc) {
+  Desc d;
+  const char *p = desc.c_str();
+  if (!parse_desc(&p, &d, 0))
+    return nullptr;
+  unique_ptr<TableFormat> fmt(new TableFormat());
+  uint32_t size, align;
+  if (!Parser::layout(d, "", 0, 0, &size, &align, &fmt->fields_))
+    return nullptr;
+  // each array of structs nests twice, format() tracks at most MAX_DEPTH
+  int depth = 0;
+  for (auto &f : fmt->fields_) {
+    if (f.type == Field::BEGIN_STRUCT || f.type == Field::BEGIN_ARRAY) {
+      if (++depth > MAX_DEPTH)
+        return nullptr;
+    } else if (f.type == Field::END_STRUCT || f.type == Field::END_ARRAY) {
+      --depth;
+    }
+  }
+  fmt->size_ = size;
+  return fmt;
+}
+
+bool TableFormat::format_scalar(Kind kind, const Field &f, const uint8_t *rec,
+                                FormatBuf *out) const {
+  const uint8_t *p = rec + f.offset;
+  if (f.is_float) {
+    char tmp[64];
+    long double v;
+    if (f.size == 4) {
+      float x;
+      memcpy(&x, p, sizeof(x));
+      v = x;
+    } else if (f.size == 8) {
+      double x;
+      memcpy(&x, p, sizeof(x));
+      v = x;
+    } else {
+      memcpy(&v, p, sizeof(v));
+    }
+    if (kind == JSON && !isfinite(v)) {
+      out->put("null", 4);
+      return !out->full();
+    }
+    int n = snprintf(tmp, sizeof(tmp), "%.*Lg", f.size == 4 ? 9 : f.size == 8 ? 17 : 21, v);
+    out->put(tmp, n);
+    return !out->full();
+  }
+
+  if (f.size == 16) {
+    // printed as hex in all formats
+    uint64_t lo, hi;
+    memcpy(&lo, p, sizeof(lo));
+    memcpy(&hi, p + 8, sizeof(hi));
+    if (kind == JSON)
+      out->put('"');
+    out->put("0x", 2);
+    if (hi) {
+      out->put_hex(hi);
+      char tmp[17];
+      snprintf(tmp, sizeof(tmp), "%016llx", (unsigned long long)lo);
+      out->put(tmp, 16);
+    } else {
+      out->put_hex(lo);
+    }
+    if (kind == JSON)
+      out->put('"');
+    return !out->full();
+  }
+
+  uint64_t v = 0;
+  memcpy(&v, p, f.size);
+  uint32_t bits = f.size * 8;
+  if (f.bit_width) {
+    v >>= f.bit_offset;
+    bits = f.bit_width;
+  }
+  uint64_t mask = bits == 64 ? ~0ULL : (1ULL << bits) - 1;
+  v &= mask;
+  if (kind == TEXT) {
+    out->put("0x", 2);
+    out->put_hex(v);
+  } else if (f.is_signed && (v >> (bits - 1)) & 1) {
+    out->put_dec(-(v | ~mask), true);
+  } else {
+    out->put_dec(v, false);
+  }
+  return !out->full();
+}
+
+bool TableFormat::format_string(Kind kind, const Field &f, const uint8_t *rec,
+                                FormatBuf *out) const {
+  static const char digits[] = "0123456789abcdef";
+  const uint8_t *p = rec + f.offset;
+  if (kind == TEXT) {
+    // char arrays are plain arrays for the snprintf helpers
+    out->put("[ ", 2);
+    for (uint32_t i = 0; i < f.size; ++i) {
+      out->put("0x", 2);
+      out->put_hex(p[i]);
+      out->put(' ');
+    }
+    out->put(']');
+    return !out->full();
+  }
+  char quote[2] = {kind == JSON ? '\\' : '"', '"'};
+  out->put('"');
+  for (uint32_t i = 0; i < f.size && p[i]; ++i) {
+    uint8_t c = p[i];
+    if (c == '"' || (kind == JSON && c == '\\')) {
+      out->put(c == '"' ? quote : "\\\\", 2);
+    } else if (kind == JSON && (c < 0x20 || c >= 0x7f)) {
+      char esc[6] = {'\\', 'u', '0', '0', digits[c >> 4], digits[c & 0xf]};
+      out->put(esc, sizeof(esc));
+    } else {
+      out->put(c);
+    }
+  }
+  out->put('"');
+  return !out->full();
+}
+
+bool TableFormat::format(Kind kind, const uint8_t *rec, FormatBuf *out) const {
+  // per nesting level: is it an array, has an element been written
+  bool in_array[MAX_DEPTH + 1];
+  bool first[MAX_DEPTH + 1];
+  int depth = 0;
+  bool csv_first = true;
+  in_array[0] = true;
+  first[0] = true;
+
+  for (auto &f : fields_) {
+    bool is_end = f.type == Field::END_STRUCT || f.type == Field::END_ARRAY;
+    if (is_end) {
+      --depth;
+      if (kind != CSV)
+        out->put(f.type == Field::END_STRUCT ? '}' : ']');
+      if (kind == TEXT && depth > 0)
+        out->put(' ');
+      if (out->full())
+        return false;
+      continue;
+    }
+
+    if (kind == CSV) {
+      if (f.type == Field::SCALAR || f.type == Field::STRING) {
+        if (!csv_first)
+          out->put(',');
+        csv_first = false;
+      }
+    } else if (kind == JSON) {
+      if (!first[depth])
+        out->put(", ", 2);
+      first[depth] = false;
+      if (!in_array[depth]) {
+        out->put('"');
+        out->put(f.name);
+        out->put("\": ", 3);
+      }
+    }
+
+    switch (f.type) {
+      case Field::BEGIN_STRUCT:
+      case Field::BEGIN_ARRAY:
+        ++depth;
+        in_array[depth] = f.type == Field::BEGIN_ARRAY;
+        first[depth] = true;
+        if (kind == TEXT)
+          out->put(f.type == Field::BEGIN_STRUCT ? "{ " : "[ ", 2);
+        else if (kind == JSON)
+          out->put(f.type == Field::BEGIN_STRUCT ? '{' : '[');
+        break;
+      case Field::SCALAR:
+        format_scalar(kind, f, rec, out);
+        if (kind == TEXT && depth > 0)
+          out->put(' ');
+        break;
+      case Field::STRING:
+        format_string(kind, f, rec, out);
+        if (kind == TEXT && depth > 0)
+          out->put(' ');
+        break;
+      default:
+        break;
+    }
+    if (out->full())
+      return false;
+  }
+  return !out->full();
+}
+
+bool TableFormat::header(const string &prefix, FormatBuf *out) const {
+  // path and next array index per nesting level
+  vector<string> path({prefix});
+  vector<int> index({-1});
+  bool csv_first = true;
+
+  for (auto &f : fields_) {
+    if (f.type == Field::END_STRUCT || f.type == Field::END_ARRAY) {
+      path.pop_back();
+      index.pop_back();
+      continue;
+    }
+    string name;
+    if (path.size() == 1)
+      name = prefix;
+    else if (index.back() >= 0)
+      name = path.back() + "[" + std::to_string(index.back()++) + "]";
+    else if (path.back().empty())
+      name = f.name;
+    else
+      name = path.back() + "." + f.name;
+
+    if (f.type == Field::BEGIN_STRUCT || f.type == Field::BEGIN_ARRAY) {
+      path.push_back(name);
+      index.push_back(f.type == Field::BEGIN_ARRAY ? 0 : -1);
+      continue;
+    }
+    if (!csv_first)
+      out->put(',');
+    csv_first = false;
+    out->put(name);
+  }
+  return !out->full();
+}
+
+bool TableFormat::scan_scalar(const Field &f, const char **p, uint8_t *rec) const {
+  uint8_t *out = rec + f.offset;
+  if (f.is_float) {
+    char *end;
+    skip_space(p);
+    long double v = strtold(*p, &end);
+    if (end == *p)
+      return false;
+    *p = end;
+    if (f.size == 4) {
+      float x = v;
+      memcpy(out, &x, sizeof(x));
+    } else if (f.size == 8) {
+      double x = v;
+      memcpy(out, &x, sizeof(x));
+    } else {
+      memcpy(out, &v, sizeof(v));
+    }
+    return true;
+  }
+
+  if (f.size == 16) {
+    // only the hex form written by format_scalar
+    skip_space(p);
+    if ((*p)[0] != '0' || ((*p)[1] != 'x' && (*p)[1] != 'X'))
+      return false;
+    *p += 2;
+    uint64_t lo = 0, hi = 0;
+    int n = 0;
+    for (; isxdigit((unsigned char)**p) && n < 32; ++*p, ++n) {
+      char c = tolower(**p);
+      hi = hi << 4 | lo >> 60;
+      lo = lo << 4 | (isdigit(c) ? c - '0' : c - 'a' + 10);
+    }
+    if (!n)
+      return false;
+    memcpy(out, &lo, sizeof(lo));
+    memcpy(out + 8, &hi, sizeof(hi));
+    return true;
+  }
+
+  uint64_t v;
+  if (!scan_int(p, &v))
+    return false;
+  if (f.bit_width) {
+    uint64_t unit = 0;
+    uint64_t mask = (f.bit_width == 64 ? ~0ULL : (1ULL << f.bit_width) - 1) << f.bit_offset;
+    memcpy(&unit, out, f.size);
+    unit = (unit & ~mask) | ((v << f.bit_offset) & mask);
+    memcpy(out, &unit, f.size);
+  } else {
+    memcpy(out, &v, f.size);
+  }
+  return true;
+}
+
+bool TableFormat::scan(const char *in, uint8_t *rec) const {
+  const char *p = in;
+  for (auto &f : fields_) {
+    switch (f.type) {
+      case Field::BEGIN_STRUCT:
+        if (!scan_char(&p, '{'))
+          return false;
+        break;
+      case Field::END_STRUCT:
+        if (!scan_char(&p, '}'))
+          return false;
+        break;
+      case Field::BEGIN_ARRAY:
+        if (!scan_char(&p, '['))
+          return false;
+        break;
+      case Field::END_ARRAY:
+        if (!scan_char(&p, ']'))
+          return false;
+        break;
+      case Field::STRING:
+        if (!scan_char(&p, '['))
+          return false;
+        for (uint32_t i = 0; i < f.size; ++i) {
+          uint64_t v;
+          if (!scan_int(&p, &v))
+            return false;
+          rec[f.offset + i] = v;
+        }
+        if (!scan_char(&p, ']'))
+          return false;
+        break;
+      case Field::SCALAR:
+        if (!scan_scalar(f, &p, rec))
+          return false;
+        break;
+    }
+  }
+  return true;
+}
+
+}  // namespace ebpf
@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2016 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace ebpf {
+
+class FormatBuf;
+
+// Formats binary keys and leaves as described by the key_desc/leaf_desc of a
+// table, without calling into the JIT'd snprintf helpers. The desc is parsed
+// once into a flat plan of fields with their offsets, formatting a record is
+// a walk over that plan.
+class TableFormat {
+ public:
+  enum Kind {
+    TEXT = 0,  // same layout as the snprintf helpers: { 0x1 [ 0x2 0x3 ] }
+    JSON = 1,
+    CSV = 2,
+  };
+
+  // return nullptr if desc can't be parsed or uses an unknown type
+  static std::unique_ptr<TableFormat> create(const std::string &desc);
+
+  // size of one record as computed from desc
+  size_t size() const { return size_; }
+
+  // append one record to out, return false if out is full
+  bool format(Kind kind, const uint8_t *rec, FormatBuf *out) const;
+  // append the comma separated column names, prefixed with prefix
+  bool header(const std::string &prefix, FormatBuf *out) const;
+  // parse one record in the TEXT layout, as the sscanf helpers do
+  bool scan(const char *in, uint8_t *rec) const;
+
+ private:
+  struct Field {
+    enum Type { BEGIN_STRUCT, END_STRUCT, BEGIN_ARRAY, END_ARRAY, SCALAR, STRING } type;
+    std::string name;  // json name, csv column
+    uint32_t offset;
+    uint32_t size;  // bytes, for STRING the array length
+    bool is_signed;
+    bool is_float;
+    uint8_t bit_offset;  // bitfields only
+    uint8_t bit_width;
+  };
+  struct Parser;
+
+  TableFormat() : size_(0) {}
+  bool format_scalar(Kind kind, const Field &f, const uint8_t *rec, FormatBuf *out) const;
+  bool format_string(Kind kind, const Field &f, const uint8_t *rec, FormatBuf *out) const;
+  bool scan_scalar(const Field &f, const char **p, uint8_t *rec) const;
+
+  std::vector<Field> fields_;
+  size_t size_;
+};
+
+// Bounded output buffer, writes past the end are dropped and mark it full
+class FormatBuf {
+ public:
+  FormatBuf(char *buf, size_t len) : buf_(buf), len_(len), pos_(0), full_(len == 0) {}
+  void put(char c) {
+    if (pos_ + 1 < len_)
+      buf_[pos_++] = c;
+    else
+      full_ = true;
+  }
+  void put(const char *s, size_t n);
+  void put(const std::string &s) { put(s.data(), s.size()); }
+  void put_dec(uint64_t v, bool neg);
+  void put_hex(uint64_t v);
+  size_t pos() const { return pos_; }
+  // drop everything after pos, used to undo a partially written record
+  void truncate(size_t pos) { pos_ = pos; full_ = false; }
+  void terminate() { if (len_) buf_[pos_] = '\0'; }
+  bool full() const { return full_; }
+ private:
+  char *buf_;
+  size_t len_;
+  size_t pos_;
+  bool full_;
+};
+
+}  // namespace ebpf
@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2016 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "verifier_log.h"
+
+namespace ebpf {
+
+using std::map;
+using std::string;
+using std::to_string;
+
+static string json_str(const string &s) {
+  string out = "\"";
+  for (char c : s) {
+    if (c == '"' || c == '\\') {
+      out += '\\';
+      out += c;
+    } else if ((unsigned char)c < 0x20) {
+      char buf[8];
+      snprintf(buf, sizeof(buf), "\\u%04x", c);
+      out += buf;
+    } else {
+      out += c;
+    }
+  }
+  return out + "\"";
+}
+
+// the value following key in line, e.g. "total_states 12"
+static unsigned summary_field(const char *line, const char *key) {
+  const char *p = strstr(line, key);
+  unsigned v = 0;
+  if (p)
+    sscanf(p + strlen(key), " %u", &v);
+  return v;
+}
+
+// Lines of log_level 1, oldest to newest kernels:
+//   "12: (bf) r1 = r6"                   instruction
+//   "from 8 to 11: R0=imm0 R10=fp"       state at a branch target
+//   "from 8 to 11: safe"                 pruned
+//   "11: R0=inv R10=fp"                  state (log_level 2)
+//   " R0=inv R10=fp"                     state after the previous instruction
+//   "; if (x > 5)"                       source of the next instruction
+//   "processed 13 insns (limit ...) ... total_states 2 peak_states 2 ..."
+// anything else after the last instruction is the reason of the rejection,
+// the summary is only printed for accepted programs
+VerifierLog VerifierLog::parse(const string &log) {
+  VerifierLog v;
+  string source;
+  bool done = false;
+  size_t pos = 0;
+  while (pos < log.size()) {
+    size_t end = log.find('\n', pos);
+    if (end == string::npos)
+      end = log.size();
+    string line = log.substr(pos, end - pos);
+    pos = end + 1;
+    if (line.empty() || done)
+      continue;
+
+    const char *s = line.c_str();
+    unsigned from, to, idx, code;
+    int n = -1;
+    if (s[0] == ';') {
+      size_t start = line.find_first_not_of("; ");
+      source = start == string::npos ? "" : line.substr(start);
+    } else if (sscanf(s, "from %u to %u: %n", &from, &to, &n) == 2 && n > 0) {
+      Insn &insn = v.insns[to];
+      ++insn.states;
+      if (!strcmp(s + n, "safe"))
+        ++insn.pruned;
+      else
+        insn.regs = s + n;
+    } else if (sscanf(s, "%u: (%x) %n", &idx, &code, &n) == 2 && n > 0) {
+      Insn &insn = v.insns[idx];
+      ++insn.visits;
+      insn.text = s + n;
+      if (!source.empty()) {
+        insn.source = source;
+        source.clear();
+      }
+      v.last_insn = idx;
+      v.error.clear();
+    } else if (sscanf(s, "%u: %n", &idx, &n) == 1 && n > 0 && (s[n] == 'R' || !strcmp(s + n, "safe"))) {
+      Insn &insn = v.insns[idx];
+      if (s[n] == 'R')
+        insn.regs = s + n;
+    } else if (sscanf(s, " R%u=%n", &idx, &n) == 1 && n > 0) {
+      if (v.last_insn >= 0)
+        v.insns[v.last_insn].regs = line.substr(line.find('R'));
+    } else if (!strncmp(s, "processed ", 10)) {
+      sscanf(s, "processed %u", &v.processed);
+      v.total_states = summary_field(s, "total_states");
+      v.peak_states = summary_field(s, "peak_states");
+      // only timing and stack depth follow
+      done = true;
+    } else {
+      if (!v.error.empty())
+        v.error += "\n";
+      v.error += line;
+    }
+  }
+  return v;
+}
+
+string VerifierLog::json(const map<unsigned, string> *listing) const {
+  string s = "{\"processed\": " + to_string(processed);
+  s += ", \"total_states\": " + to_string(total_states) + ", \"peak_states\": " + to_string(peak_states);
+  s += ", \"last_insn\": " + to_string(last_insn) + ", \"error\": " + json_str(error);
+  s += ", \"insns\": [";
+  bool first = true;
+  for (auto &it : insns) {
+    const Insn &insn = it.second;
+    string text = insn.text;
+    if (listing) {
+      auto l = listing->find(it.first);
+      if (l != listing->end())
+        text = l->second;
+    }
+    if (!first)
+      s += ", ";
+    first = false;
+    s += "{\"insn\": " + to_string(it.first) + ", \"visits\": " + to_string(insn.visits);
+    s += ", \"states\": " + to_string(insn.states) + ", \"pruned\": " + to_string(insn.pruned);
+    s += ", \"text\": " + json_str(text) + ", \"source\": " + json_str(insn.source);
+    s += ", \"regs\": " + json_str(insn.regs) + "}";
+  }
+  s += "]}";
+  return s;
+}
+
+}  // namespace ebpf
@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2016 PLUMgrid, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <map>
+#include <string>
+
+namespace ebpf {
+
+// The verifier log of a program load (log_level 1 or 2) broken down per
+// instruction: how often the verifier walked each one, how many register
+// states it reached it with, and why the program was rejected.
+class VerifierLog {
+ public:
+  struct Insn {
+    unsigned visits;  // times the verifier processed the instruction
+    unsigned states;  // register states it branched to it with
+    unsigned pruned;  // of those, found equivalent to a verified state
+    std::string text;  // as printed by the verifier
+    std::string source;  // "; line" annotation of kernels with BTF
+    std::string regs;  // last register state seen at the instruction
+  };
+
+  static VerifierLog parse(const std::string &log);
+
+  std::map<unsigned, Insn> insns;
+  unsigned processed;  // the verifier's own total, 0 if not printed
+  unsigned total_states;  // from the summary of newer kernels
+  unsigned peak_states;
+  int last_insn;  // last instruction processed, -1 if none
+  std::string error;  // lines after the last instruction, empty if accepted
+
+  // {"processed": n, "total_states": n, "peak_states": n, "last_insn": n,
+  //  "error": s, "insns": [{"insn": n, "visits": n, "states": n, "pruned": n,
+  //  "text": s, "source": s, "regs": s}, ...]}
+  // listing, if given, replaces the verifier's text of each instruction
+  std::string json(const std::map<unsigned, std::string> *listing = nullptr) const;
+
+ private:
+  VerifierLog() : processed(0), total_states(0), peak_states(0), last_insn(-1) {}
+};
+
+}  // namespace ebpf
@@ -18,7 +18,9 @@
 #ifndef LIBBPF_H
 #define LIBBPF_H
 
+#include <limits.h>
 #include <linux/bpf.h>
+#include <stddef.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -31,10 +33,76 @@ int bpf_lookup_elem(int fd, void *key, void *value);
 int bpf_delete_elem(int fd, void *key);
 int bpf_get_next_key(int fd, void *key, void *next_key);
 
+/* Get the first key of the map, without a key known not to be in it.
+ * Returns 0, or -1 with errno ENOENT if the map is empty. */
+int bpf_get_first_key(int fd, void *key, size_t key_size);
+/* The number of entries in the map, walked in a single call, or -1 */
+int bpf_count_elems(int fd, size_t key_size);
+
+/* Walk the map from the entry after start_key (any key not in the map, or
+ * NULL, starts from the first one) and fill the contiguous arrays keys and, unless
+ * it is NULL, values with up to max entries. Entries deleted during the walk
+ * are skipped. Returns the number of entries, or -1 with errno set. */
+int bpf_lookup_batch(int fd, void *start_key, void *keys, void *values,
+                     size_t key_size, size_t value_size, unsigned max);
+/* Update the n entries keys[i] to values[i], stopping at the first failure.
+ * Returns n, or -1 with errno set. */
+int bpf_update_batch(int fd, void *keys, void *values, size_t key_size,
+                     size_t value_size, unsigned n, unsigned long long flags);
+/* Delete the n entries in keys, ignoring those already gone. Returns the
+ * number deleted, or -1 with errno set. */
+int bpf_delete_batch(int fd, void *keys, size_t key_size, unsigned n);
+
+/* The number of possible cpus, for which per-cpu maps hold a value each */
+int bpf_num_possible_cpus(void);
+
+/* bpf_percpu_reduce() operations */
+#define BPF_REDUCE_SUM 0
+#define BPF_REDUCE_MIN 1
+#define BPF_REDUCE_MAX 2
+#define BPF_REDUCE_AVG 3
+/* kinds of the fields reduced */
+#define BPF_FIELD_UNSIGNED 0
+#define BPF_FIELD_SIGNED 1
+#define BPF_FIELD_FLOAT 2
+
+/* Combine the values of the n entries of a per-cpu map, as the kernel copies
+ * them (ncpus leaves of leaf_size bytes, each padded to 8 bytes), into n
+ * packed leaves at out. The nfields fields at offsets[i] of sizes[i] bytes
+ * (1, 2, 4 or 8) and kinds[i] are combined with op, the rest of each leaf
+ * is that of the first cpu. Returns 0, or -1 with errno set. */
+int bpf_percpu_reduce(const void *values, void *out, unsigned n, unsigned ncpus,
+                      size_t leaf_size, const unsigned *offsets, const unsigned *sizes,
+                      const int *kinds, unsigned nfields, int op);
+
+/* Rewrite the map fds referenced by BPF_PSEUDO_MAP_FD loads in insns from
+ * old_fds[i] to new_fds[i], in a single pass. */
+void bpf_relocate_map_fds(struct bpf_insn *insns, int insn_cnt,
+                          const int *old_fds, const int *new_fds, int nfds);
+
+/* src_reg of the ld_imm64 placeholders emitted for BPF_CONST() references,
+ * unused by the kernel so that an unbound program fails to load */
+#define BPF_PSEUDO_CONST 0xf
+
+/* Hash of a BPF_CONST() name, the imm of its placeholders */
+unsigned bpf_const_hash(const char *name);
+/* Replace the placeholders of the constants names[i] in insns by values[i].
+ * Returns the number of placeholders left unbound, or -1 if out of memory. */
+int bpf_bind_consts(struct bpf_insn *insns, int insn_cnt, const char *names[],
+                    const unsigned long long *values, int n);
+
 int bpf_prog_load(enum bpf_prog_type prog_type,
 		  const struct bpf_insn *insns, int insn_len,
 		  const char *license, unsigned kern_version,
 		  char *log_buf, unsigned log_buf_size);
+/* Same with the verifier log at log_level (0 for none), and nothing printed
+ * on failure. errno is ENOSPC if the log did not fit. Kernels before 5.2
+ * reject log buffers larger than BPF_LOG_BUF_MAX with EINVAL. */
+#define BPF_LOG_BUF_MAX (UINT_MAX >> 8)
+int bpf_prog_load_level(enum bpf_prog_type prog_type,
+                        const struct bpf_insn *insns, int prog_len,
+                        const char *license, unsigned kern_version,
+                        unsigned log_level, char *log_buf, unsigned log_buf_size);
 int bpf_attach_socket(int sockfd, int progfd);
 
 /* create RAW socket and bind to interface 'name' */
@@ -114,12 +114,16 @@ function Bpf:initialize(args)
   self.do_debug = args.debug or false
   self.funcs = {}
   self.tables = {}
+  -- values of the BPF_CONST()s, bound in load_func
+  self.consts = args.consts or {}
 
   local cflags = table.join(Bpf.DEFAULT_CFLAGS, args.cflags)
   local cflags_ary = ffi.new("const char *[?]", #cflags, cflags)
 
   local llvm_debug = args.debug or 0
   assert(type(llvm_debug) == "number")
+  -- optimization profile, one of the BPF_MODULE_OPT_* flags
+  llvm_debug = llvm_debug + (args.opt or 0)
 
   if args.text then
     log.info("\n%s\n", args.text)
@@ -157,12 +161,25 @@ function Bpf:load_func(fn_name, prog_type)
     return self.funcs[fn_name]
   end
 
-  assert(libbcc.bpf_function_start(self.module, fn_name) ~= nil,
-    "unknown program: "..fn_name)
+  local start = libbcc.bpf_function_start(self.module, fn_name)
+  assert(start ~= nil, "unknown program: "..fn_name)
+  local size = tonumber(libbcc.bpf_function_size(self.module, fn_name))
+
+  -- bind the constants in a copy, the module keeps the placeholders
+  local insns = ffi.new("uint8_t[?]", size)
+  ffi.copy(insns, start, size)
+  local names, values = {}, {}
+  for k, v in pairs(self.consts) do
+    table.insert(names, k)
+    table.insert(values, v)
+  end
+  local unbound = libbcc.bpf_bind_consts(ffi.cast("struct bpf_insn *", insns), size / 8,
+    ffi.new("const char *[?]", #names, names),
+    ffi.new("unsigned long long[?]", #values, values), #names)
+  assert(unbound == 0, "constants without a value in BPF program "..fn_name)
 
   local fd = libbcc.bpf_prog_load(prog_type,
-    libbcc.bpf_function_start(self.module, fn_name),
-    libbcc.bpf_function_size(self.module, fn_name),
+    ffi.cast("struct bpf_insn *", insns), size,
     libbcc.bpf_module_license(self.module),
     libbcc.bpf_module_kern_version(self.module), nil, 0)
 
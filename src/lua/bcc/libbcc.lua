@@ -29,9 +29,22 @@ int bpf_update_elem(int fd, void *key, void *value, unsigned long long flags);
 int bpf_lookup_elem(int fd, void *key, void *value);
 int bpf_delete_elem(int fd, void *key);
 int bpf_get_next_key(int fd, void *key, void *next_key);
+int bpf_get_first_key(int fd, void *key, size_t key_size);
+int bpf_count_elems(int fd, size_t key_size);
+int bpf_lookup_batch(int fd, void *start_key, void *keys, void *values,
+  size_t key_size, size_t value_size, unsigned max);
+int bpf_update_batch(int fd, void *keys, void *values, size_t key_size,
+  size_t value_size, unsigned n, unsigned long long flags);
+int bpf_delete_batch(int fd, void *keys, size_t key_size, unsigned n);
+
+unsigned bpf_const_hash(const char *name);
+int bpf_bind_consts(struct bpf_insn *insns, int insn_cnt, const char *names[],
+  const unsigned long long *values, int n);
 
 int bpf_prog_load(enum bpf_prog_type prog_type, const struct bpf_insn *insns, int insn_len,
   const char *license, unsigned kern_version, char *log_buf, unsigned log_buf_size);
+int bpf_prog_load_level(enum bpf_prog_type prog_type, const struct bpf_insn *insns, int prog_len,
+  const char *license, unsigned kern_version, unsigned log_level, char *log_buf, unsigned log_buf_size);
 int bpf_attach_socket(int sockfd, int progfd);
 
 /* create RAW socket and bind to interface 'name' */
@@ -55,15 +68,35 @@ ffi.cdef[[
 void * bpf_module_create_b(const char *filename, const char *proto_filename, unsigned flags);
 void * bpf_module_create_c(const char *filename, unsigned flags, const char *cflags[], int ncflags);
 void * bpf_module_create_c_from_string(const char *text, unsigned flags, const char *cflags[], int ncflags);
+int bpf_module_create_c_batch(const char *texts[], size_t n, unsigned flags,
+  const char *cflags[], int ncflags, void *modules[], unsigned nthreads);
 void bpf_module_destroy(void *program);
+int bpf_build_type_db(const char *path, const char *headers[], int nheaders,
+  const char *types[], int ntypes);
+int bpf_build_header_archive(const char *path);
+int bpf_module_compact(void *program);
+int bpf_module_instantiate(void *program);
+int bpf_module_instantiate_from(void *program, void *prev);
+int bpf_module_take_exports(void *program, void *prev);
+size_t bpf_module_skipped_map_bytes(void *program);
+int bpf_module_write_object(void *program, const char *path);
 char * bpf_module_license(void *program);
 unsigned bpf_module_kern_version(void *program);
+const char * bpf_module_compile_stats(void *program);
+size_t bpf_module_cache_hits(void);
+size_t bpf_module_cache_misses(void);
 size_t bpf_num_functions(void *program);
 const char * bpf_function_name(void *program, size_t id);
 void * bpf_function_start_id(void *program, size_t id);
 void * bpf_function_start(void *program, const char *name);
 size_t bpf_function_size_id(void *program, size_t id);
 size_t bpf_function_size(void *program, const char *name);
+const char * bpf_function_disasm(void *program, const char *name);
+const char * bpf_function_cost(void *program, const char *name);
+const char * bpf_function_verifier_report(void *program, const char *name, const char *log);
+int bpf_function_load_batch(void *program, const char *names[], size_t n, int prog_type,
+  const char *const_names[], const unsigned long long *const_values, int nconsts,
+  unsigned log_level, unsigned nthreads, int fds[], const char *logs[]);
 size_t bpf_num_tables(void *program);
 size_t bpf_table_id(void *program, const char *table_name);
 int bpf_table_fd(void *program, const char *table_name);
@@ -85,6 +118,8 @@ int bpf_table_key_snprintf(void *program, size_t id, char *buf, size_t buflen, c
 int bpf_table_leaf_snprintf(void *program, size_t id, char *buf, size_t buflen, const void *leaf);
 int bpf_table_key_sscanf(void *program, size_t id, const char *buf, void *key);
 int bpf_table_leaf_sscanf(void *program, size_t id, const char *buf, void *leaf);
+int bpf_table_format(void *program, size_t id, int format, const void *keys, const void *leaves,
+                     size_t count, char *buf, size_t buflen);
 ]]
 
 ffi.cdef[[
@@ -95,27 +95,30 @@ function BaseTable:set(key, value)
   assert(libbcc.bpf_update_elem(self.map_fd, pkey, pvalue, 0) == 0, "could not update table")
 end
 
-function BaseTable:_empty_key()
-  local pkey = self.c_key()
-  local pvalue = self.c_leaf()
-
-  for _, v in ipairs({0x0, 0x55, 0xff}) do
-    ffi.fill(pkey, ffi.sizeof(pkey[0]), v)
-    if libbcc.bpf_lookup_elem(self.map_fd, pkey, pvalue) < 0 then
-      return pkey
-    end
+function BaseTable:_next_key(pkey)
+  -- the first key when pkey is nil
+  local pkey_next = self.c_key()
+  local res
+
+  if pkey == nil then
+    res = libbcc.bpf_get_first_key(self.map_fd, pkey_next, ffi.sizeof(pkey_next))
+  else
+    res = libbcc.bpf_get_next_key(self.map_fd, pkey, pkey_next)
   end
 
-  error("failed to find an empty key for table iteration")
+  if res < 0 then
+    return nil
+  end
+  return pkey_next
 end
 
 function BaseTable:keys()
-  local pkey = self:_empty_key()
+  local pkey = nil
 
   return function()
-    local pkey_next = self.c_key()
+    local pkey_next = self:_next_key(pkey)
 
-    if libbcc.bpf_get_next_key(self.map_fd, pkey, pkey_next) < 0 then
+    if pkey_next == nil then
       return nil
     end
 
@@ -125,13 +128,13 @@ function BaseTable:keys()
 end
 
 function BaseTable:items()
-  local pkey = self:_empty_key()
+  local pkey = nil
 
   return function()
-    local pkey_next = self.c_key()
+    local pkey_next = self:_next_key(pkey)
     local pvalue = self.c_leaf()
 
-    if libbcc.bpf_get_next_key(self.map_fd, pkey, pkey_next) < 0 then
+    if pkey_next == nil then
       return nil
     end
 
@@ -155,8 +158,8 @@ function HashTable:delete(key)
 end
 
 function HashTable:size()
-  local n = 0
-  self:each(function() n = n + 1 end)
+  local n = libbcc.bpf_count_elems(self.map_fd, ffi.sizeof(self.c_key))
+  assert(n >= 0, "could not count table entries")
   return n
 end
 
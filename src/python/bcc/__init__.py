@@ -15,6 +15,7 @@
 from __future__ import print_function
 import atexit
 import ctypes as ct
+import errno
 import fcntl
 import json
 import multiprocessing
@@ -40,10 +41,19 @@ ksyms = []
 ksym_names = {}
 ksym_loaded = 0
 _kprobe_limit = 1000
+# keep in sync with BPF_LOG_BUF_MAX in libbpf.h; older kernels reject more
+BPF_LOG_BUF_MAX = (1 << 32) - 1 >> 8
 
 DEBUG_LLVM_IR = 0x1
 DEBUG_BPF = 0x2
 DEBUG_PREPROCESSOR = 0x4
+DEBUG_PASS_TIMING = 0x400
+
+OPT_DEFAULT = 0
+OPT_FAST = 0x100
+OPT_SIZE = 0x200
+_COMPILE_ONLY = 0x1000
+_KERNEL_TYPES = 0x2000
 
 @atexit.register
 def cleanup_kprobes():
@@ -68,6 +78,21 @@ def _check_probe_quota(num_new_probes):
         raise Exception("Number of open probes would exceed quota")
 
 
+class VerifierError(Exception):
+    """The kernel rejected a function. log is the verifier log and report
+    the same broken down per instruction, see BPF.verifier_report()."""
+    def __init__(self, func_name, log, report):
+        msg = "Failed to load BPF program %s" % func_name
+        if report["error"]:
+            msg += ": %s" % report["error"].splitlines()[-1]
+        if report["last_insn"] >= 0:
+            msg += " (at insn %d)" % report["last_insn"]
+        super(VerifierError, self).__init__(msg)
+        self.func_name = func_name
+        self.log = log
+        self.report = report
+
+
 class BPF(object):
     SOCKET_FILTER = 1
     KPROBE = 2
@@ -124,7 +149,9 @@ class BPF(object):
                     raise Exception("Could not find file %s" % filename)
         return filename
 
-    def __init__(self, src_file="", hdr_file="", text=None, cb=None, debug=0, cflags=[]):
+    def __init__(self, src_file="", hdr_file="", text=None, cb=None, debug=0, cflags=[],
+            opt=OPT_DEFAULT, compile_only=False, consts=None,
+            kernel_types=False):
         """Create a a new BPF module with the given source code.
 
         Note:
@@ -139,75 +166,408 @@ class BPF(object):
                 DEBUG_LLVM_IR: print LLVM IR to stderr
                 DEBUG_BPF: print BPF bytecode to stderr
                 DEBUG_PREPROCESSOR: print Preprocessed C file to stderr
+                DEBUG_PASS_TIMING: print LLVM's per pass timing of the BPF
+                    program to stderr
+            opt (Optional[int]): Optimization profile of the BPF program
+                OPT_DEFAULT: -O3
+                OPT_FAST: -O1, compiles faster, for one-off tools
+                OPT_SIZE: -Oz, smallest bytecode, for programs close to the
+                    verifier limits
+            compile_only (Optional[bool]): Only compile, the maps are created
+                by instantiate(). Does not need privileges, e.g. to fill the
+                compile cache or to dump_object().
+            consts (Optional[dict]): Values of the BPF_CONST()s of the
+                program, by name. They are bound when the functions are
+                loaded and don't change the compiled module.
+            kernel_types (Optional[bool]): Compile against the type database
+                of the running kernel, see build_type_db(), instead of its
+                headers. This is the default if the headers are missing.
         """
 
-        self._reader_cb_impl = _CB_TYPE(BPF._reader_cb)
-        self._user_cb = cb
-        self.debug = debug
-        self.funcs = {}
-        self.tables = {}
+        flags = debug | opt
+        if compile_only:
+            flags |= _COMPILE_ONLY
+        if kernel_types:
+            flags |= _KERNEL_TYPES
+        module = BPF._create_module(src_file, hdr_file, text, flags, cflags)
+        self._init_module(module, debug, cb, not compile_only, consts)
+        self._kernel_types = flags & _KERNEL_TYPES
+
+    @staticmethod
+    def build_type_db(path=None, headers=[], types=[]):
+        """build_type_db(path=None, headers=[], types=[])
+
+        Extract the layouts of the kernel types that tools use from the
+        headers of the running kernel, so that programs can later be
+        compiled without them (kernel_types=True). headers and types are
+        added to the default sets. The database is stored in the compile
+        cache for this kernel release, or at path, e.g. to be copied to
+        hosts without the headers and used there with $BCC_TYPE_DB.
+        """
+        headers_array = (ct.c_char_p * len(headers))()
+        for i, s in enumerate(headers): headers_array[i] = s.encode("ascii")
+        types_array = (ct.c_char_p * len(types))()
+        for i, s in enumerate(types): types_array[i] = s.encode("ascii")
+        if lib.bpf_build_type_db(path.encode("ascii") if path else None,
+                headers_array, len(headers), types_array, len(types)) < 0:
+            raise Exception("Failed to build the kernel type database")
+
+    @staticmethod
+    def build_header_archive(path=None):
+        """build_header_archive(path=None)
+
+        Snapshot the headers of the running kernel into one indexed file
+        that the compiler maps instead of opening and stat'ing each header.
+        Without a path, the archive is stored in the compile cache, which is
+        also done on the first compile. With a path, e.g. to be copied to
+        hosts of the same kernel, it is used from $BCC_HEADER_ARCHIVE.
+        """
+        if lib.bpf_build_header_archive(path.encode("ascii") if path else None) < 0:
+            raise Exception("Failed to build the kernel header archive")
+
+    @staticmethod
+    def _create_module(src_file, hdr_file, text, flags, cflags):
         cflags_array = (ct.c_char_p * len(cflags))()
         for i, s in enumerate(cflags): cflags_array[i] = s.encode("ascii")
         if text:
-            self.module = lib.bpf_module_create_c_from_string(text.encode("ascii"),
-                    self.debug, cflags_array, len(cflags_array))
+            module = lib.bpf_module_create_c_from_string(text.encode("ascii"),
+                    flags, cflags_array, len(cflags_array))
         else:
             src_file = BPF._find_file(src_file)
             hdr_file = BPF._find_file(hdr_file)
             if src_file.endswith(".b"):
-                self.module = lib.bpf_module_create_b(src_file.encode("ascii"),
-                        hdr_file.encode("ascii"), self.debug)
+                module = lib.bpf_module_create_b(src_file.encode("ascii"),
+                        hdr_file.encode("ascii"), flags)
             else:
-                self.module = lib.bpf_module_create_c(src_file.encode("ascii"),
-                        self.debug, cflags_array, len(cflags_array))
+                module = lib.bpf_module_create_c(src_file.encode("ascii"),
+                        flags, cflags_array, len(cflags_array))
 
-        if self.module == None:
+        if module == None:
             raise Exception("Failed to compile BPF module %s" % src_file)
+        return module
+
+    def _init_module(self, module, debug, cb, autoload=True, consts=None):
+        self._reader_cb_impl = _CB_TYPE(BPF._reader_cb)
+        self._user_cb = cb
+        self.debug = debug
+        self.consts = dict(consts or {})
+        self._kernel_types = 0
+        self.funcs = {}
+        self.tables = {}
+        # ev_name -> (probe type, fn_name, desc, pid, cpu, group_fd), to move
+        # the probes attached by this module in reload()
+        self._probes = {}
+        self.module = module
 
         # If any "kprobe__" prefixed functions were defined, they will be
         # loaded and attached here.
+        if autoload:
+            self._trace_autoload()
+
+    def instantiate(self):
+        """instantiate()
+
+        Create the maps of a module built with compile_only=True, then
+        attach the kprobe__ functions as the constructor does otherwise.
+        """
+        if lib.bpf_module_instantiate(self.module) < 0:
+            raise Exception("Failed to create the maps of the BPF module")
+        # tables looked up before have no fd
+        self.tables = {}
         self._trace_autoload()
 
-    def load_funcs(self, prog_type=KPROBE):
-        """load_funcs(prog_type=KPROBE)
+    def reload(self, src_file="", hdr_file="", text=None, cflags=[],
+            opt=OPT_DEFAULT):
+        """reload(src_file="", hdr_file="", text=None, cflags=[], opt=OPT_DEFAULT)
 
-        Load all functions in this BPF module with the given type.
-        Returns a list of the function handles."""
+        Replace the functions of this module by the ones compiled from the
+        new source, keeping the maps and their contents. Tables of the same
+        name must have the same type, size and key/leaf types. The kprobes
+        and uprobes attached so far move to the new functions of the same
+        name. Nothing changes if compiling or loading fails. If attaching
+        fails, the probes moved so far go back to the old functions.
 
-        fns = []
-        for i in range(0, lib.bpf_num_functions(self.module)):
-            func_name = lib.bpf_function_name(self.module, i).decode()
-            fns.append(self.load_func(func_name, prog_type))
+        Each probe is detached right before the new function is attached to
+        it, events hitting that window are not counted.
 
-        return fns
+        Only functions attached to kprobes or uprobes can be moved. If any
+        other function was loaded (e.g. a tail call target in a prog array,
+        a socket filter or a tracepoint), nothing is done and an exception
+        is raised, since the new module could not take its place.
+        """
+        probes = [(ev_name, p) for ev_name, p in self._probes.items()
+                if ev_name in (open_kprobes if p[0] == "kprobe" else open_uprobes)]
+        others = set(self.funcs) - set(p[1] for ev_name, p in probes)
+        if others:
+            raise Exception("Cannot reload %s, only kprobe and uprobe "
+                    "functions can be reloaded" % ", ".join(sorted(others)))
+
+        module = BPF._create_module(src_file, hdr_file, text,
+                self.debug | opt | _COMPILE_ONLY | self._kernel_types, cflags)
+        if lib.bpf_module_instantiate_from(module, self.module) < 0:
+            lib.bpf_module_destroy(module)
+            raise Exception("Failed to reuse the maps of the BPF module")
+
+        old_module, old_funcs = self.module, self.funcs
+        self.module, self.funcs = module, {}
+        try:
+            for ev_name, p in probes:
+                self.load_func(p[1], BPF.KPROBE)
+        except:
+            for fn in self.funcs.values():
+                os.close(fn.fd)
+            self.module, self.funcs = old_module, old_funcs
+            lib.bpf_module_destroy(module)
+            raise
+
+        def move(probe, funcs):
+            ev_name, (kind, fn_name, desc, pid, cpu, group_fd) = probe
+            probes_dict = open_kprobes if kind == "kprobe" else open_uprobes
+            if kind == "kprobe":
+                detach, attach = lib.bpf_detach_kprobe, lib.bpf_attach_kprobe
+            else:
+                detach, attach = lib.bpf_detach_uprobe, lib.bpf_attach_uprobe
+            if ev_name in probes_dict:
+                lib.perf_reader_free(probes_dict[ev_name])
+                del probes_dict[ev_name]
+                detach(("-:%ss/%s" % (kind, ev_name)).encode("ascii"))
+            res = attach(funcs[fn_name].fd, ev_name.encode("ascii"),
+                    desc.encode("ascii"), pid, cpu, group_fd,
+                    self._reader_cb_impl, ct.cast(id(self), ct.py_object))
+            res = ct.cast(res, ct.c_void_p)
+            if res == None:
+                return False
+            probes_dict[ev_name] = res
+            return True
+
+        for i, probe in enumerate(probes):
+            if move(probe, self.funcs):
+                continue
+            # put the old functions back on the probes moved so far
+            for moved in probes[:i + 1]:
+                move(moved, old_funcs)
+            for fn in self.funcs.values():
+                os.close(fn.fd)
+            self.module, self.funcs = old_module, old_funcs
+            lib.bpf_module_destroy(module)
+            raise Exception("Failed to attach BPF to %s %s" % (probe[1][0], probe[0]))
+
+        lib.bpf_module_take_exports(module, old_module)
+        for fn in old_funcs.values():
+            os.close(fn.fd)
+        # the tables looked up so far still point at the same maps
+        for name, table in list(self.tables.items()):
+            if lib.bpf_table_fd(module, name.encode("ascii")) != table.map_fd:
+                del self.tables[name]
+            else:
+                table.map_id = lib.bpf_table_id(module, name.encode("ascii"))
+        lib.bpf_module_destroy(old_module)
 
-    def load_func(self, func_name, prog_type):
-        if func_name in self.funcs:
-            return self.funcs[func_name]
+    @classmethod
+    def compile_batch(cls, texts, debug=0, cflags=[], opt=OPT_DEFAULT, nthreads=0):
+        """compile_batch(texts, debug=0, cflags=[], opt=OPT_DEFAULT, nthreads=0)
 
-        if lib.bpf_function_start(self.module, func_name.encode("ascii")) == None:
-            raise Exception("Unknown program %s" % func_name)
+        Compile several programs concurrently, using up to nthreads threads
+        (default: one per cpu). Returns a list with a BPF object for each of
+        the texts. Raises if any of them fails to compile, after releasing
+        the others.
+        """
+        texts_array = (ct.c_char_p * len(texts))()
+        for i, t in enumerate(texts): texts_array[i] = t.encode("ascii")
+        cflags_array = (ct.c_char_p * len(cflags))()
+        for i, s in enumerate(cflags): cflags_array[i] = s.encode("ascii")
+        modules = (ct.c_void_p * len(texts))()
+        failed = lib.bpf_module_create_c_batch(texts_array, len(texts),
+                debug | opt, cflags_array, len(cflags_array), modules, nthreads)
+        if failed:
+            for m in modules:
+                if m: lib.bpf_module_destroy(m)
+            raise Exception("Failed to compile %d of %d BPF modules" %
+                    (failed, len(texts)))
+        bpfs = []
+        for m in modules:
+            b = cls.__new__(cls)
+            b._init_module(m, debug, None)
+            bpfs.append(b)
+        return bpfs
+
+    def load_funcs(self, prog_type=KPROBE, parallel=False):
+        """load_funcs(prog_type=KPROBE, parallel=False)
 
-        log_buf = ct.create_string_buffer(65536) if self.debug else None
+        Load all functions in this BPF module with the given type.
+        Returns a list of the function handles. With parallel, they are
+        loaded from one thread per cpu, so that the kernel verifies them
+        concurrently."""
+
+        func_names = [lib.bpf_function_name(self.module, i).decode()
+                for i in range(0, lib.bpf_num_functions(self.module))]
+        if parallel:
+            self._load_batch(func_names, prog_type)
+        return [self.load_func(func_name, prog_type) for func_name in func_names]
+
+    def _load_batch(self, func_names, prog_type):
+        """Load the functions that are not loaded yet concurrently, with the
+        consts given to the constructor. Raises VerifierError for the first
+        one that is rejected, after keeping the others."""
+        func_names = [f for f in func_names if f not in self.funcs]
+        if not func_names:
+            return
+        n = len(func_names)
+        names = (ct.c_char_p * n)()
+        for i, f in enumerate(func_names): names[i] = f.encode("ascii")
+        const_names = (ct.c_char_p * len(self.consts))()
+        const_values = (ct.c_ulonglong * len(self.consts))()
+        for i, (k, v) in enumerate(self.consts.items()):
+            const_names[i] = k.encode("ascii")
+            const_values[i] = v & 0xffffffffffffffff
+        fds = (ct.c_int * n)()
+        logs = (ct.c_char_p * n)()
+        lib.bpf_function_load_batch(self.module, names, n, prog_type,
+                const_names, const_values, len(self.consts),
+                1 if self.debug & DEBUG_BPF else 0, 0, fds, logs)
+
+        error = None
+        for i, func_name in enumerate(func_names):
+            log = logs[i].decode() if logs[i] else ""
+            if self.debug & DEBUG_BPF:
+                print(log, file=sys.stderr)
+            if fds[i] >= 0:
+                self.funcs[func_name] = BPF.Function(self, func_name, fds[i])
+            elif not error:
+                error = VerifierError(func_name, log,
+                        self._verifier_report(func_name, log))
+        if error:
+            raise error
+
+    def load_func(self, func_name, prog_type, consts=None):
+        """load_func(func_name, prog_type, consts=None)
+
+        Load the function into the kernel. The BPF_CONST()s it uses are
+        bound to the values in consts, or else in the consts given to the
+        constructor. Loading it again with other consts gives a new program.
+        """
+        values = dict(self.consts)
+        if consts:
+            values.update(consts)
+            key = (func_name, tuple(sorted(consts.items())))
+        else:
+            key = func_name
+        if key in self.funcs:
+            return self.funcs[key]
 
-        fd = lib.bpf_prog_load(prog_type,
-                lib.bpf_function_start(self.module, func_name.encode("ascii")),
-                lib.bpf_function_size(self.module, func_name.encode("ascii")),
-                lib.bpf_module_license(self.module),
-                lib.bpf_module_kern_version(self.module),
-                log_buf, ct.sizeof(log_buf) if log_buf else 0)
+        insns, size = self._bound_insns(func_name, values)
+        fd, log = self._prog_load(prog_type, insns, size,
+                1 if self.debug & DEBUG_BPF else 0)
 
         if self.debug & DEBUG_BPF:
-            print(log_buf.value.decode(), file=sys.stderr)
+            print(log, file=sys.stderr)
 
         if fd < 0:
-            raise Exception("Failed to load BPF program %s" % func_name)
+            if not log:
+                fd, log = self._prog_load(prog_type, insns, size, 1)
+                # only the log was wanted, keep no program if it loaded
+                if fd >= 0:
+                    os.close(fd)
+            raise VerifierError(func_name, log,
+                    self._verifier_report(func_name, log))
 
         fn = BPF.Function(self, func_name, fd)
-        self.funcs[func_name] = fn
+        self.funcs[key] = fn
 
         return fn
 
+    def _bound_insns(self, func_name, values):
+        start = lib.bpf_function_start(self.module, func_name.encode("ascii"))
+        if start == None:
+            raise Exception("Unknown program %s" % func_name)
+        size = lib.bpf_function_size(self.module, func_name.encode("ascii"))
+
+        # bind the constants in a copy, the module keeps the placeholders
+        insns = ct.create_string_buffer(ct.string_at(start, size), size)
+        names = (ct.c_char_p * len(values))()
+        vals = (ct.c_ulonglong * len(values))()
+        for i, (k, v) in enumerate(values.items()):
+            names[i] = k.encode("ascii")
+            vals[i] = v & 0xffffffffffffffff
+        unbound = lib.bpf_bind_consts(insns, size // 8, names, vals, len(values))
+        if unbound < 0:
+            raise MemoryError("Failed to bind the constants of %s" % func_name)
+        if unbound:
+            raise Exception("Failed to load BPF program %s: %d uses of "
+                    "constants without a value" % (func_name, unbound))
+        return insns, size
+
+    def _prog_load(self, prog_type, insns, size, log_level):
+        """Returns the fd, or -1, and the verifier log at log_level. The log
+        buffer grows until the log fits."""
+        log_size = 65536 if log_level else 0
+        while True:
+            log_buf = ct.create_string_buffer(log_size) if log_size else None
+            fd = lib.bpf_prog_load_level(prog_type, insns, size,
+                    lib.bpf_module_license(self.module),
+                    lib.bpf_module_kern_version(self.module),
+                    log_level, log_buf, log_size)
+            if fd >= 0 or not log_size or ct.get_errno() != errno.ENOSPC or \
+                    log_size >= BPF_LOG_BUF_MAX:
+                break
+            log_size = min(log_size * 2, BPF_LOG_BUF_MAX)
+        return fd, log_buf.value.decode() if log_buf else ""
+
+    def _verifier_report(self, func_name, log):
+        report = lib.bpf_function_verifier_report(self.module,
+                func_name.encode("ascii"), log.encode())
+        return json.loads(report.decode())
+
+    def verifier_report(self, func_name, prog_type=KPROBE, consts=None):
+        """verifier_report(func_name, prog_type=KPROBE, consts=None)
+
+        Load the function once more with the verifier log on and return the
+        log broken down per instruction, as a dict with the keys processed,
+        total_states, peak_states (0 where the kernel does not print them),
+        last_insn, error (empty if the function was accepted) and insns, a
+        list of dicts with the keys insn, visits, states, pruned, text,
+        source and regs. The function is loaded whether or not it was
+        already, and is not kept; load_func() raises VerifierError with the
+        same report for a rejected function.
+        """
+        values = dict(self.consts)
+        if consts:
+            values.update(consts)
+        insns, size = self._bound_insns(func_name, values)
+        fd, log = self._prog_load(prog_type, insns, size, 1)
+        if fd >= 0:
+            os.close(fd)
+        return self._verifier_report(func_name, log)
+
+    def disassemble_func(self, func_name):
+        """disassemble_func(func_name)
+
+        Return the listing of the eBPF instructions of the function, one per
+        line.
+        """
+        text = lib.bpf_function_disasm(self.module, func_name.encode("ascii"))
+        if text == None:
+            raise Exception("Unknown program %s" % func_name)
+        return text.decode()
+
+    def analyze(self, func_name=None):
+        """analyze(func_name=None)
+
+        Return the static cost of the function as a dict with the keys
+        insns, calls, helpers (call sites by helper name, e.g.
+        "probe_read"), max_path_insns, max_path_calls, stack_bytes and
+        has_loops. Without func_name, return a dict of those for every
+        function of the module.
+        """
+        if func_name is None:
+            return dict((lib.bpf_function_name(self.module, i).decode(),
+                    self.analyze(lib.bpf_function_name(self.module, i).decode()))
+                    for i in range(0, lib.bpf_num_functions(self.module)))
+        cost = lib.bpf_function_cost(self.module, func_name.encode("ascii"))
+        if cost == None:
+            raise Exception("Unknown program %s" % func_name)
+        return json.loads(cost.decode())
+
     def dump_func(self, func_name):
         """
         Return the eBPF bytecodes for the specified function as a string
@@ -219,6 +579,58 @@ class BPF(object):
         size, = lib.bpf_function_size(self.module, func_name.encode("ascii")),
         return ct.string_at(start, size)
 
+    def dump_object(self, path):
+        """dump_object(path)
+
+        Write the compiled module to path. The object can be loaded without
+        LLVM through the bpf_object_* functions of libbcc (see bpf_object.h).
+        """
+        if lib.bpf_module_write_object(self.module, path.encode("ascii")) < 0:
+            raise Exception("Failed to write object %s" % path)
+
+    def compact(self):
+        """compact()
+
+        Release the compiler state (LLVM context, JIT engines, clang) of the
+        loaded module, keeping only the function bytes and table metadata.
+        Meant for long running tools, the tables are formatted from their
+        key/leaf desc afterwards and dump_object() is no longer possible.
+        """
+        if lib.bpf_module_compact(self.module) < 0:
+            raise Exception("Failed to compact module")
+
+    @staticmethod
+    def cache_stats():
+        """cache_stats()
+
+        Return a (hits, misses) tuple counting the modules in this process
+        that were restored from, or missed in, the on-disk compile cache.
+        The cache is located in $BCC_CACHE_DIR (default /var/tmp/bcc-cache),
+        set it to the empty string to disable caching.
+        """
+        return (lib.bpf_module_cache_hits(), lib.bpf_module_cache_misses())
+
+    @property
+    def skipped_map_bytes(self):
+        """skipped_map_bytes
+
+        Approximate locked memory saved by the tables that no function of the
+        module references. Their maps are only created when the table is
+        first used from user space.
+        """
+        return lib.bpf_module_skipped_map_bytes(self.module)
+
+    @property
+    def compile_stats(self):
+        """compile_stats
+
+        List of dicts with the wall time, thread CPU time (in ns) and growth
+        of the process peak RSS (in kB) of each compile phase of this module,
+        in the order they first ran. Table formatters are built on first use,
+        so the "rw_jit" phase keeps growing after the constructor returns.
+        """
+        return json.loads(lib.bpf_module_compile_stats(self.module).decode())
+
     str2ctype = {
         u"_Bool": ct.c_bool,
         u"char": ct.c_char,
@@ -350,6 +762,7 @@ class BPF(object):
         if res == None:
             raise Exception("Failed to attach BPF to kprobe")
         open_kprobes[ev_name] = res
+        self._probes[ev_name] = ("kprobe", fn_name, desc, pid, cpu, group_fd)
         return self
 
     @staticmethod
@@ -398,6 +811,7 @@ class BPF(object):
         if res == None:
             raise Exception("Failed to attach BPF to kprobe")
         open_kprobes[ev_name] = res
+        self._probes[ev_name] = ("kprobe", fn_name, desc, pid, cpu, group_fd)
         return self
 
     @staticmethod
@@ -522,6 +936,7 @@ class BPF(object):
         if res == None:
             raise Exception("Failed to attach BPF to uprobe")
         open_uprobes[ev_name] = res
+        self._probes[ev_name] = ("uprobe", fn_name, desc, pid, cpu, group_fd)
         return self
 
     @classmethod
@@ -566,6 +981,7 @@ class BPF(object):
         if res == None:
             raise Exception("Failed to attach BPF to uprobe")
         open_uprobes[ev_name] = res
+        self._probes[ev_name] = ("uprobe", fn_name, desc, pid, cpu, group_fd)
         return self
 
     @classmethod
@@ -590,9 +1006,13 @@ class BPF(object):
     def _trace_autoload(self):
         # Cater to one-liner case where attach_kprobe is omitted and C function
         # name matches that of the kprobe.
+        # The functions are verified one at a time on purpose, a tool that
+        # wants them verified concurrently calls load_funcs(parallel=True)
+        # before attaching.
         if len(open_kprobes) == 0:
-            for i in range(0, lib.bpf_num_functions(self.module)):
-                func_name = lib.bpf_function_name(self.module, i).decode()
+            func_names = [lib.bpf_function_name(self.module, i).decode()
+                    for i in range(0, lib.bpf_num_functions(self.module))]
+            for func_name in func_names:
                 if func_name.startswith("kprobe__"):
                     fn = self.load_func(func_name, BPF.KPROBE)
                     self.attach_kprobe(event=fn.name[8:], fn_name=fn.name)
@@ -14,7 +14,7 @@
 
 import ctypes as ct
 
-lib = ct.CDLL("libbcc.so.0")
+lib = ct.CDLL("libbcc.so.0", use_errno=True)
 
 # keep in sync with bpf_common.h
 lib.bpf_module_create_b.restype = ct.c_void_p
@@ -25,12 +25,39 @@ lib.bpf_module_create_c.argtypes = [ct.c_char_p, ct.c_uint,
 lib.bpf_module_create_c_from_string.restype = ct.c_void_p
 lib.bpf_module_create_c_from_string.argtypes = [ct.c_char_p, ct.c_uint,
         ct.POINTER(ct.c_char_p), ct.c_int]
+lib.bpf_module_create_c_batch.restype = ct.c_int
+lib.bpf_module_create_c_batch.argtypes = [ct.POINTER(ct.c_char_p), ct.c_size_t,
+        ct.c_uint, ct.POINTER(ct.c_char_p), ct.c_int, ct.POINTER(ct.c_void_p),
+        ct.c_uint]
+lib.bpf_build_type_db.restype = ct.c_int
+lib.bpf_build_type_db.argtypes = [ct.c_char_p, ct.POINTER(ct.c_char_p), ct.c_int,
+        ct.POINTER(ct.c_char_p), ct.c_int]
+lib.bpf_build_header_archive.restype = ct.c_int
+lib.bpf_build_header_archive.argtypes = [ct.c_char_p]
 lib.bpf_module_destroy.restype = None
 lib.bpf_module_destroy.argtypes = [ct.c_void_p]
+lib.bpf_module_compact.restype = ct.c_int
+lib.bpf_module_compact.argtypes = [ct.c_void_p]
+lib.bpf_module_instantiate.restype = ct.c_int
+lib.bpf_module_instantiate.argtypes = [ct.c_void_p]
+lib.bpf_module_instantiate_from.restype = ct.c_int
+lib.bpf_module_instantiate_from.argtypes = [ct.c_void_p, ct.c_void_p]
+lib.bpf_module_take_exports.restype = ct.c_int
+lib.bpf_module_take_exports.argtypes = [ct.c_void_p, ct.c_void_p]
+lib.bpf_module_skipped_map_bytes.restype = ct.c_size_t
+lib.bpf_module_skipped_map_bytes.argtypes = [ct.c_void_p]
+lib.bpf_module_write_object.restype = ct.c_int
+lib.bpf_module_write_object.argtypes = [ct.c_void_p, ct.c_char_p]
 lib.bpf_module_license.restype = ct.c_char_p
 lib.bpf_module_license.argtypes = [ct.c_void_p]
 lib.bpf_module_kern_version.restype = ct.c_uint
 lib.bpf_module_kern_version.argtypes = [ct.c_void_p]
+lib.bpf_module_compile_stats.restype = ct.c_char_p
+lib.bpf_module_compile_stats.argtypes = [ct.c_void_p]
+lib.bpf_module_cache_hits.restype = ct.c_size_t
+lib.bpf_module_cache_hits.argtypes = []
+lib.bpf_module_cache_misses.restype = ct.c_size_t
+lib.bpf_module_cache_misses.argtypes = []
 lib.bpf_num_functions.restype = ct.c_ulonglong
 lib.bpf_num_functions.argtypes = [ct.c_void_p]
 lib.bpf_function_name.restype = ct.c_char_p
@@ -39,8 +66,22 @@ lib.bpf_function_start.restype = ct.c_void_p
 lib.bpf_function_start.argtypes = [ct.c_void_p, ct.c_char_p]
 lib.bpf_function_size.restype = ct.c_size_t
 lib.bpf_function_size.argtypes = [ct.c_void_p, ct.c_char_p]
+lib.bpf_function_disasm.restype = ct.c_char_p
+lib.bpf_function_disasm.argtypes = [ct.c_void_p, ct.c_char_p]
+lib.bpf_function_cost.restype = ct.c_char_p
+lib.bpf_function_cost.argtypes = [ct.c_void_p, ct.c_char_p]
+lib.bpf_function_verifier_report.restype = ct.c_char_p
+lib.bpf_function_verifier_report.argtypes = [ct.c_void_p, ct.c_char_p,
+        ct.c_char_p]
+lib.bpf_function_load_batch.restype = ct.c_int
+lib.bpf_function_load_batch.argtypes = [ct.c_void_p, ct.POINTER(ct.c_char_p),
+        ct.c_size_t, ct.c_int, ct.POINTER(ct.c_char_p),
+        ct.POINTER(ct.c_ulonglong), ct.c_int, ct.c_uint, ct.c_uint,
+        ct.POINTER(ct.c_int), ct.POINTER(ct.c_char_p)]
 lib.bpf_table_id.restype = ct.c_ulonglong
 lib.bpf_table_id.argtypes = [ct.c_void_p, ct.c_char_p]
+lib.bpf_table_name.restype = ct.c_char_p
+lib.bpf_table_name.argtypes = [ct.c_void_p, ct.c_ulonglong]
 lib.bpf_table_fd.restype = ct.c_int
 lib.bpf_table_fd.argtypes = [ct.c_void_p, ct.c_char_p]
 lib.bpf_table_type_id.restype = ct.c_int
@@ -63,6 +104,13 @@ lib.bpf_table_key_sscanf.argtypes = [ct.c_void_p, ct.c_ulonglong,
 lib.bpf_table_leaf_sscanf.restype = ct.c_int
 lib.bpf_table_leaf_sscanf.argtypes = [ct.c_void_p, ct.c_ulonglong,
         ct.c_char_p, ct.c_void_p]
+lib.bpf_table_key_size_id.restype = ct.c_size_t
+lib.bpf_table_key_size_id.argtypes = [ct.c_void_p, ct.c_ulonglong]
+lib.bpf_table_leaf_size_id.restype = ct.c_size_t
+lib.bpf_table_leaf_size_id.argtypes = [ct.c_void_p, ct.c_ulonglong]
+lib.bpf_table_format.restype = ct.c_int
+lib.bpf_table_format.argtypes = [ct.c_void_p, ct.c_ulonglong, ct.c_int,
+        ct.c_void_p, ct.c_void_p, ct.c_size_t, ct.c_char_p, ct.c_size_t]
 
 # keep in sync with libbpf.h
 lib.bpf_get_next_key.restype = ct.c_int
@@ -74,6 +122,25 @@ lib.bpf_update_elem.argtypes = [ct.c_int, ct.c_void_p, ct.c_void_p,
         ct.c_ulonglong]
 lib.bpf_delete_elem.restype = ct.c_int
 lib.bpf_delete_elem.argtypes = [ct.c_int, ct.c_void_p]
+lib.bpf_get_first_key.restype = ct.c_int
+lib.bpf_get_first_key.argtypes = [ct.c_int, ct.c_void_p, ct.c_size_t]
+lib.bpf_count_elems.restype = ct.c_int
+lib.bpf_count_elems.argtypes = [ct.c_int, ct.c_size_t]
+lib.bpf_num_possible_cpus.restype = ct.c_int
+lib.bpf_num_possible_cpus.argtypes = []
+lib.bpf_percpu_reduce.restype = ct.c_int
+lib.bpf_percpu_reduce.argtypes = [ct.c_void_p, ct.c_void_p, ct.c_uint,
+        ct.c_uint, ct.c_size_t, ct.c_void_p, ct.c_void_p, ct.c_void_p,
+        ct.c_uint, ct.c_int]
+lib.bpf_lookup_batch.restype = ct.c_int
+lib.bpf_lookup_batch.argtypes = [ct.c_int, ct.c_void_p, ct.c_void_p,
+        ct.c_void_p, ct.c_size_t, ct.c_size_t, ct.c_uint]
+lib.bpf_update_batch.restype = ct.c_int
+lib.bpf_update_batch.argtypes = [ct.c_int, ct.c_void_p, ct.c_void_p,
+        ct.c_size_t, ct.c_size_t, ct.c_uint, ct.c_ulonglong]
+lib.bpf_delete_batch.restype = ct.c_int
+lib.bpf_delete_batch.argtypes = [ct.c_int, ct.c_void_p, ct.c_size_t,
+        ct.c_uint]
 lib.bpf_open_raw_sock.restype = ct.c_int
 lib.bpf_open_raw_sock.argtypes = [ct.c_char_p]
 lib.bpf_attach_socket.restype = ct.c_int
@@ -81,6 +148,12 @@ lib.bpf_attach_socket.argtypes = [ct.c_int, ct.c_int]
 lib.bpf_prog_load.restype = ct.c_int
 lib.bpf_prog_load.argtypes = [ct.c_int, ct.c_void_p, ct.c_size_t,
         ct.c_char_p, ct.c_uint, ct.c_char_p, ct.c_uint]
+lib.bpf_prog_load_level.restype = ct.c_int
+lib.bpf_prog_load_level.argtypes = [ct.c_int, ct.c_void_p, ct.c_size_t,
+        ct.c_char_p, ct.c_uint, ct.c_uint, ct.c_char_p, ct.c_uint]
+lib.bpf_bind_consts.restype = ct.c_int
+lib.bpf_bind_consts.argtypes = [ct.c_void_p, ct.c_int,
+        ct.POINTER(ct.c_char_p), ct.POINTER(ct.c_ulonglong), ct.c_int]
 lib.bpf_attach_kprobe.restype = ct.c_void_p
 _CB_TYPE = ct.CFUNCTYPE(None, ct.py_object, ct.c_int,
         ct.c_ulonglong, ct.POINTER(ct.c_ulonglong))
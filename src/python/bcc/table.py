@@ -14,6 +14,7 @@
 
 from collections import MutableMapping
 import ctypes as ct
+from functools import reduce
 import multiprocessing
 
 from .libbcc import lib, _RAW_CB_TYPE
@@ -27,6 +28,17 @@ BPF_MAP_TYPE_PERCPU_HASH = 5
 BPF_MAP_TYPE_PERCPU_ARRAY = 6
 BPF_MAP_TYPE_STACK_TRACE = 7
 
+# formats of TableBase.format_records(), keep in sync with bpf_common.h
+BPF_TABLE_FORMATS = {"text": 0, "json": 1, "csv": 2}
+BPF_TABLE_FORMAT_HEADER = 0x100
+
+# native reductions of per-cpu values and the kinds of the fields they
+# combine, keep in sync with libbpf.h
+BPF_PERCPU_REDUCERS = {"sum": 0, "min": 1, "max": 2, "avg": 3}
+BPF_FIELD_UNSIGNED = 0
+BPF_FIELD_SIGNED = 1
+BPF_FIELD_FLOAT = 2
+
 stars_max = 40
 
 # helper functions, consider moving these to a utils module
@@ -74,6 +86,39 @@ def _print_log2_hist(vals, val_type):
                       _stars(val, val_max, stars)))
 
 
+def _possible_cpus():
+    # per-cpu maps hold a value for each possible cpu, online or not
+    n = lib.bpf_num_possible_cpus()
+    if n < 0:
+        raise Exception("Could not get the number of possible cpus")
+    return n
+
+
+def _reduced_fields(t, offset=0):
+    """(offset, size, kind) of the numbers that make up the ctypes type t.
+    Characters, pointers, unions and bit fields are left out."""
+    if issubclass(t, ct.Structure):
+        fields = []
+        for f in t._fields_:
+            if len(f) < 3:
+                fields += _reduced_fields(f[1], offset + getattr(t, f[0]).offset)
+        return fields
+    if issubclass(t, ct.Array):
+        size = ct.sizeof(t._type_)
+        return [f for i in range(t._length_)
+                for f in _reduced_fields(t._type_, offset + i * size)]
+    code = getattr(t, "_type_", None)
+    if not isinstance(code, str):
+        return []
+    if code in "fd":
+        return [(offset, ct.sizeof(t), BPF_FIELD_FLOAT)]
+    if code in "bhilq":
+        return [(offset, ct.sizeof(t), BPF_FIELD_SIGNED)]
+    if code in "BHILQ":
+        return [(offset, ct.sizeof(t), BPF_FIELD_UNSIGNED)]
+    return []
+
+
 def Table(bpf, map_id, map_fd, keytype, leaftype, **kwargs):
     """Table(bpf, map_id, map_fd, keytype, leaftype, **kwargs)
 
@@ -110,10 +155,22 @@ class TableBase(MutableMapping):
         self.Leaf = leaftype
         self.ttype = lib.bpf_table_type_id(self.bpf.module, self.map_id)
         self._cbs = {}
+        self._sbuf = None
+
+    # whether the leaves read by _dump() are those of __getitem__, i.e. the
+    # table has one value per key
+    _batch_leaves = True
+
+    def _sprintf_buf(self):
+        # reused by key_sprintf/leaf_sprintf
+        if not self._sbuf:
+            self._sbuf = ct.create_string_buffer(
+                    max(ct.sizeof(self.Key), ct.sizeof(self.Leaf)) * 8)
+        return self._sbuf
 
     def key_sprintf(self, key):
         key_p = ct.pointer(key)
-        buf = ct.create_string_buffer(ct.sizeof(self.Key) * 8)
+        buf = self._sprintf_buf()
         res = lib.bpf_table_key_snprintf(self.bpf.module, self.map_id,
                 buf, len(buf), key_p)
         if res < 0:
@@ -122,7 +179,7 @@ class TableBase(MutableMapping):
 
     def leaf_sprintf(self, leaf):
         leaf_p = ct.pointer(leaf)
-        buf = ct.create_string_buffer(ct.sizeof(self.Leaf) * 8)
+        buf = self._sprintf_buf()
         res = lib.bpf_table_leaf_snprintf(self.bpf.module, self.map_id,
                 buf, len(buf), leaf_p)
         if res < 0:
@@ -147,6 +204,165 @@ class TableBase(MutableMapping):
             raise Exception("Could not scanf leaf")
         return leaf
 
+    def format_records(self, keys=None, leaves=None, fmt="text", header=False):
+        """format_records(keys=None, leaves=None, fmt="text", header=False)
+
+        Format ctypes arrays of keys and/or leaves (of the same length) in
+        native code, one line per record. fmt is one of "text", "json" or
+        "csv", header adds a line of column names to csv output.
+        """
+        records = keys if keys is not None else leaves
+        if records is None:
+            raise Exception("No records to format")
+        if keys is not None and leaves is not None and len(keys) != len(leaves):
+            raise Exception("Keys and leaves differ in length")
+        if (keys is not None and ct.sizeof(self.Key) != lib.bpf_table_key_size_id(
+                    self.bpf.module, self.map_id)) or \
+                (leaves is not None and ct.sizeof(self.Leaf) != lib.bpf_table_leaf_size_id(
+                    self.bpf.module, self.map_id)):
+            raise Exception("Records do not match the table layout")
+        flags = BPF_TABLE_FORMATS[fmt]
+        if header:
+            flags |= BPF_TABLE_FORMAT_HEADER
+        count = len(records)
+        out = []
+        done = 0
+        buf = ct.create_string_buffer(65536)
+        while done < count:
+            keys_p = ct.byref(keys, done * ct.sizeof(self.Key)) \
+                    if keys is not None else None
+            leaves_p = ct.byref(leaves, done * ct.sizeof(self.Leaf)) \
+                    if leaves is not None else None
+            res = lib.bpf_table_format(self.bpf.module, self.map_id, flags,
+                    keys_p, leaves_p, count - done, buf, len(buf))
+            if res < 0:
+                raise Exception("Could not format records")
+            if res == 0:
+                buf = ct.create_string_buffer(len(buf) * 2)
+                continue
+            out.append(buf.value)
+            done += res
+            flags &= ~BPF_TABLE_FORMAT_HEADER
+        return b"".join(out)
+
+    def dump(self, fmt="text", header=False):
+        """dump(fmt="text", header=False)
+
+        Return all entries of the table formatted by format_records()
+        """
+        if self._batch_leaves:
+            keys, leaves = self._dump()
+        else:
+            items = self.items()
+            keys = (self.Key * len(items))(*[k for k, v in items])
+            leaves = (self.Leaf * len(items))(*[v for k, v in items])
+        if not len(keys):
+            return b""
+        return self.format_records(keys, leaves, fmt, header)
+
+    def _dump(self, leaves=True, leaftype=None):
+        """_dump(leaves=True, leaftype=None)
+
+        Read all the entries of the table in one native call, into ctypes
+        arrays of keys and leaves (None unless leaves) of the same length.
+        leaftype overrides the Leaf of the table.
+        """
+        leaftype = leaftype or self.Leaf
+        ksize, vsize = ct.sizeof(self.Key), ct.sizeof(leaftype)
+        max_entries = int(lib.bpf_table_max_entries_id(self.bpf.module,
+                self.map_id))
+        n = max(min(self._dump_hint(), max_entries), 1)
+        chunks = []
+        total = 0
+        start = None
+        while True:
+            keys = (self.Key * n)()
+            vals = (leaftype * n)() if leaves else None
+            res = lib.bpf_lookup_batch(self.map_fd, start, keys, vals,
+                    ksize, vsize, n)
+            if res < 0:
+                raise Exception("Could not dump table")
+            chunks.append((keys, vals, res))
+            total += res
+            # only a table that grew since _dump_hint() has more entries,
+            # read them from the last key on
+            if res < n or total >= max_entries:
+                break
+            start = ct.byref(keys, (res - 1) * ksize)
+            n = min(max(total // 8, 16), max_entries - total)
+        if len(chunks) == 1:
+            keys = (self.Key * res).from_buffer(keys)
+            if leaves:
+                vals = (leaftype * res).from_buffer(vals)
+            return keys, vals
+        keys = (self.Key * total)()
+        vals = (leaftype * total)() if leaves else None
+        done = 0
+        for k, v, res in chunks:
+            ct.memmove(ct.byref(keys, done * ksize), k, res * ksize)
+            if leaves:
+                ct.memmove(ct.byref(vals, done * vsize), v, res * vsize)
+            done += res
+        return keys, vals
+
+    def _dump_hint(self):
+        # the size of the first walk of _dump(), with room for entries
+        # added after they were counted
+        count = lib.bpf_count_elems(self.map_fd, ct.sizeof(self.Key))
+        if count < 0:
+            raise Exception("Could not count table entries")
+        return count + count // 8 + 16
+
+    def _snapshot_leaf(self):
+        # the leaf as the kernel copies it, and the type of its elements if
+        # it is a row of per-cpu values
+        return self.Leaf, None
+
+    def snapshot(self, numpy=False):
+        """snapshot(numpy=False)
+
+        Read all the entries of the table in one native call, without a
+        Python object per entry. Returns the keys and the leaves as
+        memoryviews of two contiguous buffers, or with numpy as structured
+        arrays sharing them. Leaves of per-cpu tables are [entries x cpus],
+        with a column for each possible cpu.
+        """
+        leaftype, elemtype = self._snapshot_leaf()
+        keys, leaves = self._dump(leaftype=leaftype)
+        if not numpy:
+            return memoryview(keys), memoryview(leaves)
+        import numpy as np
+        keys = np.frombuffer(keys, dtype=np.dtype(self.Key))
+        if elemtype:
+            leaves = np.frombuffer(leaves, dtype=np.dtype(elemtype)).reshape(
+                    len(keys), ct.sizeof(leaftype) // ct.sizeof(elemtype))
+        else:
+            leaves = np.frombuffer(leaves, dtype=np.dtype(leaftype))
+        return keys, leaves
+
+    def swap(self):
+        """swap()
+
+        For a table declared with BPF_TABLE_SWAP: reset the copy of the
+        table that the program does not update, in bulk, and make the
+        program update it from now on. Returns the copy updated until now,
+        which holds the entries since the previous swap() and can be read
+        while the program goes on.
+        """
+        name = lib.bpf_table_name(self.bpf.module, self.map_id).decode()
+        if name.endswith("__1"):
+            name = name[:-3]
+        try:
+            active = self.bpf[name + "__active"]
+            copies = [self.bpf[name], self.bpf[name + "__1"]]
+        except KeyError:
+            raise Exception("Table %s is not declared with BPF_TABLE_SWAP" %
+                    name)
+        i = 1 if active[0].value else 0
+        copies[1 - i].clear()
+        active[0] = active.Leaf(1 - i)
+        return copies[i]
+
     def __getitem__(self, key):
         key_p = ct.pointer(key)
         leaf = self.Leaf()
@@ -186,19 +402,36 @@ class TableBase(MutableMapping):
                 pass
 
     def items(self):
-        return [item for item in self.iteritems()]
+        if not self._batch_leaves:
+            return [item for item in self.iteritems()]
+        keys, leaves = self._dump()
+        ks, ls = ct.sizeof(self.Key), ct.sizeof(self.Leaf)
+        return [(self.Key.from_buffer(keys, i * ks),
+                 self.Leaf.from_buffer(leaves, i * ls))
+                for i in range(len(keys))]
 
     def values(self):
-        return [value for value in self.itervalues()]
+        return [value for key, value in self.items()]
 
     def clear(self):
         # default clear uses popitem, which can race with the bpf prog
-        for k in self.keys():
-            self.__delitem__(k)
+        keys, _ = self._dump(leaves=False)
+        res = lib.bpf_delete_batch(self.map_fd, keys, ct.sizeof(self.Key),
+                len(keys))
+        if res < 0:
+            raise Exception("Could not clear table")
 
     def zero(self):
-        for k in self.keys():
-            self[k] = self.Leaf()
+        if not self._batch_leaves:
+            for k in self.keys():
+                self[k] = self.Leaf()
+            return
+        keys, _ = self._dump(leaves=False)
+        leaves = (self.Leaf * len(keys))()
+        res = lib.bpf_update_batch(self.map_fd, keys, leaves,
+                ct.sizeof(self.Key), ct.sizeof(self.Leaf), len(keys), 0)
+        if res < 0:
+            raise Exception("Could not zero table")
 
     def __iter__(self):
         return TableBase.Iter(self, self.Key)
@@ -210,16 +443,7 @@ class TableBase(MutableMapping):
         def __init__(self, table, keytype):
             self.Key = keytype
             self.table = table
-            k = self.Key()
-            kp = ct.pointer(k)
-            # if 0 is a valid key, try a few alternatives
-            if k in table:
-                ct.memset(kp, 0xff, ct.sizeof(k))
-                if k in table:
-                    ct.memset(kp, 0x55, ct.sizeof(k))
-                    if k in table:
-                        raise Exception("Unable to allocate iterator")
-            self.key = k
+            self.key = None
         def __iter__(self):
             return self
         def __next__(self):
@@ -229,12 +453,20 @@ class TableBase(MutableMapping):
             return self.key
 
     def next(self, key):
+        """next(key)
+
+        The key after key in the table, or the first one if key is None
+        """
         next_key = self.Key()
         next_key_p = ct.pointer(next_key)
-        key_p = ct.pointer(key)
-        res = lib.bpf_get_next_key(self.map_fd,
-                ct.cast(key_p, ct.c_void_p),
-                ct.cast(next_key_p, ct.c_void_p))
+        if key is None:
+            res = lib.bpf_get_first_key(self.map_fd,
+                    ct.cast(next_key_p, ct.c_void_p), ct.sizeof(self.Key))
+        else:
+            key_p = ct.pointer(key)
+            res = lib.bpf_get_next_key(self.map_fd,
+                    ct.cast(key_p, ct.c_void_p),
+                    ct.cast(next_key_p, ct.c_void_p))
         if res < 0:
             raise StopIteration()
         return next_key
@@ -279,9 +511,10 @@ class HashTable(TableBase):
         super(HashTable, self).__init__(*args, **kwargs)
 
     def __len__(self):
-        i = 0
-        for k in self: i += 1
-        return i
+        res = lib.bpf_count_elems(self.map_fd, ct.sizeof(self.Key))
+        if res < 0:
+            raise Exception("Could not count table entries")
+        return res
 
     def __delitem__(self, key):
         key_p = ct.pointer(key)
@@ -310,6 +543,10 @@ class ArrayBase(TableBase):
     def __len__(self):
         return self.max_entries
 
+    def _dump_hint(self):
+        # every index is present, walking them once is enough
+        return self.max_entries
+
     def __getitem__(self, key):
         key = self._normalize_key(key)
         return super(ArrayBase, self).__getitem__(key)
@@ -331,6 +568,10 @@ class ArrayBase(TableBase):
         if res < 0:
             raise Exception("Could not clear item")
 
+    def clear(self):
+        # entries of arrays can't be deleted, zero them instead
+        self.zero()
+
     def __iter__(self):
         return ArrayBase.Iter(self, self.Key)
 
@@ -404,111 +645,126 @@ class PerfEventArray(ArrayBase):
             del(self.bpf.open_kprobes()[(id(self), key)])
         del self._cbs[key]
 
-class PerCpuHash(HashTable):
+class PerCpuMixin(object):
+    """Values of per-cpu tables, shared by PerCpuHash and PerCpuArray
+
+    A Leaf holds the value of each possible cpu, padded to 8 bytes as the
+    kernel copies them. reducer is a function combining two values of
+    getvalue(), or one of "sum", "min", "max" and "avg" to combine all of
+    them natively, field by field for struct leaves.
+    """
     def __init__(self, *args, **kwargs):
         self.reducer = kwargs.pop("reducer", None)
-        super(PerCpuHash, self).__init__(*args, **kwargs)
+        super(PerCpuMixin, self).__init__(*args, **kwargs)
         self.sLeaf = self.Leaf
-        self.total_cpu = multiprocessing.cpu_count()
+        self.total_cpu = _possible_cpus()
         # This needs to be 8 as hard coded into the linux kernel.
         self.alignment = ct.sizeof(self.sLeaf) % 8
-        if self.alignment is 0:
-            self.Leaf = self.sLeaf * self.total_cpu
-        else:
-            # Currently Float, Char, un-aligned structs are not supported
-            if self.sLeaf == ct.c_uint:
-                self.Leaf = ct.c_uint64 * self.total_cpu
-            elif self.sLeaf == ct.c_int:
-                self.Leaf = ct.c_int64 * self.total_cpu
+        self._padded = False
+        if self.alignment == 0:
+            eLeaf = self.sLeaf
+        elif issubclass(self.sLeaf, ct._SimpleCData) and \
+                self.sLeaf._type_ in "bBhHiIlLqQ":
+            # widen integers, their value is in the low bytes
+            if self.sLeaf._type_.islower():
+                eLeaf = ct.c_int64
             else:
-                raise IndexError("Leaf must be aligned to 8 bytes")
+                eLeaf = ct.c_uint64
+        else:
+            eLeaf = type("padded_" + self.sLeaf.__name__, (ct.Structure,),
+                    dict(_fields_=[("v", self.sLeaf),
+                        ("_pad", ct.c_char * (8 - self.alignment))]))
+            self._padded = True
+        self.Leaf = eLeaf * self.total_cpu
+        self._fields = None
 
     def getvalue(self, key):
-        result = super(PerCpuHash, self).__getitem__(key)
-        if self.alignment is 0:
+        result = super(PerCpuMixin, self).__getitem__(key)
+        if self.alignment == 0:
             ret = result
         else:
             ret = (self.sLeaf * self.total_cpu)()
             for i in range(0, self.total_cpu):
-                ret[i] = result[i]
+                ret[i] = result[i].v if self._padded else result[i]
         return ret
 
     def __getitem__(self, key):
-        if self.reducer:
+        if isinstance(self.reducer, str):
+            return self._reduce(key, self.reducer)
+        elif self.reducer:
             return reduce(self.reducer, self.getvalue(key))
         else:
             return self.getvalue(key)
 
-    def __setitem__(self, key, leaf):
-        super(PerCpuHash, self).__setitem__(key, leaf)
-
-    def sum(self, key):
-        if isinstance(self.Leaf(), ct.Structure):
-            raise IndexError("Leaf must be an integer type for default sum functions")
-        return self.sLeaf(reduce(lambda x,y: x+y, self.getvalue(key)))
-
-    def max(self, key):
-        if isinstance(self.Leaf(), ct.Structure):
-            raise IndexError("Leaf must be an integer type for default max functions")
-        return self.sLeaf(max(self.getvalue(key)))
+    def _reduce_rows(self, rows, n, op):
+        # combine n Leaf rows into an array of n sLeaf natively
+        if self._fields is None:
+            fields = _reduced_fields(self.sLeaf)
+            k = len(fields)
+            self._fields = ((ct.c_uint * k)(*[f[0] for f in fields]),
+                    (ct.c_uint * k)(*[f[1] for f in fields]),
+                    (ct.c_int * k)(*[f[2] for f in fields]), k)
+        offsets, sizes, kinds, k = self._fields
+        out = (self.sLeaf * n)()
+        res = lib.bpf_percpu_reduce(rows, out, n, self.total_cpu,
+                ct.sizeof(self.sLeaf), offsets, sizes, kinds, k,
+                BPF_PERCPU_REDUCERS[op])
+        if res < 0:
+            raise Exception("Could not reduce per-cpu values")
+        return out
 
-    def average(self, key):
-        result = self.sum(key)
-        result.value/=self.total_cpu
-        return result
+    def _reduce(self, key, op):
+        row = super(PerCpuMixin, self).__getitem__(key)
+        return self.sLeaf.from_buffer(self._reduce_rows(row, 1, op))
 
-class PerCpuArray(ArrayBase):
-    def __init__(self, *args, **kwargs):
-        self.reducer = kwargs.pop("reducer", None)
-        super(PerCpuArray, self).__init__(*args, **kwargs)
-        self.sLeaf = self.Leaf
-        self.total_cpu = multiprocessing.cpu_count()
-        # This needs to be 8 as hard coded into the linux kernel.
-        self.alignment = ct.sizeof(self.sLeaf) % 8
-        if self.alignment is 0:
-            self.Leaf = self.sLeaf * self.total_cpu
-        else:
-            # Currently Float, Char, un-aligned structs are not supported
-            if self.sLeaf == ct.c_uint:
-                self.Leaf = ct.c_uint64 * self.total_cpu
-            elif self.sLeaf == ct.c_int:
-                self.Leaf = ct.c_int64 * self.total_cpu
-            else:
-                raise IndexError("Leaf must be aligned to 8 bytes")
+    def reduced(self, op="sum"):
+        """reduced(op="sum")
 
-    def getvalue(self, key):
-        result = super(PerCpuArray, self).__getitem__(key)
-        if self.alignment is 0:
-            ret = result
-        else:
-            ret = (self.sLeaf * self.total_cpu)()
-            for i in range(0, self.total_cpu):
-                ret[i] = result[i]
-        return ret
+        Read all the entries of the table in one native call and combine
+        the values of the cpus of each with op, one of "sum", "min", "max"
+        and "avg". Returns ctypes arrays of the keys and of the sLeaf
+        results.
+        """
+        keys, rows = self._dump()
+        return keys, self._reduce_rows(rows, len(keys), op)
 
-    def __getitem__(self, key):
-        if (self.reducer):
-            return reduce(self.reducer, self.getvalue(key))
-        else:
-            return self.getvalue(key)
+    def items(self):
+        if not isinstance(self.reducer, str):
+            return super(PerCpuMixin, self).items()
+        keys, leaves = self.reduced(self.reducer)
+        ks, ls = ct.sizeof(self.Key), ct.sizeof(self.sLeaf)
+        return [(self.Key.from_buffer(keys, i * ks),
+                 self.sLeaf.from_buffer(leaves, i * ls))
+                for i in range(len(keys))]
 
-    def __setitem__(self, key, leaf):
-        super(PerCpuArray, self).__setitem__(key, leaf)
+    def _snapshot_leaf(self):
+        return self.Leaf, self.Leaf._type_
 
     def sum(self, key):
-        if isinstance(self.Leaf(), ct.Structure):
-            raise IndexError("Leaf must be an integer type for default sum functions")
-        return self.sLeaf(reduce(lambda x,y: x+y, self.getvalue(key)))
+        return self._reduce(key, "sum")
+
+    def min(self, key):
+        return self._reduce(key, "min")
 
     def max(self, key):
-        if isinstance(self.Leaf(), ct.Structure):
-            raise IndexError("Leaf must be an integer type for default max functions")
-        return self.sLeaf(max(self.getvalue(key)))
+        return self._reduce(key, "max")
 
     def average(self, key):
-        result = self.sum(key)
-        result.value/=self.total_cpu
-        return result
+        return self._reduce(key, "avg")
+
+class PerCpuHash(PerCpuMixin, HashTable):
+    # leaves go through getvalue() or the reducer, one entry at a time
+    # unless the reducer is native
+    _batch_leaves = False
+
+    def __init__(self, *args, **kwargs):
+        super(PerCpuHash, self).__init__(*args, **kwargs)
+
+class PerCpuArray(PerCpuMixin, ArrayBase):
+    _batch_leaves = False
+
+    def __init__(self, *args, **kwargs):
+        super(PerCpuArray, self).__init__(*args, **kwargs)
 
 class StackTrace(TableBase):
     MAX_DEPTH = 127
@@ -543,9 +799,10 @@ class StackTrace(TableBase):
         return StackTrace.StackWalker(self[self.Key(stack_id)], resolve)
 
     def __len__(self):
-        i = 0
-        for k in self: i += 1
-        return i
+        res = lib.bpf_count_elems(self.map_fd, ct.sizeof(self.Key))
+        if res < 0:
+            raise Exception("Could not count table entries")
+        return res
 
     def __delitem__(self, key):
         key_p = ct.pointer(key)
@@ -0,0 +1,34 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "bpf_object.h"
+
+// loads the object written by test_object_write, without llvm
+
+int main(int argc, char **argv) {
+  struct bpf_object *obj;
+  int ret = 1;
+
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s OBJECT\n", argv[0]);
+    return 1;
+  }
+  obj = bpf_object_open(argv[1]);
+  if (!obj)
+    return 1;
+  if (bpf_object_num_tables(obj) != 1 ||
+      strcmp(bpf_object_table_name(obj, 0), "counts") ||
+      bpf_object_table_fd(obj, "counts") < 0 ||
+      bpf_object_table_key_size(obj, "counts") != 4 ||
+      bpf_object_table_leaf_size(obj, "counts") != 8)
+    goto close;
+  if (bpf_object_num_functions(obj) != 1 ||
+      strcmp(bpf_object_function_name(obj, 0), "count"))
+    goto close;
+  if (bpf_object_prog_load(obj, "count", BPF_PROG_TYPE_KPROBE, NULL, 0) < 0)
+    goto close;
+  ret = 0;
+close:
+  bpf_object_close(obj);
+  return ret;
+}
@@ -0,0 +1,32 @@
+#include <stdio.h>
+
+#include "bpf_common.h"
+
+// compiles the program that test_object loads. This side links all of
+// bcc-static, test_object links only the loader.
+
+static const char *text =
+  "BPF_TABLE(\"hash\", int, u64, counts, 16);\n"
+  "int count(void *ctx) {\n"
+  "  int key = 1;\n"
+  "  u64 zero = 0, *val = counts.lookup_or_init(&key, &zero);\n"
+  "  if (val) (*val)++;\n"
+  "  return 0;\n"
+  "}\n";
+
+int main(int argc, char **argv) {
+  void *mod;
+  int ret = 1;
+
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s OBJECT\n", argv[0]);
+    return 1;
+  }
+  mod = bpf_module_create_c_from_string(text, 0, NULL, 0);
+  if (!mod)
+    return 1;
+  if (bpf_module_write_object(mod, argv[1]) == 0)
+    ret = 0;
+  bpf_module_destroy(mod);
+  return ret;
+}
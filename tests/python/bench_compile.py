@@ -0,0 +1,131 @@
+#!/usr/bin/env python
+# Copyright (c) PLUMgrid, Inc.
+# Licensed under the Apache License, Version 2.0 (the "License")
+
+# Compare the compile time of the programs in tools/ between two builds of
+# libbcc, e.g. a change and its parent.
+#
+# USAGE: bench_compile.py TOOLS_DIR [BASELINE_LIBDIR [ITERATIONS]]
+#
+# Every tool is run up to its first BPF() call, the module is compiled and
+# timed, and the tool is stopped. BCC_CACHE_DIR is empty, so neither the
+# module cache nor the PCH is used and every compile parses all headers. The
+# "BASE" column is measured in a child process that loads the libbcc.so.0 in
+# BASELINE_LIBDIR, the "NEW" column in one that loads the library found on
+# the usual path.
+
+from __future__ import print_function
+import os
+import runpy
+import subprocess
+import sys
+import time
+
+# tools that exit early when called without arguments
+args = {
+    "argdist.py": ["-C", "p::do_sys_open()"],
+    "funccount.py": ["vfs_read"],
+    "funclatency.py": ["vfs_read"],
+    "stackcount.py": ["vfs_read"],
+    "stacksnoop.py": ["vfs_read"],
+    "trace.py": ["do_sys_open"],
+}
+
+class Compiled(Exception):
+    pass
+
+class Timer(object):
+    def __init__(self, libbcc):
+        self.libbcc = libbcc
+        self.elapsed = None
+        self.orig_c = libbcc.lib.bpf_module_create_c
+        self.orig_str = libbcc.lib.bpf_module_create_c_from_string
+
+    def wrap(self, fn):
+        def timed(src, *rest):
+            start = time.time()
+            mod = fn(src, *rest)
+            self.elapsed = time.time() - start
+            if mod:
+                self.libbcc.lib.bpf_module_destroy(mod)
+            raise Compiled()
+        return timed
+
+    def run(self, path):
+        lib = self.libbcc.lib
+        self.elapsed = None
+        lib.bpf_module_create_c = self.wrap(self.orig_c)
+        lib.bpf_module_create_c_from_string = self.wrap(self.orig_str)
+        argv = sys.argv
+        sys.argv = [path] + args.get(os.path.basename(path), [])
+        try:
+            runpy.run_path(path, run_name="__main__")
+        except (SystemExit, Exception):
+            pass
+        finally:
+            sys.argv = argv
+            lib.bpf_module_create_c = self.orig_c
+            lib.bpf_module_create_c_from_string = self.orig_str
+        return self.elapsed
+
+def measure(tools_dir, iterations):
+    # runs in the child, prints "BENCH <tool> <best seconds>" per tool among
+    # whatever the tools print themselves
+    os.environ["BCC_CACHE_DIR"] = ""
+    from bcc import libbcc
+    timer = Timer(libbcc)
+    for name in sorted(os.listdir(tools_dir)):
+        if not name.endswith(".py"):
+            continue
+        best = None
+        for i in range(iterations):
+            t = timer.run(os.path.join(tools_dir, name))
+            if t is None:
+                break
+            best = t if best is None else min(best, t)
+        if best is not None:
+            print("BENCH %s %f" % (name, best))
+            sys.stdout.flush()
+
+def child(tools_dir, iterations, libdir=None):
+    env = dict(os.environ)
+    if libdir:
+        env["LD_LIBRARY_PATH"] = libdir + ":" + env.get("LD_LIBRARY_PATH", "")
+    out = subprocess.check_output([sys.executable, sys.argv[0], "--measure",
+            tools_dir, str(iterations)], env=env)
+    times = {}
+    for line in out.decode().splitlines():
+        if not line.startswith("BENCH "):
+            continue
+        _, name, t = line.split(" ")
+        times[name] = float(t)
+    return times
+
+def main():
+    if len(sys.argv) > 1 and sys.argv[1] == "--measure":
+        measure(sys.argv[2], int(sys.argv[3]))
+        return
+    if len(sys.argv) < 2:
+        print("USAGE: %s TOOLS_DIR [BASELINE_LIBDIR [ITERATIONS]]" % sys.argv[0])
+        sys.exit(1)
+    tools_dir = sys.argv[1]
+    base_dir = sys.argv[2] if len(sys.argv) > 2 else ""
+    iterations = int(sys.argv[3]) if len(sys.argv) > 3 else 3
+    new = child(tools_dir, iterations)
+    base = child(tools_dir, iterations, base_dir) if base_dir else {}
+    total_base = total_new = 0
+    print("%-20s %10s %10s %8s" % ("TOOL", "BASE(ms)", "NEW(ms)", "SPEEDUP"))
+    for name in sorted(new):
+        if name not in base:
+            print("%-20s %10s %10.1f" % (name, "-", new[name] * 1000))
+            continue
+        total_base += base[name]
+        total_new += new[name]
+        print("%-20s %10.1f %10.1f %7.1fx" % (name, base[name] * 1000,
+              new[name] * 1000, base[name] / new[name]))
+    if total_new:
+        print("%-20s %10.1f %10.1f %7.1fx" % ("total", total_base * 1000,
+              total_new * 1000, total_base / total_new))
+
+if __name__ == "__main__":
+    main()
@@ -2,8 +2,11 @@
 # Copyright (c) PLUMgrid, Inc.
 # Licensed under the Apache License, Version 2.0 (the "License")
 
-from bcc import BPF
+from bcc import BPF, VerifierError
 import ctypes
+import os
+import struct
+import tempfile
 from unittest import main, TestCase
 
 class TestClang(TestCase):
@@ -47,6 +50,177 @@ int count_foo(struct pt_regs *ctx, unsigned long a, unsigned long b) {
         b = BPF(text=text, debug=0)
         fn = b.load_func("count_foo", BPF.KPROBE)
 
+    def test_probe_read_coalesce(self):
+        text = """
+#include <linux/sched.h>
+#include <uapi/linux/ptrace.h>
+int count_sched(struct pt_regs *ctx, struct task_struct *prev) {
+    if (prev->pid == 0)
+        return 0;
+    return prev->tgid == prev->pid;
+}
+"""
+        b = BPF(text=text, debug=0)
+        fn = b.load_func("count_sched", BPF.KPROBE)
+        # the three reads share one call to bpf_probe_read (helper 4)
+        insns = b.dump_func("count_sched")
+        calls = [i for i in range(0, len(insns), 8)
+                if bytearray(insns[i:i+8])[0] == 0x85 and
+                struct.unpack("<i", insns[i+4:i+8])[0] == 4]
+        self.assertEqual(len(calls), 1)
+
+    def test_probe_read_coalesce_budget(self):
+        fields = "abcdefghijklmnop"
+        text = """
+#include <uapi/linux/ptrace.h>
+struct big { u64 %s; };
+int count(struct pt_regs *ctx, struct big *x, struct big *y) {
+    return %s + %s;
+}
+""" % (", ".join(fields), " + ".join("x->" + f for f in fields),
+          " + ".join("y->" + f for f in fields))
+        b = BPF(text=text, debug=0)
+        b.load_func("count", BPF.KPROBE)
+        # two 128 byte caches don't fit the budget, y is read field by field
+        insns = b.dump_func("count")
+        calls = [i for i in range(0, len(insns), 8)
+                if bytearray(insns[i:i+8])[0] == 0x85 and
+                struct.unpack("<i", insns[i+4:i+8])[0] == 4]
+        self.assertEqual(len(calls), 1 + len(fields))
+
+    def test_analyze(self):
+        text = """
+#include <linux/sched.h>
+#include <uapi/linux/ptrace.h>
+BPF_HASH(counts, u32);
+int count_sched(struct pt_regs *ctx, struct task_struct *prev) {
+    u32 pid = prev->pid;
+    u64 zero = 0, *val = counts.lookup_or_init(&pid, &zero);
+    if (val) (*val)++;
+    return 0;
+}
+"""
+        b = BPF(text=text, debug=0)
+        cost = b.analyze("count_sched")
+        self.assertEqual(cost["insns"], len(b.dump_func("count_sched")) // 8)
+        self.assertEqual(cost["helpers"]["probe_read"], 1)
+        self.assertTrue(cost["helpers"]["map_lookup_elem"] >= 1)
+        self.assertTrue(0 < cost["max_path_insns"] <= cost["insns"])
+        self.assertTrue(cost["stack_bytes"] > 0)
+        self.assertFalse(cost["has_loops"])
+        self.assertEqual(list(b.analyze().keys()), ["count_sched"])
+        listing = b.disassemble_func("count_sched")
+        self.assertIn("call probe_read#4", listing)
+        self.assertIn("exit", listing)
+
+    def test_verifier_report(self):
+        text = """
+BPF_HASH(vals, u32, u64);
+int accepted(void *ctx) {
+    u32 key = 0;
+    u64 *val = vals.lookup(&key);
+    return val ? *val : 0;
+}
+int rejected(void *ctx) {
+    u32 key = 0;
+    u64 *val = vals.lookup(&key);
+    return *val;
+}
+"""
+        b = BPF(text=text, debug=0)
+        report = b.verifier_report("accepted")
+        self.assertEqual(report["error"], "")
+        self.assertTrue(report["insns"])
+        self.assertTrue(all(i["visits"] >= 1 for i in report["insns"]
+                if i["text"]))
+        with self.assertRaises(VerifierError) as cm:
+            b.load_func("rejected", BPF.KPROBE)
+        report = cm.exception.report
+        self.assertTrue(report["error"])
+        self.assertTrue(report["last_insn"] >= 0)
+        self.assertIn(report["last_insn"], [i["insn"] for i in report["insns"]])
+        self.assertTrue(cm.exception.log)
+
+    def test_load_funcs_parallel(self):
+        text = "BPF_HASH(counts, u32, u64);\nBPF_CONST(u32, base);\n"
+        for i in range(16):
+            text += """
+int count%d(void *ctx) {
+    u32 key = base + %d;
+    u64 zero = 0, *val = counts.lookup_or_init(&key, &zero);
+    (*val)++;
+    return 0;
+}
+""" % (i, i)
+        b = BPF(text=text, consts={"base": 100})
+        fns = b.load_funcs(BPF.KPROBE, parallel=True)
+        self.assertEqual(len(fns), 16)
+        self.assertEqual(len(set(fn.fd for fn in fns)), 16)
+        self.assertTrue(all(fn.fd >= 0 for fn in fns))
+        # loaded once, later calls return the same programs
+        self.assertEqual([fn.fd for fn in b.load_funcs(BPF.KPROBE)],
+                [fn.fd for fn in fns])
+
+        text += """
+int rejected(void *ctx) {
+    u32 key = 0;
+    return *counts.lookup(&key);
+}
+"""
+        b = BPF(text=text, consts={"base": 100})
+        with self.assertRaises(VerifierError) as cm:
+            b.load_funcs(BPF.KPROBE, parallel=True)
+        self.assertEqual(cm.exception.func_name, "rejected")
+        self.assertTrue(cm.exception.report["error"])
+        self.assertIn("count15", b.funcs)
+
+    def test_kernel_types(self):
+        text = """
+#include <uapi/linux/ptrace.h>
+#include <linux/sched.h>
+#include <linux/blkdev.h>
+BPF_HASH(sizes, u32, u64);
+int on_request(struct pt_regs *ctx, struct task_struct *task, struct request *req) {
+    u32 pid = task->pid;
+    u64 len = req->__data_len + req->rq_disk->major + ctx->di;
+    sizes.update(&pid, &len);
+    return task->comm[0];
+}
+"""
+        with tempfile.NamedTemporaryFile(suffix=".db") as f:
+            BPF.build_type_db(f.name)
+            os.environ["BCC_TYPE_DB"] = f.name
+            try:
+                b = BPF(text=text, kernel_types=True)
+            finally:
+                del os.environ["BCC_TYPE_DB"]
+        # the same layouts give the same code
+        self.assertEqual(b.dump_func("on_request"),
+                BPF(text=text).dump_func("on_request"))
+
+    def test_header_archive(self):
+        text = """
+#include <uapi/linux/ptrace.h>
+#include <linux/sched.h>
+#include <net/sock.h>
+int count(struct pt_regs *ctx, struct task_struct *task, struct sock *sk) {
+    return task->pid + sk->__sk_common.skc_family;
+}
+"""
+        # without the module cache, both really compile
+        os.environ["BCC_CACHE_DIR"] = ""
+        try:
+            with tempfile.NamedTemporaryFile(suffix=".headers") as f:
+                BPF.build_header_archive(f.name)
+                os.environ["BCC_HEADER_ARCHIVE"] = f.name
+                b = BPF(text=text)
+            os.environ["BCC_HEADER_ARCHIVE"] = ""
+            # the snapshot compiles to the same code as the headers
+            self.assertEqual(b.dump_func("count"), BPF(text=text).dump_func("count"))
+        finally:
+            os.environ.pop("BCC_HEADER_ARCHIVE", None)
+            del os.environ["BCC_CACHE_DIR"]
+
     def test_probe_read_keys(self):
         text = """
 #include <uapi/linux/ptrace.h>
@@ -147,6 +321,58 @@ BPF_HASH(table3, u32, int);
 """
         b = BPF(text=text, debug=0)
 
+    def test_table_batch(self):
+        b = BPF(text="""BPF_HASH(table1, u32, u64, 64);""")
+        t = b["table1"]
+        for i in range(64):
+            t[t.Key(i)] = t.Leaf(i * 10)
+        self.assertEqual(len(t), 64)
+        items = t.items()
+        self.assertEqual(len(items), 64)
+        self.assertEqual(sorted((k.value, v.value) for k, v in items),
+                [(i, i * 10) for i in range(64)])
+        t.zero()
+        self.assertEqual(len(t), 64)
+        self.assertEqual(sum(v.value for v in t.values()), 0)
+        t.clear()
+        self.assertEqual(len(t), 0)
+        self.assertEqual(t.items(), [])
+
+    def test_table_swap(self):
+        b = BPF(text="""
+BPF_TABLE_SWAP("hash", u32, u64, counts, 16);
+int count(void *ctx) {
+    u32 key = 1;
+    counts.increment(key);
+    u64 *val = counts.lookup(&key);
+    if (val)
+        counts.delete(&key);
+    return 0;
+}""")
+        b.load_func("count", BPF.KPROBE)
+        t = b["counts"]
+        t[t.Key(1)] = t.Leaf(10)
+        b["counts__1"][t.Key(2)] = t.Leaf(20)
+        # the idle copy is reset and the program moves to it
+        retired = t.swap()
+        self.assertEqual([(k.value, v.value) for k, v in retired.items()],
+                [(1, 10)])
+        self.assertEqual(len(b["counts__1"]), 0)
+        self.assertEqual(b["counts__active"][0].value, 1)
+        retired = retired.swap()
+        self.assertEqual(len(retired), 0)
+        self.assertEqual(len(t), 0)
+        self.assertEqual(b["counts__active"][0].value, 0)
+
+    def test_iter_no_sentinel(self):
+        b = BPF(text="""BPF_HASH(table1, u8, u64, 256);""")
+        t = b["table1"]
+        # no key is left unused to start the walk from
+        for i in range(256):
+            t[t.Key(i)] = t.Leaf(i)
+        self.assertEqual(len(t), 256)
+        self.assertEqual(sorted(k.value for k in t.keys()), list(range(256)))
+
     def test_consecutive_probe_read(self):
         text = """
 #include <linux/fs.h>
@@ -320,5 +546,110 @@ BPF_TABLE("array", int, union emptyu, t3, 1);
         with self.assertRaises(Exception):
             b = BPF(text="""int failure(void *ctx) { if (); return 0; }""")
 
+    def test_compile_batch(self):
+        texts = ["""BPF_HASH(t%d, int, u64);
+int count(void *ctx) {
+    int key = %d;
+    u64 zero = 0, *val = t%d.lookup_or_init(&key, &zero);
+    if (val) (*val)++;
+    return 0;
+}""" % (i, i, i) for i in range(8)]
+        bpfs = BPF.compile_batch(texts, nthreads=4)
+        self.assertEqual(len(bpfs), 8)
+        for i, b in enumerate(bpfs):
+            b.load_func("count", BPF.KPROBE)
+            self.assertEqual(ctypes.sizeof(b["t%d" % i].Leaf), 8)
+        with self.assertRaises(Exception):
+            BPF.compile_batch(texts[:2] + ["int failure(void *ctx) { if (); }"])
+
+    def test_compile_only(self):
+        text = """
+BPF_HASH(counts, int, u64);
+int count(void *ctx) {
+    int key = 0;
+    u64 zero = 0, *val = counts.lookup_or_init(&key, &zero);
+    if (val) (*val)++;
+    return 0;
+}
+"""
+        b = BPF(text=text, compile_only=True)
+        self.assertTrue(len(b.dump_func("count")) > 0)
+        self.assertEqual(b["counts"].map_fd, -1)
+        b.instantiate()
+        self.assertTrue(b["counts"].map_fd >= 0)
+        b.load_func("count", BPF.KPROBE)
+
+    def test_exported_maps_deferred(self):
+        text = """BPF_TABLE_PUBLIC("hash", int, int, table2, 10);"""
+        b1 = BPF(text=text, compile_only=True)
+        b2 = BPF(text=text, compile_only=True)
+        b1.instantiate()
+        # the name is taken by b1, b2 must not leave a map behind
+        with self.assertRaises(Exception):
+            b2.instantiate()
+
+    def test_unused_tables(self):
+        text = """
+BPF_TABLE("hash", int, u64, used, 128);
+BPF_TABLE("hash", int, u64, unused, 1024);
+int count(void *ctx) {
+    int key = 0;
+    u64 zero = 0, *val = used.lookup_or_init(&key, &zero);
+    if (val) (*val)++;
+    return 0;
+}
+"""
+        b = BPF(text=text)
+        self.assertEqual(b.skipped_map_bytes, (4 + 8) * 1024)
+        # created once user space asks for it
+        self.assertTrue(b["unused"].map_fd >= 0)
+        self.assertEqual(b.skipped_map_bytes, 0)
+
+    def test_consts(self):
+        text = """
+BPF_CONST(u32, target_pid);
+BPF_CONST(u64, min_len);
+int filter(void *ctx) {
+    if ((bpf_get_current_pid_tgid() >> 32) != target_pid)
+        return 0;
+    return bpf_ktime_get_ns() >= min_len;
+}
+"""
+        b = BPF(text=text, consts={"min_len": 1 << 40})
+        with self.assertRaises(Exception):
+            b.load_func("filter", BPF.KPROBE)
+        fn1 = b.load_func("filter", BPF.KPROBE, consts={"target_pid": 1})
+        fn2 = b.load_func("filter", BPF.KPROBE, consts={"target_pid": 2})
+        self.assertNotEqual(fn1.fd, fn2.fd)
+        self.assertEqual(fn1, b.load_func("filter", BPF.KPROBE,
+            consts={"target_pid": 1}))
+
+    def test_reload(self):
+        text = """
+BPF_TABLE("hash", int, u64, counts, 128);
+int count(void *ctx) {
+    int key = %d;
+    u64 zero = 0, *val = counts.lookup_or_init(&key, &zero);
+    if (val) (*val)++;
+    return 0;
+}
+"""
+        b = BPF(text=text % 1)
+        counts = b["counts"]
+        counts[counts.Key(7)] = counts.Leaf(42)
+        fd = counts.map_fd
+        b.reload(text=text % 2)
+        self.assertEqual(b["counts"].map_fd, fd)
+        self.assertEqual(b["counts"][counts.Key(7)].value, 42)
+        # a table of the same name must keep its layout
+        with self.assertRaises(Exception):
+            b.reload(text=text.replace("u64, counts, 128", "u32, counts, 128") % 3)
+        self.assertEqual(counts[counts.Key(7)].value, 42)
+        # a function not attached to a probe cannot be moved
+        b.load_func("count", BPF.KPROBE)
+        with self.assertRaises(Exception):
+            b.reload(text=text % 3)
+        self.assertEqual(b["counts"].map_fd, fd)
+
 if __name__ == "__main__":
     main()
@@ -0,0 +1,139 @@
+#!/usr/bin/env python
+# Copyright (c) PLUMgrid, Inc.
+# Licensed under the Apache License, Version 2.0 (the "License")
+
+# test program for the on-disk compiled module cache
+
+from bcc import BPF, OPT_FAST, OPT_SIZE
+import ctypes as ct
+import os
+import shutil
+import tempfile
+from unittest import main, TestCase
+
+text = """
+BPF_HASH(stats, int, struct { u64 a; u32 b; });
+int count(void *ctx) {
+    int key = 1;
+    typeof(stats.leaf) zero = {};
+    stats.lookup_or_init(&key, &zero);
+    return 0;
+}
+"""
+
+class TestModuleCache(TestCase):
+    def setUp(self):
+        self.cache_dir = tempfile.mkdtemp()
+        os.environ["BCC_CACHE_DIR"] = self.cache_dir
+
+    def tearDown(self):
+        del os.environ["BCC_CACHE_DIR"]
+        shutil.rmtree(self.cache_dir)
+
+    def test_hit(self):
+        hits, misses = BPF.cache_stats()
+        b1 = BPF(text=text)
+        self.assertEqual(BPF.cache_stats(), (hits, misses + 1))
+        b2 = BPF(text=text)
+        self.assertEqual(BPF.cache_stats(), (hits + 1, misses + 1))
+
+        # maps are created fresh for every module
+        t1 = b1["stats"]
+        t2 = b2["stats"]
+        self.assertNotEqual(t1.map_fd, t2.map_fd)
+        t1[t1.Key(1)] = t1.Leaf(2, 3)
+        self.assertEqual(len(t2), 0)
+
+        # formatters survive the round trip
+        self.assertEqual(t2.key_sprintf(t2.Key(2)), b"0x2")
+        l = t2.leaf_scanf(t2.leaf_sprintf(t2.Leaf(4, 5)))
+        self.assertEqual((l.a, l.b), (4, 5))
+
+        b2.load_func("count", BPF.KPROBE)
+
+    def test_key(self):
+        hits, misses = BPF.cache_stats()
+        BPF(text=text)
+        BPF(text=text, cflags=["-DFOO"])
+        self.assertEqual(BPF.cache_stats(), (hits, misses + 2))
+
+    def test_include(self):
+        hdr = os.path.join(self.cache_dir, "inc.h")
+        with open(hdr, "w") as f:
+            f.write("#define KEY 1\n")
+        prog = '#include "%s"\n' % hdr + text.replace("key = 1", "key = KEY")
+        hits, misses = BPF.cache_stats()
+        BPF(text=prog)
+        BPF(text=prog)
+        self.assertEqual(BPF.cache_stats(), (hits + 1, misses + 1))
+        # editing an included file invalidates the entry
+        with open(hdr, "w") as f:
+            f.write("#define KEY 22\n")
+        os.utime(hdr, (0, 0))
+        BPF(text=prog)
+        self.assertEqual(BPF.cache_stats(), (hits + 1, misses + 2))
+
+    def test_pch(self):
+        BPF(text=text)
+        pchs = [f for f in os.listdir(self.cache_dir) if f.endswith(".pch")]
+        self.assertEqual(len(pchs), 1)
+        # a different program with the same flags reuses the header
+        BPF(text=text.replace("count", "count2"))
+        BPF(text=text, cflags=["-DFOO"])
+        pchs = [f for f in os.listdir(self.cache_dir) if f.endswith(".pch")]
+        self.assertEqual(len(pchs), 2)
+
+    def test_pch_same_code(self):
+        def insns(b):
+            code = bytearray(b.dump_func("count"))
+            # mask the map fds of the BPF_PSEUDO_MAP_FD loads
+            for i in range(0, len(code), 8):
+                if code[i] == 0x18 and code[i + 1] >> 4 == 1:
+                    code[i + 4:i + 8] = b"\0\0\0\0"
+            return code
+        os.environ["BCC_CACHE_DIR"] = ""
+        full = insns(BPF(text=text))
+        os.environ["BCC_CACHE_DIR"] = self.cache_dir
+        BPF(text=text)
+        # differs in the key only, parsed with the header built above
+        self.assertEqual(insns(BPF(text=text + "\n")), full)
+
+    def test_opt_profiles(self):
+        hits, misses = BPF.cache_stats()
+        for opt in [0, OPT_FAST, OPT_SIZE]:
+            b = BPF(text=text, opt=opt)
+            b.load_func("count", BPF.KPROBE)
+        # each profile produces different code, so gets its own entry
+        self.assertEqual(BPF.cache_stats(), (hits, misses + 3))
+        BPF(text=text, opt=OPT_SIZE)
+        self.assertEqual(BPF.cache_stats(), (hits + 1, misses + 3))
+
+    def test_disabled(self):
+        os.environ["BCC_CACHE_DIR"] = ""
+        stats = BPF.cache_stats()
+        BPF(text=text)
+        BPF(text=text)
+        self.assertEqual(BPF.cache_stats(), stats)
+
+    def test_compile_stats(self):
+        b1 = BPF(text=text)
+        phases = [p["phase"] for p in b1.compile_stats]
+        for name in ["clang_driver", "clang_rewrite", "clang_ir", "annotate",
+                     "opt", "bpf_codegen", "cache_save"]:
+            self.assertIn(name, phases)
+        self.assertNotIn("rw_jit", phases)
+        for p in b1.compile_stats:
+            self.assertEqual(p["count"], 1)
+            self.assertGreaterEqual(p["wall_ns"], 0)
+
+        b2 = BPF(text=text)
+        phases = [p["phase"] for p in b2.compile_stats]
+        self.assertEqual(phases, ["cache_load"])
+
+        t = b2["stats"]
+        t.key_sprintf(t.Key(1))
+        phases = [p["phase"] for p in b2.compile_stats]
+        self.assertIn("rw_jit", phases)
+
+if __name__ == "__main__":
+    main()
@@ -3,6 +3,7 @@
 # Licensed under the Apache License, Version 2.0 (the "License")
 
 import os
+import struct
 import unittest
 from bcc import BPF
 import multiprocessing
@@ -98,6 +99,47 @@ class TestPercpu(unittest.TestCase):
         k = stats_map[ stats_map.Key(0) ]
         self.assertGreater(k.c1, 0L)
 
+    def test_snapshot(self):
+        bpf_code = BPF(text="""BPF_TABLE("percpu_array", u32, u64, stats, 4);""")
+        stats_map = bpf_code.get_table("stats")
+        ini = stats_map.Leaf()
+        for i in range(0, multiprocessing.cpu_count()):
+            ini[i] = i + 1
+        stats_map[stats_map.Key(2)] = ini
+        keys, leaves = stats_map.snapshot()
+        self.assertEqual(keys.shape, (4,))
+        self.assertEqual(leaves.shape[0], 4)
+        self.assertGreaterEqual(leaves.shape[1], multiprocessing.cpu_count())
+        width = leaves.shape[1]
+        vals = struct.unpack_from("=%dQ" % (4 * width), leaves.tobytes())
+        self.assertEqual(list(vals[2 * width:2 * width + multiprocessing.cpu_count()]),
+                list(range(1, multiprocessing.cpu_count() + 1)))
+        self.assertEqual(sum(vals[:width]), 0)
+
+    def test_reduce_native(self):
+        bpf_code = BPF(text="""
+        struct val_t {
+            u16 count;
+            s8 delta;
+        };
+        BPF_TABLE("percpu_hash", u32, struct val_t, stats, 4);""")
+        stats_map = bpf_code.get_table("stats", reducer="sum")
+        ncpu = stats_map.total_cpu
+        ini = stats_map.Leaf()
+        for i in range(ncpu):
+            ini[i].v.count = 1
+            ini[i].v.delta = -(i % 2)
+        stats_map[stats_map.Key(7)] = ini
+        val = stats_map[stats_map.Key(7)]
+        self.assertEqual(val.count, ncpu)
+        self.assertEqual(stats_map.min(stats_map.Key(7)).delta,
+                -1 if ncpu > 1 else 0)
+        self.assertEqual(stats_map.max(stats_map.Key(7)).delta, 0)
+        self.assertEqual([(k.value, v.count) for k, v in stats_map.items()],
+                [(7, ncpu)])
+        keys, leaves = stats_map.reduced("avg")
+        self.assertEqual(leaves[0].count, 1)
+
     def cleanup(self):
         BPF.detach_kprobe("sys_clone")
 
@@ -0,0 +1,103 @@
+#!/usr/bin/env python
+# Copyright (c) PLUMgrid, Inc.
+# Licensed under the Apache License, Version 2.0 (the "License")
+
+# test program for the native desc-driven table formatter
+
+from bcc import BPF
+import ctypes as ct
+import json
+from unittest import main, TestCase
+
+text = """
+struct key_t {
+    u32 pid;
+    char comm[8];
+};
+struct leaf_t {
+    u64 count;
+    int delta;
+    u32 flag:1, level:7;
+    short hist[2];
+};
+BPF_HASH(stats, struct key_t, struct leaf_t);
+BPF_HASH(counts, u64, s64);
+"""
+
+def vm_rss_kb():
+    with open("/proc/self/status") as f:
+        for line in f:
+            if line.startswith("VmRSS:"):
+                return int(line.split()[1])
+
+class TestTableFormat(TestCase):
+    def setUp(self):
+        self.b = BPF(text=text)
+        self.t = self.b["stats"]
+        keys = (self.t.Key * 2)()
+        leaves = (self.t.Leaf * 2)()
+        for i in range(2):
+            keys[i].pid = 100 + i
+            keys[i].comm = b"a\"b" if i else b"bash"
+            leaves[i].count = 1 << 40
+            leaves[i].delta = -i
+            leaves[i].flag = 1
+            leaves[i].level = 42
+            leaves[i].hist[0] = 3
+            leaves[i].hist[1] = -3
+        self.keys = keys
+        self.leaves = leaves
+
+    def test_json(self):
+        out = self.t.format_records(self.keys, self.leaves, "json")
+        lines = [json.loads(l) for l in out.decode().splitlines()]
+        self.assertEqual(len(lines), 2)
+        self.assertEqual(lines[1]["key"], {"pid": 101, "comm": "a\"b"})
+        self.assertEqual(lines[1]["leaf"], {"count": 1 << 40, "delta": -1,
+            "flag": 1, "level": 42, "hist": [3, -3]})
+
+    def test_csv(self):
+        out = self.t.format_records(self.keys, self.leaves, "csv", header=True)
+        lines = out.decode().splitlines()
+        self.assertEqual(lines[0], "key.pid,key.comm,leaf.count,leaf.delta,"
+                "leaf.flag,leaf.level,leaf.hist[0],leaf.hist[1]")
+        self.assertEqual(lines[1], "100,\"bash\",1099511627776,0,1,42,3,-3")
+        self.assertEqual(lines[2], "101,\"a\"\"b\",1099511627776,-1,1,42,3,-3")
+
+    def test_text(self):
+        out = self.t.format_records(keys=self.keys, fmt="text")
+        self.assertEqual(out.splitlines()[0],
+                b"{ 0x64 [ 0x62 0x61 0x73 0x68 0x0 0x0 0x0 0x0 ] }")
+
+    def test_small_buffer(self):
+        # more output than the initial buffer, formatted in several calls
+        c = self.b["counts"]
+        n = 20000
+        keys = (c.Key * n)(*range(n))
+        leaves = (c.Leaf * n)(*[-i for i in range(n)])
+        lines = c.format_records(keys, leaves, "csv").splitlines()
+        self.assertEqual(len(lines), n)
+        self.assertEqual(lines[-1], b"19999,-19999")
+
+    def test_dump(self):
+        self.t[self.keys[0]] = self.leaves[0]
+        self.assertEqual(json.loads(self.t.dump("json").decode())["key"]["comm"],
+                "bash")
+
+    def test_compact(self):
+        before = self.t.key_sprintf(self.keys[1])
+        rss = vm_rss_kb()
+        self.b.compact()
+        # the LLVM context and JIT engines are given back to the OS
+        self.assertLess(vm_rss_kb(), rss)
+        # the desc-driven formatter takes over from the JIT'd helpers
+        self.assertEqual(self.t.key_sprintf(self.keys[1]), before)
+        key = self.t.key_scanf(before)
+        self.assertEqual((key.pid, key.comm), (101, b"a\"b"))
+        leaf = self.t.leaf_scanf(self.t.leaf_sprintf(self.leaves[1]))
+        self.assertEqual((leaf.delta, leaf.level, leaf.hist[1]), (-1, 42, -3))
+        self.t[self.keys[0]] = self.leaves[0]
+        self.assertEqual(len(self.t), 1)
+
+if __name__ == "__main__":
+    main()
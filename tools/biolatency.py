@@ -94,13 +94,14 @@ else:
     label = "usecs"
 if args.disks:
     bpf_text = bpf_text.replace('STORAGE',
-        'BPF_HISTOGRAM(dist, disk_key_t);')
+        'BPF_TABLE_SWAP("histogram", disk_key_t, u64, dist, 64);')
     bpf_text = bpf_text.replace('STORE',
         'disk_key_t key = {.slot = bpf_log2l(delta)}; ' +
         'bpf_probe_read(&key.disk, sizeof(key.disk), ' +
         'req->rq_disk->disk_name); dist.increment(key);')
 else:
-    bpf_text = bpf_text.replace('STORAGE', 'BPF_HISTOGRAM(dist);')
+    bpf_text = bpf_text.replace('STORAGE',
+        'BPF_TABLE_SWAP("histogram", int, u64, dist, 64);')
     bpf_text = bpf_text.replace('STORE',
         'dist.increment(bpf_log2l(delta));')
 if debug:
@@ -131,8 +132,8 @@ while (1):
     if args.timestamp:
         print("%-8s\n" % strftime("%H:%M:%S"), end="")
 
-    dist.print_log2_hist(label, "disk")
-    dist.clear()
+    # the program goes on in the other copy while this one is printed
+    dist.swap().print_log2_hist(label, "disk")
 
     countdown -= 1
     if exiting or countdown == 0:
@@ -130,12 +130,13 @@ else:
     label = "usecs"
 if args.pids:
     bpf_text = bpf_text.replace('STORAGE',
-        'BPF_HISTOGRAM(dist, pid_key_t);')
+        'BPF_TABLE_SWAP("histogram", pid_key_t, u64, dist, 64);')
     bpf_text = bpf_text.replace('STORE',
         'pid_key_t key = {.pid = pid, .slot = bpf_log2l(delta)}; ' +
         'dist.increment(key);')
 else:
-    bpf_text = bpf_text.replace('STORAGE', 'BPF_HISTOGRAM(dist);')
+    bpf_text = bpf_text.replace('STORAGE',
+        'BPF_TABLE_SWAP("histogram", int, u64, dist, 64);')
     bpf_text = bpf_text.replace('STORE',
         'dist.increment(bpf_log2l(delta));')
 if debug:
@@ -161,8 +162,8 @@ while (1):
     if args.timestamp:
         print("%-8s\n" % strftime("%H:%M:%S"), end="")
 
-    dist.print_log2_hist(label, "pid", section_print_fn=int)
-    dist.clear()
+    # the program goes on in the other copy while this one is printed
+    dist.swap().print_log2_hist(label, "pid", section_print_fn=int)
 
     countdown -= 1
     if exiting or countdown == 0: